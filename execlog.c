@@ -0,0 +1,253 @@
+// execlog - print the structured command log (MINISHELL_LOG_FORMAT=binary) as text
+//
+//   gcc -O2 -o execlog execlog.c
+//   execlog [-f text|classic|jsonl] <log>...
+//
+// text    one aligned line per record with time, pid, status, duration, usage and counters
+// classic the shell's text log format: "<command> : <seconds> sec"
+// jsonl   one JSON object per record
+//
+// Files are mapped and walked unit by unit; output goes through one large buffer.
+// Rotated files (<log>.N, oldest first) can be given in order to read a whole history.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "execlog.h"
+
+/**** CONSTANTS ****/
+#define OUTPUT_BUFFER (1 << 20)
+#define FORMAT_TEXT 0
+#define FORMAT_CLASSIC 1
+#define FORMAT_JSONL 2
+
+/**** FUNCTION PROTOTYPES ****/
+int read_log(const char *path, int format);
+size_t record_command(const char *units, const ExecLogRecord *rec, char *out);
+void print_record(const ExecLogRecord *rec, const ExecLogPerf *perf, const char *command, size_t len, int format);
+void print_json_string(const char *str, size_t len);
+const char* format_status(int status, char *buf, size_t size);
+
+/**** GLOBAL VARIABLES ****/
+long records_read = 0;     // Records printed
+long units_skipped = 0;    // Units that did not belong to a complete record
+
+// Parse options and print every file given
+int main(int argc, char *argv[]) {
+    int format = FORMAT_TEXT;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        if (strcmp(argv[2], "text") == 0) format = FORMAT_TEXT;
+        else if (strcmp(argv[2], "classic") == 0) format = FORMAT_CLASSIC;
+        else if (strcmp(argv[2], "jsonl") == 0) format = FORMAT_JSONL;
+        else {
+            fprintf(stderr, "ERR: unknown format %s\n", argv[2]);
+            return 1;
+        }
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "Usage: %s [-f text|classic|jsonl] <log>...\n", argv[0]);
+        return 1;
+    }
+
+    static char buffer[OUTPUT_BUFFER];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    int failed = 0;
+    for (int i = first; i < argc; i++) {
+        failed |= read_log(argv[i], format) != 0;
+    }
+    fflush(stdout);
+
+    if (units_skipped > 0) {
+        fprintf(stderr, "execlog: skipped %ld units that did not form complete records\n", units_skipped);
+    }
+    return failed;
+}
+
+// Map one log file and print its records
+int read_log(const char *path, int format) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ExecLogFileHeader)) {
+        fprintf(stderr, "ERR: %s: not a command log\n", path);
+        close(fd);
+        return -1;
+    }
+
+    const char *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    madvise((void*)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    ExecLogFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, EXECLOG_FILE_MAGIC, sizeof(header.magic)) != 0 || header.unit_size != EXECLOG_UNIT) {
+        fprintf(stderr, "ERR: %s: not a command log\n", path);
+        munmap((void*)data, (size_t)st.st_size);
+        return -1;
+    }
+    if (header.version < 1 || header.version > EXECLOG_VERSION) {
+        fprintf(stderr, "ERR: %s: log version %u, this reader understands 1 to %d\n",
+                path, header.version, EXECLOG_VERSION);
+        munmap((void*)data, (size_t)st.st_size);
+        return -1;
+    }
+
+    size_t units = (size_t)st.st_size / EXECLOG_UNIT;
+    char command[EXECLOG_UNIT * 64];
+
+    // A record is used only if all of its units are present and of the expected kind;
+    // anything else is skipped a unit at a time until the next record start
+    for (size_t u = 1; u < units; ) {
+        const char *unit = data + u * EXECLOG_UNIT;
+        ExecLogRecord rec;
+        memcpy(&rec, unit, sizeof(rec));
+
+        int valid = rec.magic == EXECLOG_RECORD_MAGIC && rec.units >= 1 && u + rec.units <= units &&
+                    rec.units == execlog_record_units(rec.command_len, rec.flags) &&
+                    (size_t)rec.units * EXECLOG_UNIT <= sizeof(command) &&
+                    execlog_record_complete(unit, &rec);
+        if (!valid) {
+            units_skipped++;
+            u++;
+            continue;
+        }
+
+        ExecLogPerf perf;
+        if (rec.flags & EXECLOG_F_PERF) memcpy(&perf, unit + (rec.units - 1) * EXECLOG_UNIT, sizeof(perf));
+
+        size_t len = record_command(unit, &rec, command);
+        print_record(&rec, rec.flags & EXECLOG_F_PERF ? &perf : NULL, command, len, format);
+        records_read++;
+        u += rec.units;
+    }
+
+    munmap((void*)data, (size_t)st.st_size);
+    return 0;
+}
+
+// Gather the command text of a record from its units; returns its length
+size_t record_command(const char *units, const ExecLogRecord *rec, char *out) {
+    size_t len = rec->command_len;
+    size_t first = len < sizeof(rec->command) ? len : sizeof(rec->command);
+    memcpy(out, rec->command, first);
+
+    size_t used = first;
+    for (uint32_t k = 1; used < len; k++) {
+        const ExecLogCont *cont = (const ExecLogCont*)(units + k * EXECLOG_UNIT);
+        size_t n = len - used < sizeof(cont->command) ? len - used : sizeof(cont->command);
+        memcpy(out + used, cont->command, n);
+        used += n;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// "exit N" or "signal N" for a raw wait status
+const char* format_status(int status, char *buf, size_t size) {
+    if (WIFSIGNALED(status)) snprintf(buf, size, "signal %d", WTERMSIG(status));
+    else snprintf(buf, size, "exit %d", WEXITSTATUS(status));
+    return buf;
+}
+
+// Print one record in the chosen format; perf is NULL when it has no counters
+void print_record(const ExecLogRecord *rec, const ExecLogPerf *perf, const char *command, size_t len, int format) {
+    static time_t cached_second = -1;
+    static char cached_stamp[32];
+
+    if (format == FORMAT_CLASSIC) {
+        printf("%s : %.5f sec\n", command, rec->duration_ns / 1e9);
+        return;
+    }
+
+    int pipe = (rec->flags & EXECLOG_F_PIPE) != 0;
+    int status = pipe ? rec->status2 : rec->status;
+
+    if (format == FORMAT_JSONL) {
+        printf("{\"wall_ns\":%lld,\"mono_ns\":%lld,\"duration_ns\":%lld,\"pid\":%d,\"status\":%d",
+               (long long)rec->wall_ns, (long long)rec->mono_ns, (long long)rec->duration_ns,
+               rec->pid, rec->status);
+        if (pipe) printf(",\"pid2\":%d,\"status2\":%d", rec->pid2, rec->status2);
+        if (rec->flags & EXECLOG_F_BACKGROUND) printf(",\"background\":true");
+        if (rec->flags & EXECLOG_F_TRUNCATED) printf(",\"truncated\":true");
+        if (rec->flags & EXECLOG_F_RUSAGE) {
+            printf(",\"utime_us\":%lld,\"stime_us\":%lld,\"maxrss_kb\":%lld,\"minflt\":%u,\"majflt\":%u,"
+                   "\"nvcsw\":%u,\"nivcsw\":%u",
+                   (long long)rec->utime_us, (long long)rec->stime_us, (long long)rec->maxrss_kb,
+                   rec->minflt, rec->majflt, rec->nvcsw, rec->nivcsw);
+        }
+        if (perf != NULL && perf->kind == EXECLOG_PERF_HARDWARE) {
+            printf(",\"cycles\":%llu,\"instructions\":%llu,\"cache_misses\":%llu,\"branch_misses\":%llu",
+                   (unsigned long long)perf->values[0], (unsigned long long)perf->values[1],
+                   (unsigned long long)perf->values[2], (unsigned long long)perf->values[3]);
+        } else if (perf != NULL && perf->kind == EXECLOG_PERF_SOFTWARE) {
+            printf(",\"task_clock_ns\":%llu,\"context_switches\":%llu,\"page_faults\":%llu,\"cpu_migrations\":%llu",
+                   (unsigned long long)perf->values[0], (unsigned long long)perf->values[1],
+                   (unsigned long long)perf->values[2], (unsigned long long)perf->values[3]);
+        }
+        printf(",\"command\":");
+        print_json_string(command, len);
+        printf("}\n");
+        return;
+    }
+
+    // Formatting the wall clock is the slow part; records mostly share their second
+    time_t second = (time_t)(rec->wall_ns / 1000000000LL);
+    if (second != cached_second) {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        strftime(cached_stamp, sizeof(cached_stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_second = second;
+    }
+
+    char status_text[32];
+    printf("%s.%06lld %7d %-10s %12.6f s", cached_stamp, (long long)(rec->wall_ns % 1000000000LL / 1000),
+           rec->pid, format_status(status, status_text, sizeof(status_text)), rec->duration_ns / 1e9);
+    if (rec->flags & EXECLOG_F_RUSAGE) {
+        printf(" %9.3f user %9.3f sys %8lld KB", rec->utime_us / 1e6, rec->stime_us / 1e6,
+               (long long)rec->maxrss_kb);
+    }
+    if (perf != NULL && perf->kind == EXECLOG_PERF_HARDWARE) {
+        printf(" %5.2f IPC %9llu cache-miss %9llu branch-miss",
+               perf->values[0] ? (double)perf->values[1] / perf->values[0] : 0.0,
+               (unsigned long long)perf->values[2], (unsigned long long)perf->values[3]);
+    } else if (perf != NULL && perf->kind == EXECLOG_PERF_SOFTWARE) {
+        printf(" %9.3f ms cpu %6llu csw", perf->values[0] / 1e6, (unsigned long long)perf->values[1]);
+    }
+    printf("%s  %s\n", rec->flags & EXECLOG_F_BACKGROUND ? " &" : "", command);
+}
+
+// Print a JSON string literal
+void print_json_string(const char *str, size_t len) {
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
@@ -0,0 +1,104 @@
+// On-disk format of the structured command log (MINISHELL_LOG_FORMAT=binary).
+// Shared by the shell (shitTest.c), which writes it, and execlog.c, which reads it.
+//
+// A file is a header unit followed by records. Every record is a whole number of
+// EXECLOG_UNIT byte units: a start unit holding the fixed fields and the first bytes
+// of the command, then continuation units holding the rest of the command, then (with
+// EXECLOG_F_PERF) a unit of performance counters. Readers can therefore step through a
+// file (or any unit-aligned slice of it) without parsing text.
+#ifndef EXECLOG_H
+#define EXECLOG_H
+
+#include <stdint.h>
+
+#define EXECLOG_FILE_MAGIC "MSHEXEC1"
+#define EXECLOG_VERSION 2                // Bump on any layout change (2: counter units)
+#define EXECLOG_UNIT 128
+#define EXECLOG_RECORD_MAGIC 0x5243584du // "MXCR": first unit of a record
+#define EXECLOG_CONT_MAGIC 0x544e4f43u   // "CONT": continuation unit
+#define EXECLOG_PERF_MAGIC 0x46524550u   // "PERF": counter unit, last in its record
+
+// Record flags
+#define EXECLOG_F_RUSAGE 1               // Resource usage fields are valid
+#define EXECLOG_F_PIPE 2                 // Two-command pipeline: pid2/status2 set, usage summed
+#define EXECLOG_F_BACKGROUND 4           // Background command, reaped asynchronously
+#define EXECLOG_F_TRUNCATED 8            // Command text was cut to fit the record
+#define EXECLOG_F_PERF 16                // Ends with an ExecLogPerf unit
+
+// ExecLogPerf kinds and what their values count
+#define EXECLOG_PERF_HARDWARE 1          // Cycles, instructions, cache misses, branch misses
+#define EXECLOG_PERF_SOFTWARE 2          // Task clock (ns), context switches, page faults, CPU migrations
+
+// First unit of a file
+typedef struct {
+    char magic[8];                       // EXECLOG_FILE_MAGIC
+    uint32_t version;
+    uint32_t unit_size;                  // EXECLOG_UNIT
+    int64_t created_ns;                  // CLOCK_REALTIME when the file was started
+    char reserved[EXECLOG_UNIT - 24];
+} ExecLogFileHeader;
+
+// First unit of a record
+typedef struct {
+    uint32_t magic;                      // EXECLOG_RECORD_MAGIC
+    uint16_t units;                      // Units in the record, this one included
+    uint16_t flags;                      // EXECLOG_F_*
+    uint32_t command_len;                // Bytes of command text across all units
+    int32_t status;                      // Raw wait status of the (left) command
+    int32_t status2;                     // and of the right command of a pipeline
+    int32_t pid;
+    int32_t pid2;
+    uint32_t reserved;
+    int64_t mono_ns;                     // CLOCK_MONOTONIC when the command finished
+    int64_t wall_ns;                     // CLOCK_REALTIME at the same moment
+    int64_t duration_ns;                 // From reading the line to the command finishing
+    int64_t utime_us;                    // Resource usage of the child(ren)
+    int64_t stime_us;
+    int64_t maxrss_kb;
+    uint32_t minflt;
+    uint32_t majflt;
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+    char command[EXECLOG_UNIT - 96];     // Start of the command text (not NUL-terminated)
+} ExecLogRecord;
+
+// Remaining units of a record
+typedef struct {
+    uint32_t magic;                      // EXECLOG_CONT_MAGIC
+    char command[EXECLOG_UNIT - 4];
+} ExecLogCont;
+
+// Performance counters of the command's process(es), summed over a pipeline
+typedef struct {
+    uint32_t magic;                      // EXECLOG_PERF_MAGIC
+    uint32_t kind;                       // EXECLOG_PERF_*
+    uint64_t values[4];
+    char reserved[EXECLOG_UNIT - 40];
+} ExecLogPerf;
+
+_Static_assert(sizeof(ExecLogFileHeader) == EXECLOG_UNIT, "execlog header must fill one unit");
+_Static_assert(sizeof(ExecLogRecord) == EXECLOG_UNIT, "execlog record must fill one unit");
+_Static_assert(sizeof(ExecLogCont) == EXECLOG_UNIT, "execlog continuation must fill one unit");
+_Static_assert(sizeof(ExecLogPerf) == EXECLOG_UNIT, "execlog counters must fill one unit");
+
+// Units needed for a record whose command is len bytes long
+static inline uint32_t execlog_record_units(uint32_t len, uint32_t flags) {
+    uint32_t first = sizeof(((ExecLogRecord*)0)->command);
+    uint32_t rest = sizeof(((ExecLogCont*)0)->command);
+    uint32_t perf = (flags & EXECLOG_F_PERF) ? 1 : 0;
+    return (len <= first ? 1 : 1 + (len - first + rest - 1) / rest) + perf;
+}
+
+// Whether the units after a record's start unit are what its header says: all
+// continuations, except a counter unit at the end with EXECLOG_F_PERF
+static inline int execlog_record_complete(const char *start, const ExecLogRecord *rec) {
+    for (uint32_t k = 1; k < rec->units; k++) {
+        uint32_t magic;
+        __builtin_memcpy(&magic, start + k * EXECLOG_UNIT, sizeof(magic));
+        int perf = (rec->flags & EXECLOG_F_PERF) && k == rec->units - 1u;
+        if (magic != (perf ? EXECLOG_PERF_MAGIC : EXECLOG_CONT_MAGIC)) return 0;
+    }
+    return 1;
+}
+
+#endif
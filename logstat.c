@@ -0,0 +1,570 @@
+// logstat - summarize command logs: per-command percentiles, a run time histogram
+// and the slowest runs
+//
+//   gcc -O2 -pthread -o logstat logstat.c
+//   logstat [-j threads] [-n N] [-k name|line] <log>...
+//
+// -j  worker threads (default: one per online CPU)
+// -n  commands and slowest runs listed (default 20)
+// -k  group by command name (default) or by the whole command line
+//
+// Both log formats are read: the text "<command> : <seconds> sec" lines and the
+// structured MINISHELL_LOG_FORMAT=binary files (execlog.h), told apart by the file
+// header, so rotated histories of either kind can be given together. Files are mapped
+// and cut into chunks that the workers take in turn: text chunks end on a newline and
+// binary chunks on a unit boundary. Each worker keeps its own tables, merged at the end.
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "execlog.h"
+
+/**** CONSTANTS ****/
+#define CHUNK_SIZE (16 << 20)      // Bytes per unit of work
+#define MAX_THREADS 256
+#define SKETCH_SUB_BITS 3          // Latency sketch: 8 buckets per power of two (under 7% error)
+#define SKETCH_BUCKETS ((40 - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) // Covers up to 2^40 us
+#define HISTOGRAM_OCTAVES 41       // Powers of two of microseconds in the histogram
+#define SLOW_COMMAND_MAX 160       // Bytes of command text kept per slowest run
+#define KEY_NAME 0
+#define KEY_LINE 1
+
+/**** TYPES ****/
+// One mapped input file
+typedef struct {
+    const char *path;
+    const char *data;
+    size_t size;
+    int binary;                    // execlog.h file rather than text lines
+} LogFile;
+
+// A slice of a file for one worker: [begin, end) in bytes
+typedef struct {
+    int file;
+    size_t begin;
+    size_t end;
+} Chunk;
+
+// Aggregates for one command
+typedef struct {
+    uint64_t hash;
+    char *key;                     // NULL when the slot is free
+    uint32_t key_len;
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint32_t sketch[SKETCH_BUCKETS];
+} CommandEntry;
+
+// Open addressing table of CommandEntry, grown at 1/2 full
+typedef struct {
+    CommandEntry *slots;
+    uint32_t capacity;             // Power of two
+    uint32_t used;
+} CommandTable;
+
+// One of the slowest runs seen
+typedef struct {
+    uint64_t us;
+    char command[SLOW_COMMAND_MAX];
+} SlowRun;
+
+// Per-thread results
+typedef struct {
+    pthread_t thread;
+    CommandTable table;
+    uint64_t histogram[HISTOGRAM_OCTAVES];
+    SlowRun *slowest;              // Min-heap on us, at most top entries
+    int slow_count;
+    uint64_t records;
+    uint64_t malformed;            // Text lines or binary units that were not records
+    uint64_t bytes;
+} Worker;
+
+/**** FUNCTION PROTOTYPES ****/
+int map_log(const char *path, LogFile *file);
+void* worker_main(void *arg);
+void parse_text_chunk(Worker *w, const LogFile *file, size_t begin, size_t end);
+void parse_binary_chunk(Worker *w, const LogFile *file, size_t begin, size_t end);
+void record_run(Worker *w, const char *command, size_t len, uint64_t us);
+CommandEntry* table_find(CommandTable *table, const char *key, uint32_t len, uint64_t hash);
+void table_merge(CommandTable *into, const CommandEntry *entry);
+uint64_t sketch_quantile(const CommandEntry *entry, double q);
+void slow_push(SlowRun *heap, int *count, int top, uint64_t us, const char *command, size_t len);
+void print_report(Worker *total, double seconds, uint64_t bytes);
+
+/**** GLOBAL VARIABLES ****/
+LogFile *files = NULL;             // Inputs
+int file_count = 0;
+Chunk *chunks = NULL;              // Work list, taken in order
+int chunk_count = 0;
+int next_chunk = 0;                // Next chunk a worker will take
+int top = 20;                      // -n
+int key_mode = KEY_NAME;           // -k
+
+// Parse options, map the inputs, cut them into chunks and run the workers
+int main(int argc, char *argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, usage = 0;
+
+    while ((opt = getopt(argc, argv, "j:n:k:")) != -1) {
+        if (opt == 'j') threads = strtol(optarg, NULL, 10);
+        else if (opt == 'n') top = (int)strtol(optarg, NULL, 10);
+        else if (opt == 'k' && strcmp(optarg, "name") == 0) key_mode = KEY_NAME;
+        else if (opt == 'k' && strcmp(optarg, "line") == 0) key_mode = KEY_LINE;
+        else usage = 1;
+    }
+    if (usage || optind >= argc || threads <= 0 || top <= 0) {
+        fprintf(stderr, "Usage: %s [-j threads] [-n N] [-k name|line] <log>...\n", argv[0]);
+        return 1;
+    }
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    files = calloc((size_t)(argc - optind), sizeof(LogFile));
+    uint64_t bytes = 0;
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        if (map_log(argv[i], &files[file_count]) != 0) {
+            failed = 1;
+            continue;
+        }
+        bytes += files[file_count].size;
+        file_count++;
+    }
+
+    // Enough chunks that every worker gets several, none larger than CHUNK_SIZE
+    size_t chunk_size = bytes / ((uint64_t)threads * 4) + 1;
+    if (chunk_size > CHUNK_SIZE) chunk_size = CHUNK_SIZE;
+    chunk_size = (chunk_size + EXECLOG_UNIT - 1) / EXECLOG_UNIT * EXECLOG_UNIT;
+
+    int chunk_capacity = 16;
+    chunks = malloc(chunk_capacity * sizeof(Chunk));
+    for (int f = 0; f < file_count; f++) {
+        size_t start = files[f].binary ? sizeof(ExecLogFileHeader) : 0;
+        for (size_t off = start; off < files[f].size; off += chunk_size) {
+            if (chunk_count == chunk_capacity) {
+                chunk_capacity *= 2;
+                chunks = realloc(chunks, chunk_capacity * sizeof(Chunk));
+            }
+            chunks[chunk_count].file = f;
+            chunks[chunk_count].begin = off;
+            chunks[chunk_count].end = off + chunk_size < files[f].size ? off + chunk_size : files[f].size;
+            chunk_count++;
+        }
+    }
+    if (threads > chunk_count) threads = chunk_count > 0 ? chunk_count : 1;
+
+    Worker *workers = calloc((size_t)threads, sizeof(Worker));
+    for (long t = 0; t < threads; t++) {
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            fprintf(stderr, "ERR: could not start worker threads\n");
+            return 1;
+        }
+    }
+
+    // Merge everything into the first worker's tables
+    Worker *total = &workers[0];
+    pthread_join(total->thread, NULL);
+    for (long t = 1; t < threads; t++) {
+        Worker *w = &workers[t];
+        pthread_join(w->thread, NULL);
+        for (uint32_t s = 0; s < w->table.capacity; s++) {
+            if (w->table.slots[s].key) table_merge(&total->table, &w->table.slots[s]);
+        }
+        for (int o = 0; o < HISTOGRAM_OCTAVES; o++) total->histogram[o] += w->histogram[o];
+        for (int i = 0; i < w->slow_count; i++) {
+            slow_push(total->slowest, &total->slow_count, top, w->slowest[i].us, w->slowest[i].command,
+                      strlen(w->slowest[i].command));
+        }
+        total->records += w->records;
+        total->malformed += w->malformed;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_report(total, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, bytes);
+    return failed;
+}
+
+// Map a log and tell its format from the header
+int map_log(const char *path, LogFile *file) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    file->path = path;
+    file->size = (size_t)st.st_size;
+    file->data = NULL;
+    if (file->size > 0) {
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        madvise((void*)file->data, file->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+    close(fd);
+
+    file->binary = file->size >= sizeof(ExecLogFileHeader) &&
+                   memcmp(file->data, EXECLOG_FILE_MAGIC, strlen(EXECLOG_FILE_MAGIC)) == 0;
+    if (file->binary) {
+        ExecLogFileHeader header;
+        memcpy(&header, file->data, sizeof(header));
+        if (header.version < 1 || header.version > EXECLOG_VERSION || header.unit_size != EXECLOG_UNIT) {
+            fprintf(stderr, "ERR: %s: log version %u, this reader understands 1 to %d\n",
+                    path, header.version, EXECLOG_VERSION);
+            munmap((void*)file->data, file->size);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Take chunks until none are left
+void* worker_main(void *arg) {
+    Worker *w = arg;
+    w->table.capacity = 1024;
+    w->table.slots = calloc(w->table.capacity, sizeof(CommandEntry));
+    w->slowest = calloc((size_t)top, sizeof(SlowRun));
+
+    for (;;) {
+        int c = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+        if (c >= chunk_count) break;
+
+        const LogFile *file = &files[chunks[c].file];
+        if (file->binary) parse_binary_chunk(w, file, chunks[c].begin, chunks[c].end);
+        else parse_text_chunk(w, file, chunks[c].begin, chunks[c].end);
+        w->bytes += chunks[c].end - chunks[c].begin;
+    }
+    return NULL;
+}
+
+// Parse the text lines that start in [begin, end). A line belongs to the chunk its
+// first byte is in, so a chunk skips a partial first line and finishes its last one
+void parse_text_chunk(Worker *w, const LogFile *file, size_t begin, size_t end) {
+    const char *data = file->data;
+    const char *limit = data + file->size;
+    const char *p = data + begin;
+
+    if (begin > 0 && data[begin - 1] != '\n') {
+        const char *nl = memchr(p, '\n', (size_t)(limit - p));
+        if (nl == NULL) return;
+        p = nl + 1;
+    }
+
+    while (p < data + end) {
+        const char *nl = memchr(p, '\n', (size_t)(limit - p));
+        const char *line_end = nl ? nl : limit;
+
+        // "<command> : <seconds> sec", read from the right since commands may hold " : "
+        const char *q = line_end;
+        if (q > p && q[-1] == '\r') q--;
+        if (q - p < 8 || memcmp(q - 4, " sec", 4) != 0) {
+            if (line_end > p) w->malformed++;
+            p = line_end + 1;
+            continue;
+        }
+        q -= 4;
+
+        uint64_t whole = 0, frac = 0, scale = 1000000;
+        const char *num = q;
+        while (num > p && ((num[-1] >= '0' && num[-1] <= '9') || num[-1] == '.')) num--;
+        const char *d = num;
+        for (; d < q && *d != '.'; d++) whole = whole * 10 + (uint64_t)(*d - '0');
+        if (d < q) d++;
+        for (; d < q && *d != '.'; d++) {
+            scale /= 10;
+            if (scale > 0) frac += (uint64_t)(*d - '0') * scale;
+        }
+
+        if (num == q || d != q || num - p < 3 || memcmp(num - 3, " : ", 3) != 0) {
+            w->malformed++;
+            p = line_end + 1;
+            continue;
+        }
+
+        record_run(w, p, (size_t)(num - 3 - p), whole * 1000000 + frac);
+        p = line_end + 1;
+    }
+}
+
+// Parse the records that start in the units of [begin, end). A record may run into
+// the next chunk; that chunk skips its continuation and counter units
+void parse_binary_chunk(Worker *w, const LogFile *file, size_t begin, size_t end) {
+    size_t units = file->size / EXECLOG_UNIT;
+    char command[EXECLOG_UNIT * 64];
+
+    size_t last = end / EXECLOG_UNIT < units ? end / EXECLOG_UNIT : units;
+
+    for (size_t u = begin / EXECLOG_UNIT; u < last; ) {
+        const char *unit = file->data + u * EXECLOG_UNIT;
+        ExecLogRecord rec;
+        memcpy(&rec, unit, sizeof(rec));
+
+        if (rec.magic == EXECLOG_CONT_MAGIC || rec.magic == EXECLOG_PERF_MAGIC) {
+            u++;
+            continue;
+        }
+        int valid = rec.magic == EXECLOG_RECORD_MAGIC && rec.units >= 1 && u + rec.units <= units &&
+                    rec.units == execlog_record_units(rec.command_len, rec.flags) &&
+                    (size_t)rec.units * EXECLOG_UNIT <= sizeof(command) &&
+                    execlog_record_complete(unit, &rec);
+        if (!valid) {
+            w->malformed++;
+            u++;
+            continue;
+        }
+
+        size_t len = rec.command_len;
+        size_t first = len < sizeof(rec.command) ? len : sizeof(rec.command);
+        memcpy(command, rec.command, first);
+        for (size_t used = first, k = 1; used < len; k++) {
+            const ExecLogCont *cont = (const ExecLogCont*)(unit + k * EXECLOG_UNIT);
+            size_t n = len - used < sizeof(cont->command) ? len - used : sizeof(cont->command);
+            memcpy(command + used, cont->command, n);
+            used += n;
+        }
+
+        record_run(w, command, len, rec.duration_ns > 0 ? (uint64_t)rec.duration_ns / 1000 : 0);
+        u += rec.units;
+    }
+}
+
+// Sketch bucket of a run time: exact below 2^SKETCH_SUB_BITS us, then
+// 2^SKETCH_SUB_BITS buckets per power of two
+static uint32_t sketch_bucket(uint64_t us) {
+    if (us >= (1ULL << 40)) us = (1ULL << 40) - 1;
+    if (us < (1u << SKETCH_SUB_BITS)) return (uint32_t)us;
+
+    int e = 63 - __builtin_clzll(us);
+    return (uint32_t)((e - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) +
+           (uint32_t)((us >> (e - SKETCH_SUB_BITS)) & ((1u << SKETCH_SUB_BITS) - 1));
+}
+
+// Middle of the run times a sketch bucket holds
+static uint64_t sketch_bucket_value(uint32_t bucket) {
+    if (bucket < (1u << SKETCH_SUB_BITS)) return bucket;
+
+    int e = (int)(bucket >> SKETCH_SUB_BITS) + SKETCH_SUB_BITS - 1;
+    uint64_t low = ((uint64_t)(1u << SKETCH_SUB_BITS) + (bucket & ((1u << SKETCH_SUB_BITS) - 1))) << (e - SKETCH_SUB_BITS);
+    return low + (1ULL << (e - SKETCH_SUB_BITS)) / 2;
+}
+
+// FNV-1a hash of a byte range
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Count one run of a command in the worker's tables
+void record_run(Worker *w, const char *command, size_t len, uint64_t us) {
+    size_t key_len = len;
+    if (key_mode == KEY_NAME) {
+        const char *space = memchr(command, ' ', len);
+        if (space) key_len = (size_t)(space - command);
+    }
+
+    CommandEntry *entry = table_find(&w->table, command, (uint32_t)key_len, hash_bytes(command, key_len));
+    entry->count++;
+    entry->total_us += us;
+    if (us < entry->min_us) entry->min_us = us;
+    if (us > entry->max_us) entry->max_us = us;
+    entry->sketch[sketch_bucket(us)]++;
+
+    int octave = us ? 64 - __builtin_clzll(us) : 0;     // Row o holds [2^(o-1), 2^o) us
+    w->histogram[octave < HISTOGRAM_OCTAVES ? octave : HISTOGRAM_OCTAVES - 1]++;
+    w->records++;
+    if (w->slow_count < top || us > w->slowest[0].us) slow_push(w->slowest, &w->slow_count, top, us, command, len);
+}
+
+// Entry for a key, added if missing
+CommandEntry* table_find(CommandTable *table, const char *key, uint32_t len, uint64_t hash) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t slot = (uint32_t)hash & mask;
+
+    while (table->slots[slot].key) {
+        CommandEntry *entry = &table->slots[slot];
+        if (entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0) return entry;
+        slot = (slot + 1) & mask;
+    }
+
+    if ((table->used + 1) * 2 > table->capacity) {
+        CommandTable grown = {calloc((size_t)table->capacity * 2, sizeof(CommandEntry)), table->capacity * 2, 0};
+        for (uint32_t s = 0; s < table->capacity; s++) {
+            const CommandEntry *old = &table->slots[s];
+            if (old->key == NULL) continue;
+            uint32_t to = (uint32_t)old->hash & (grown.capacity - 1);
+            while (grown.slots[to].key) to = (to + 1) & (grown.capacity - 1);
+            grown.slots[to] = *old;
+            grown.used++;
+        }
+        free(table->slots);
+        *table = grown;
+        return table_find(table, key, len, hash);
+    }
+
+    CommandEntry *entry = &table->slots[slot];
+    entry->hash = hash;
+    entry->key = malloc(len + 1);
+    memcpy(entry->key, key, len);
+    entry->key[len] = '\0';
+    entry->key_len = len;
+    entry->min_us = UINT64_MAX;
+    table->used++;
+    return entry;
+}
+
+// Add another worker's entry into a table
+void table_merge(CommandTable *into, const CommandEntry *entry) {
+    CommandEntry *to = table_find(into, entry->key, entry->key_len, entry->hash);
+    to->count += entry->count;
+    to->total_us += entry->total_us;
+    if (entry->min_us < to->min_us) to->min_us = entry->min_us;
+    if (entry->max_us > to->max_us) to->max_us = entry->max_us;
+    for (int b = 0; b < SKETCH_BUCKETS; b++) to->sketch[b] += entry->sketch[b];
+}
+
+// Run time (us) below which a fraction q of the runs finished, clamped to the
+// exact minimum and maximum
+uint64_t sketch_quantile(const CommandEntry *entry, double q) {
+    uint64_t rank = (uint64_t)(q * entry->count + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < SKETCH_BUCKETS; b++) {
+        seen += entry->sketch[b];
+        if (seen >= rank) {
+            uint64_t value = sketch_bucket_value(b);
+            if (value < entry->min_us) value = entry->min_us;
+            if (value > entry->max_us) value = entry->max_us;
+            return value;
+        }
+    }
+    return entry->max_us;
+}
+
+// Keep a run among the top slowest: a min-heap, so the fastest kept run is at [0]
+void slow_push(SlowRun *heap, int *count, int limit, uint64_t us, const char *command, size_t len) {
+    int i;
+    if (*count < limit) {
+        i = (*count)++;
+        while (i > 0 && heap[(i - 1) / 2].us > us) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else {
+        if (us <= heap[0].us) return;
+        i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= *count) break;
+            if (child + 1 < *count && heap[child + 1].us < heap[child].us) child++;
+            if (heap[child].us >= us) break;
+            heap[i] = heap[child];
+            i = child;
+        }
+    }
+
+    if (len >= SLOW_COMMAND_MAX) len = SLOW_COMMAND_MAX - 1;
+    heap[i].us = us;
+    memcpy(heap[i].command, command, len);
+    heap[i].command[len] = '\0';
+}
+
+// Largest total time first
+static int compare_entries(const void *a, const void *b) {
+    const CommandEntry *x = *(const CommandEntry* const*)a, *y = *(const CommandEntry* const*)b;
+    if (x->total_us != y->total_us) return x->total_us > y->total_us ? -1 : 1;
+    return strcmp(x->key, y->key);
+}
+
+// Slowest first
+static int compare_slow_runs(const void *a, const void *b) {
+    const SlowRun *x = a, *y = b;
+    return x->us > y->us ? -1 : (x->us < y->us);
+}
+
+// Print a duration given in microseconds with a unit that keeps it short
+static void print_micros(uint64_t us) {
+    if (us < 1000) printf(" %7lluus", (unsigned long long)us);
+    else if (us < 1000000) printf(" %7.2fms", us / 1e3);
+    else printf(" %8.2fs", us / 1e6);
+}
+
+// Print the command table, the histogram and the slowest runs
+void print_report(Worker *total, double seconds, uint64_t bytes) {
+    CommandTable *table = &total->table;
+    CommandEntry **entries = malloc((table->used + 1) * sizeof(CommandEntry*));
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < table->capacity; s++) {
+        if (table->slots[s].key) entries[count++] = &table->slots[s];
+    }
+    qsort(entries, count, sizeof(CommandEntry*), compare_entries);
+
+    printf("%-24s %10s %10s %9s %9s %9s %9s %9s\n", "command", "count", "total", "avg", "p50", "p90", "p99", "max");
+    for (uint32_t i = 0; i < count && i < (uint32_t)top; i++) {
+        const CommandEntry *e = entries[i];
+        printf("%-24.24s %10llu %9.2fs", e->key, (unsigned long long)e->count, e->total_us / 1e6);
+        print_micros(e->total_us / e->count);
+        print_micros(sketch_quantile(e, 0.50));
+        print_micros(sketch_quantile(e, 0.90));
+        print_micros(sketch_quantile(e, 0.99));
+        print_micros(e->max_us);
+        printf("\n");
+    }
+    if (count > (uint32_t)top) printf("(%u more)\n", count - (uint32_t)top);
+
+    // One row per power of two, from the first to the last that has runs
+    uint64_t peak = 0;
+    int first = -1, last = -1;
+    for (int o = 0; o < HISTOGRAM_OCTAVES; o++) {
+        if (total->histogram[o] == 0) continue;
+        if (first < 0) first = o;
+        last = o;
+        if (total->histogram[o] > peak) peak = total->histogram[o];
+    }
+    if (first >= 0) printf("\nrun time histogram\n");
+    for (int o = first; o >= 0 && o <= last; o++) {
+        uint64_t low = o == 0 ? 0 : 1ULL << (o - 1);
+        int bar = (int)(total->histogram[o] * 50 / peak);
+        printf("  >=");
+        print_micros(low);
+        printf(" |%-50.*s %llu\n", bar, "##################################################",
+               (unsigned long long)total->histogram[o]);
+    }
+
+    qsort(total->slowest, (size_t)total->slow_count, sizeof(SlowRun), compare_slow_runs);
+    if (total->slow_count > 0) printf("\nslowest runs\n");
+    for (int i = 0; i < total->slow_count; i++) {
+        print_micros(total->slowest[i].us);
+        printf("  %s\n", total->slowest[i].command);
+    }
+
+    fprintf(stderr, "logstat: %llu records (%llu malformed) from %d files, %.1f MB in %.3f s (%.2f GB/s)\n",
+            (unsigned long long)total->records, (unsigned long long)total->malformed, file_count,
+            bytes / 1e6, seconds, seconds > 0 ? bytes / 1e9 / seconds : 0.0);
+    free(entries);
+}
@@ -0,0 +1,110 @@
+// USDT probes: static tracepoints for bpftrace, perf and SystemTap. Each probe is a
+// single nop plus an ELF note (.note.stapsdt) naming it and saying where its
+// arguments are, so nothing runs unless a tracer attaches. Uses <sys/sdt.h> when the
+// system has it; otherwise the same notes are emitted here (x86-64 and AArch64 with
+// GCC or Clang). Build with -DMINISHELL_NO_PROBES to leave them out entirely.
+//
+// List them:   readelf -n minishell | grep -A4 stapsdt
+// Check them:  ./probes_check.sh (every probe below present, none with MINISHELL_NO_PROBES)
+// Use them:    bpftrace -e 'usdt:./minishell:minishell:reaped { printf("%d %d\n", arg0, arg1); }'
+//
+// Provider "minishell". The names and arguments below are a stable interface: new
+// probes may be added, existing ones keep their arguments (new ones go at the end).
+//
+//   command_accepted  (char *line, long history_index)
+//       A line was read, history-expanded and is about to be parsed. history_index is
+//       -1 when the line was not stored.
+//   danger_verdict    (char *line, int verdict, char *rule, long rule_id, int token_distance)
+//       A command was checked against the blocklist: verdict 0 allow, 1 warn, 2 block.
+//       rule and rule_id are NULL and -1 on allow; token_distance is set on warn.
+//   spawn             (int pid, char *name, int background)
+//       A child was forked for the named command (after its counters are attached).
+//   reaped            (int pid, int status, long duration_ns)
+//       A child was reaped. status is the raw wait status; duration runs from the line
+//       being read to the child's exit.
+//   rlimit_applied    (char *resource, int resource_id, unsigned long soft, unsigned long hard)
+//       `rlimit set` changed a limit (RLIM_INFINITY for unlimited).
+//   tee_flush         (long bytes, long total_bytes, char *file)
+//       my_tee copied a chunk to stdout and its file (NULL when none).
+//   mcalc_begin       (char *operation, int operands, int rows, int cols)
+//   mcalc_end         (char *operation, int ok, int rows, int cols)
+//       An mcalc calculation over `operands` rows x cols matrices; ok is 0 if it failed.
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+
+#if !defined(MINISHELL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MINISHELL_PROBES_SDT 1
+#elif (defined(__x86_64__) || defined(__aarch64__)) && defined(__GNUC__)
+#define MINISHELL_PROBES_NOTES 1
+#endif
+#endif
+
+#if defined(MINISHELL_PROBES_SDT)
+#include <sys/sdt.h>
+
+#define PROBE0(name) STAP_PROBE(minishell, name)
+#define PROBE1(name, a) STAP_PROBE1(minishell, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(minishell, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(minishell, name, a, b, c)
+#define PROBE4(name, a, b, c, d) STAP_PROBE4(minishell, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) STAP_PROBE5(minishell, name, a, b, c, d, e)
+
+#elif defined(MINISHELL_PROBES_NOTES)
+// The note layout <sys/sdt.h> writes (version 3): probe address, the address of
+// _.stapsdt.base (so tools can correct for prelinking), semaphore address (none),
+// then provider, name and an argument list like "-8@%rax -8@$5". Every argument is
+// passed as a signed 8-byte value
+#define PROBE_ARG_(x) ((int64_t)(intptr_t)(x))
+#define PROBE_ASM_(name, args, ...)                                                     \
+    __asm__ __volatile__("990: nop\n"                                                   \
+                         ".pushsection .note.stapsdt,\"\",\"note\"\n"                   \
+                         ".balign 4\n"                                                  \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                             \
+                         "991: .asciz \"stapsdt\"\n"                                    \
+                         "992: .balign 4\n"                                             \
+                         "993: .8byte 990b\n"                                           \
+                         ".8byte _.stapsdt.base\n"                                      \
+                         ".8byte 0\n"                                                   \
+                         ".asciz \"minishell\"\n"                                       \
+                         ".asciz \"" #name "\"\n"                                       \
+                         ".asciz \"" args "\"\n"                                        \
+                         "994: .balign 4\n"                                             \
+                         ".popsection\n"                                                \
+                         ".ifndef _.stapsdt.base\n"                                     \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+                         ".weak _.stapsdt.base\n"                                       \
+                         ".hidden _.stapsdt.base\n"                                     \
+                         "_.stapsdt.base: .space 1\n"                                   \
+                         ".size _.stapsdt.base, 1\n"                                    \
+                         ".popsection\n"                                                \
+                         ".endif\n"                                                     \
+                         :: __VA_ARGS__)
+
+#define PROBE0(name) PROBE_ASM_(name, "")
+#define PROBE1(name, a) PROBE_ASM_(name, "-8@%[a1]", [a1] "nor" (PROBE_ARG_(a)))
+#define PROBE2(name, a, b)                                                              \
+    PROBE_ASM_(name, "-8@%[a1] -8@%[a2]", [a1] "nor" (PROBE_ARG_(a)), [a2] "nor" (PROBE_ARG_(b)))
+#define PROBE3(name, a, b, c)                                                           \
+    PROBE_ASM_(name, "-8@%[a1] -8@%[a2] -8@%[a3]", [a1] "nor" (PROBE_ARG_(a)),           \
+               [a2] "nor" (PROBE_ARG_(b)), [a3] "nor" (PROBE_ARG_(c)))
+#define PROBE4(name, a, b, c, d)                                                        \
+    PROBE_ASM_(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]", [a1] "nor" (PROBE_ARG_(a)),  \
+               [a2] "nor" (PROBE_ARG_(b)), [a3] "nor" (PROBE_ARG_(c)), [a4] "nor" (PROBE_ARG_(d)))
+#define PROBE5(name, a, b, c, d, e)                                                     \
+    PROBE_ASM_(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4] -8@%[a5]",                     \
+               [a1] "nor" (PROBE_ARG_(a)), [a2] "nor" (PROBE_ARG_(b)),                   \
+               [a3] "nor" (PROBE_ARG_(c)), [a4] "nor" (PROBE_ARG_(d)), [a5] "nor" (PROBE_ARG_(e)))
+
+#else
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+#define PROBE5(name, a, b, c, d, e) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Check the USDT probes documented in probes.h: build the shell and make sure every
+# minishell probe has a .note.stapsdt entry, then build it with -DMINISHELL_NO_PROBES
+# and make sure none are left. Run from the repository root; CC and CFLAGS are honoured.
+#
+#   ./probes_check.sh
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O1}
+PROBES="command_accepted danger_verdict spawn reaped rlimit_applied tee_flush mcalc_begin mcalc_end"
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+# Provider/name pairs from the stapsdt notes of a binary, one "provider name" per line
+list_probes() {
+    readelf -n "$1" | awk '/Provider:/ { provider = $2 } /Name:/ && provider != "" { print provider, $2; provider = "" }'
+}
+
+$CC $CFLAGS -o "$tmp/minishell" shitTest.c -lpthread || { echo "FAIL: build"; exit 1; }
+list_probes "$tmp/minishell" > "$tmp/probes"
+for probe in $PROBES; do
+    if ! grep -qx "minishell $probe" "$tmp/probes"; then
+        echo "FAIL: probe minishell:$probe missing"
+        status=1
+    fi
+done
+
+$CC $CFLAGS -DMINISHELL_NO_PROBES -o "$tmp/minishell-noprobes" shitTest.c -lpthread || { echo "FAIL: build with -DMINISHELL_NO_PROBES"; exit 1; }
+if readelf -n "$tmp/minishell-noprobes" | grep -q stapsdt; then
+    echo "FAIL: stapsdt notes left with -DMINISHELL_NO_PROBES"
+    status=1
+fi
+
+[ $status -eq 0 ] && echo "OK: $(echo $PROBES | wc -w) probes present, none with -DMINISHELL_NO_PROBES"
+exit $status
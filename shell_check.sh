@@ -0,0 +1,127 @@
+#!/bin/sh
+# Behaviour checks for the shell: run it on a few lines at a time and look at what it
+# prints. It is built with AddressSanitizer by default, so any overread fails the
+# check too. Run from the repository root; CC and CFLAGS are honoured.
+#
+#   ./shell_check.sh
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O1 -g -fsanitize=address}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+passed=0
+flags=
+
+$CC $CFLAGS -o "$tmp/minishell" shitTest.c -lpthread || { echo "FAIL: build"; exit 1; }
+mkdir "$tmp/work"
+: > "$tmp/work/x"
+printf 'rm -rf /\n' > "$tmp/blocklist"
+list=blocklist
+
+# Write the blocklist the next checks run against, one rule per argument
+blocklist() {
+    printf '%s\n' "$@" > "$tmp/blocklist"
+    list=blocklist
+}
+
+# Compile the current blocklist and run the next checks against the compiled file
+compiled() {
+    "$tmp/minishell" --compile-blocklist "$tmp/blocklist" "$tmp/blocklist.bin" > /dev/null 2> "$tmp/stderr" ||
+        { echo "FAIL: --compile-blocklist"; cat "$tmp/stderr"; status=1; }
+    list=blocklist.bin
+}
+
+# Run the shell in $tmp/work on the given lines (then done). Prints its output one
+# line per line with the prompts taken out; stderr goes to $tmp/stderr
+run() {
+    printf '%s\n' "$@" done |
+        (cd "$tmp/work" && ASAN_OPTIONS=detect_leaks=0 MINISHELL_HISTFILE="$tmp/history" \
+         timeout 10 "$tmp/minishell" $flags "$tmp/$list" "$tmp/log" 2> "$tmp/stderr") |
+        sed 's/#cmd:[^>]*>>/\n/g' | grep -v '^$'
+}
+
+# Record the result of check $1; $2 is 1 if it passed
+result() {
+    if grep -q AddressSanitizer "$tmp/stderr"; then
+        echo "FAIL: $1: AddressSanitizer"
+        sed -n '1,8p' "$tmp/stderr"
+        status=1
+    elif [ "$2" -eq 1 ]; then
+        passed=$((passed + 1))
+    else
+        echo "FAIL: $1"
+        status=1
+    fi
+}
+
+# expect NAME TEXT LINE...: running the lines prints TEXT as a whole line
+expect() {
+    name=$1 text=$2
+    shift 2
+    out=$(run "$@")
+    ok=0
+    printf '%s\n' "$out" | grep -qxF -- "$text" && ok=1
+    [ $ok -eq 1 ] || printf '  expected "%s" in:\n%s\n' "$text" "$out"
+    result "$name" $ok
+}
+
+# expect_err NAME TEXT LINE...: running the lines writes TEXT (anywhere) to stderr
+expect_err() {
+    name=$1 text=$2
+    shift 2
+    run "$@" > /dev/null
+    ok=0
+    grep -qF -- "$text" "$tmp/stderr" && ok=1
+    [ $ok -eq 1 ] || printf '  expected "%s" on stderr:\n%s\n' "$text" "$(cat "$tmp/stderr")"
+    result "$name" $ok
+}
+
+# Glob words with brackets: an unterminated [ is a literal character
+expect "word ending in [" 'a[' 'echo a['
+expect "lone [" '[' 'echo ['
+expect "lone [!" '[!' 'echo [!'
+expect "[ -f x ] finds x" 'after' '[ -f x ]' 'echo after'
+expect "[ -f y ] fails" 'Process exited with error code: 1' '[ -f y ]'
+expect "bracket class" 'x' 'echo [xyz]'
+
+# Blocklist pattern tokens ending in [ (literal) next to real wildcards
+blocklist 'echo a[' 'cat *[' 'echo [!'
+expect_err "rule token a[" 'Dangerous command detected ("echo a[")' 'echo a['
+expect_err "rule token *[" 'Dangerous command detected ("cat *[")' 'cat notes['
+expect_err "rule token [!" 'Dangerous command detected ("echo [!")' 'echo [!'
+expect "rule *[ needs the [" 'notes' 'echo notes'
+compiled
+expect_err "compiled rule token a[" 'Dangerous command detected ("echo a[")' 'echo a['
+expect_err "compiled rule token *[" 'Dangerous command detected ("cat *[")' 'cat notes['
+blocklist 'rm -rf /'
+
+# Flags are only merged before the first operand: after it a flag-like word is an operand
+blocklist 'rm -rf /' 'echo rm -rf /'
+expect_err "flags in any order" 'Dangerous command detected ("rm -rf /")' 'rm -fr /'
+expect_err "flags split" 'Dangerous command detected ("rm -rf /")' 'rm -r -f /'
+expect_err "flag-like operand as written" 'Dangerous command detected ("echo rm -rf /")' 'echo rm -rf /'
+expect "flag-like operand reordered" 'rm -fr /' 'echo rm -fr /'
+expect "flag-like operand after --" '-- rm -fr /' 'echo -- rm -fr /'
+compiled
+expect "compiled flag-like operand reordered" 'rm -fr /' 'echo rm -fr /'
+expect_err "compiled flags in any order" 'Dangerous command detected ("rm -rf /")' 'rm -fr /'
+blocklist 'rm -rf /'
+
+# History, the log writer and the perf probe start after the first prompt, when first needed
+flags=--startup-trace
+run 'echo hi' > /dev/null
+before=$(sed -n '1,/total to first prompt/p' "$tmp/stderr")
+ok=1
+printf '%s\n' "$before" | grep -qF 'total to first prompt' || ok=0
+printf '%s\n' "$before" | grep -qiE 'history|writer|perf' && ok=0
+for subsystem in 'history started on first use' 'log writer started on first use' 'perf counters'; do
+    grep -qF "$subsystem" "$tmp/stderr" || ok=0
+done
+[ $ok -eq 1 ] || printf '  deferred subsystems not in the trace as expected:\n%s\n' "$(cat "$tmp/stderr")"
+result "--startup-trace defers history, log writer and perf" $ok
+flags=
+
+[ $status -eq 0 ] && echo "OK: $passed checks"
+exit $status
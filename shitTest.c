@@ -12,6 +12,30 @@
 #include <asm-generic/errno-base.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <stdarg.h>
+#include <linux/perf_event.h>
+#include "execlog.h"
+#include "shmstats.h"
+#include "probes.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /**** CONSTANTS ****/
 #define MAX_INPUT_LENGTH 1024
@@ -19,6 +43,65 @@
 #define MAX_ARGC 7
 const char delim[] = " ";
 #define MAX_MATRICES 10
+#define CMD_CACHE_SIZE 64         // Parsed command lines kept in the LRU cache
+#define CMD_CACHE_BUCKETS 128     // Hash buckets for the cache (power of two)
+#define VERDICT_CACHE_SIZE 512    // Danger verdicts kept in the LRU cache
+#define VERDICT_CACHE_BUCKETS 1024 // Hash buckets for the verdict cache (power of two)
+#define MAX_REDIRECTIONS 8        // Redirections allowed per command
+#define MAX_EVENT_SOURCES 8       // Descriptors the input wait can dispatch
+#define LOG_RING_SLOTS 256        // Records the log ring holds (power of two)
+#define LOG_RECORD_MAX 2048       // Bytes of text per record; longer records are cut
+#define LOG_BATCH_MAX 64          // Records written per writev
+#define LOG_FLUSH_RECORDS 32      // Queued records that wake the writer early
+#define LOG_FLUSH_INTERVAL_MS 100 // Longest a record waits for the writer otherwise
+#define LOG_TARGET_COMMANDS 0     // Command timing log (second shell argument)
+#define LOG_TARGET_MATRIX 1       // matrix_operations.log
+#define LOG_TARGETS 2
+#define LOG_FORMAT_TEXT 0         // "<command> : <seconds> sec" lines, truncated per session
+#define LOG_FORMAT_BINARY 1       // execlog.h records, appended across sessions and rotated
+#define MAX_BACKGROUND_JOBS 16    // Background commands tracked for the structured log
+#define COMMAND_STATS_SLOTS 256   // Command names `stats` tracks (power of two)
+#define COMMAND_STATS_NAME 64     // Longest command name kept; longer names are cut
+#define SKETCH_SUB_BITS 3         // Latency sketch: 8 buckets per power of two (under 7% error)
+#define SKETCH_BUCKETS ((40 - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) // Covers up to 2^40 us
+#define METRICS_TOP_K 10          // Commands exported with their own label; the rest are "other"
+#define METRICS_INTERVAL 15       // Seconds between rewrites of the textfile collector file
+#define METRICS_REQUEST_MAX 2048  // Bytes of an HTTP request read before answering
+#define METRICS_IO_TIMEOUT_MS 100 // Longest a slow scraper can hold up the prompt per read or write
+#define TRACE_DETAIL_MAX 48       // Bytes of command text kept per trace event
+#define TRACE_INITIAL_EVENTS 64   // First buffer size per thread; doubled as it fills
+#define TRACE_MAX_EVENTS (1 << 20) // Events a thread buffers before dropping
+#define TRACE_SIGNAL_EVENTS 256   // Preallocated events for the SIGCHLD handler
+#define PERF_COUNTERS 4           // Events in a child's counter group (execlog.h ExecLogPerf)
+#define MEMSTATS_TOP 20           // Allocation sites `memstats` lists by default
+#define MEMSTATS_MAGIC 0xA110ULL  // Top 16 bits of a tracked block's size tag
+
+// Verdicts returned by classify_dangerous_command()
+#define DANGER_ALLOW 0
+#define DANGER_WARN 1
+#define DANGER_BLOCK 2
+
+// Blocklist index: one flat blob of offsets (no pointers). --compile-blocklist
+// writes it to disk and the shell maps such a file back as-is
+#define DANGER_INDEX_MAGIC "MSHPOL01"
+#define DANGER_INDEX_VERSION 4           // Bump on any layout or canonical_args change; older files are rejected
+#define CANON_CACHE_SLOTS 256            // Resolved command paths remembered (power of two)
+
+// Persistent history: append-only record file plus an index file holding
+// per-prefix bucket chains (first 1..HIST_PREFIX_LEVELS chars) and record offsets
+#define HIST_MAGIC "MSHHIST1"
+#define HIST_BUCKETS 16384               // Buckets per prefix level (power of two)
+#define HIST_PREFIX_LEVELS 4
+#define HIST_DEFAULT_SHOW 20             // Entries listed by a bare `history`
+#define HIST_GROW_STEP (1 << 20)         // Files grow in 1MB steps
+#define HIST_DATA_MAP_MAX (1ULL << 34)   // Address space reserved for the record file
+#define HIST_INDEX_MAP_MAX (1ULL << 31)  // Address space reserved for the index file
+#define HIST_INDEX_OFFSETS (sizeof(HistoryIndexHeader) + HIST_PREFIX_LEVELS * HIST_BUCKETS * sizeof(uint64_t))
+
+// Line editor and completion
+#define DIR_SCAN_BUFFER (1 << 18)        // getdents64 batch size
+#define COMPLETION_MAX_LIST 100          // Candidates listed on an ambiguous Tab
+#define COMPLETION_MAX_PATH_DIRS 64      // PATH directories tracked for staleness
 
 
 
@@ -31,6 +114,389 @@ typedef struct {
     int min_args;
 } CustomCommand;
 
+/**** BUILTIN COMMANDS STRUCTURE ****/
+typedef struct {
+    const char *name;
+    int (*handler)(char **args, int args_len);
+} BuiltinCommand;
+
+/**** HISTORY FILE STRUCTURES ****/
+typedef struct {
+    char magic[8];
+    uint64_t count;          // Number of records
+    uint64_t data_end;       // Logical end of the record file
+    uint64_t reserved[5];
+} HistoryIndexHeader;
+
+typedef struct {
+    int64_t timestamp;                  // Wall-clock time the command was accepted
+    double duration;                    // Seconds, -1 until the command finished
+    int32_t exit_status;                // -1 until the command finished
+    uint32_t len;                       // Length of the command text
+    uint64_t prev[HIST_PREFIX_LEVELS];  // Previous record (+1) in the same prefix bucket, per level
+} HistoryRecord;                        // Followed by the NUL-terminated text, padded to 8 bytes
+
+/**** COMPLETION TRIE ****/
+typedef struct {
+    char ch;                 // Character on the edge into this node
+    unsigned char terminal;  // A word ends here
+    int child;               // First child (-1 if none), children sorted by ch
+    int next;                // Next sibling (-1 if none)
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;         // Node pool, node 0 is the root
+    int count;
+    int capacity;
+} CompletionTrie;
+
+// Raw directory entry as returned by getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef int (*dir_entry_fn)(const char *name, unsigned char d_type, void *ctx);
+
+/**** GLOB EXPANSION ****/
+#define GLOB_LITERAL 0
+#define GLOB_ANY 1        // ?
+#define GLOB_STAR 2       // *
+#define GLOB_CLASS 3      // [...]
+
+typedef struct {
+    unsigned char type;      // GLOB_*
+    unsigned char ch;        // Character for GLOB_LITERAL
+    unsigned char set[32];   // Member bitmap for GLOB_CLASS
+} GlobOp;
+
+typedef struct {
+    GlobOp *ops;             // Compiled path segment
+    int count;
+    int match_dot;           // Segment starts with '.', so hidden names may match
+} GlobPattern;
+
+typedef struct {
+    char **items;
+    int count;
+    int capacity;
+} StringList;
+
+// State of one word's expansion
+typedef struct {
+    char path[PATH_MAX];     // Path built so far
+    char **segments;         // Pattern split on '/'
+    GlobPattern *compiled;   // Compiled form of glob segments
+    char *is_glob;           // Which segments need matching
+    int segment_count;
+    StringList results;
+} GlobWalk;
+
+/**** REDIRECTIONS ****/
+typedef struct {
+    int fd;          // Descriptor being redirected (0, 1 or 2)
+    int flags;       // open() flags for a file target
+    int dup_fd;      // Source descriptor for 2>&1, -1 for a file target
+    char *file;      // Target file
+} Redirection;
+
+typedef struct {
+    Redirection ops[MAX_REDIRECTIONS];  // Applied in the order they were written
+    int count;
+} Redirections;
+
+/**** BLOCKLIST INDEX ****/
+// Blob header; every *_off is a byte offset from the start of the blob
+typedef struct {
+    char magic[8];             // DANGER_INDEX_MAGIC
+    uint32_t version;
+    uint32_t rule_count;
+    uint32_t token_count;
+    uint32_t exact_slots;      // Power of two
+    uint32_t head_slots;       // Power of two
+    uint32_t node_count;       // Pattern trie nodes (node 0 is the root)
+    uint32_t edge_count;
+    uint32_t canon_slots;      // Power of two
+    uint64_t rules_off;        // DangerRule[rule_count], in file order
+    uint64_t nodes_off;        // PatternNode[node_count]
+    uint64_t edges_off;        // PatternEdge[edge_count]
+    uint64_t tokens_off;       // uint32_t[token_count] string offsets
+    uint64_t exact_off;        // uint32_t[exact_slots]: rule id + 1 keyed by full_hash (0 = empty)
+    uint64_t head_off;         // uint32_t[head_slots]: last rule id + 1 keyed by head_hash (0 = empty)
+    uint64_t canon_off;        // uint32_t[canon_slots]: rule id + 1 keyed by canon_hash (0 = empty)
+    uint64_t strings_off;      // NUL-terminated rule lines and tokens
+    uint64_t strings_size;
+    uint64_t total_size;
+} DangerIndexHeader;
+
+typedef struct {
+    uint64_t full_hash;        // hash_args() of every token
+    uint64_t head_hash;        // hash_string() of the canonical argv[0]
+    uint64_t canon_hash;       // hash_args() of canonical_args()
+    uint64_t canon_signature;  // token_signature() of canonical_args()
+    uint32_t line_off;         // Rule as written in the blocklist
+    uint32_t first_token;      // First entry in the token table
+    uint32_t token_count;
+    uint32_t prev_same_head;   // Previous rule id + 1 with the same canonical argv[0] (0 = none)
+    uint32_t canon_head_off;   // Canonical argv[0]
+    uint32_t canon_line_off;   // Canonical tokens joined by single spaces
+    uint32_t canon_line_len;
+    uint32_t canon_token_count;
+} DangerRule;
+
+// Token trie over the rules that contain wildcards. A token with *, ? or [...]
+// is a glob over that one argument; a token that is exactly ** matches any
+// number of remaining arguments (including none)
+typedef struct {
+    uint32_t first_edge;       // Literal edges (sorted by hash), then pattern edges
+    uint32_t literal_count;
+    uint32_t pattern_count;
+    uint32_t star_child;       // Node + 1 reached through a ** token (0 = none)
+    uint32_t accept;           // Lowest rule id + 1 ending here (0 = none)
+    uint32_t self_loop;        // Reached through **, so it absorbs any further token
+} PatternNode;
+
+typedef struct {
+    uint64_t hash;             // hash_string() of the token
+    uint32_t str_off;          // Token text (a glob for pattern edges)
+    uint32_t child;
+} PatternEdge;
+
+// Loaded index: the blob plus pointers to its sections
+// How often one blocklist rule fired; kept beside the index, never in the blob
+typedef struct {
+    uint32_t blocks;
+    uint32_t warns;
+    int64_t last_hit;          // Wall clock seconds of the latest hit (0 = never)
+} RuleStats;
+
+typedef struct DangerIndex {
+    void *blob;
+    size_t blob_size;
+    int mapped;                // Blob is a read-only mapping of a compiled file
+    const DangerIndexHeader *header;
+    const DangerRule *rules;
+    const uint32_t *tokens;
+    const uint32_t *exact;
+    const uint32_t *head;
+    const uint32_t *canon;
+    const PatternNode *nodes;
+    const PatternEdge *edges;
+    const char *strings;
+    GlobPattern *patterns;     // Pattern edges, compiled on first use, by edge id
+    uint32_t *active[2];       // Trie states of the current and next token
+    uint32_t *seen;            // Per node stamp deduplicating states
+    uint32_t stamp;
+    time_t loaded_at;          // Wall clock time the index was built
+    double load_seconds;       // Time spent reading and indexing the file
+    RuleStats *stats;          // Per rule hit counts, allocated on the first hit
+    struct DangerIndex *retired_next; // Link in the list of replaced indexes
+} DangerIndex;
+
+// Myers bit-vector edit distance: a pattern preprocessed into per-symbol match
+// masks. Texts are given as row numbers into peq (the last row never matches)
+typedef struct {
+    int length;                // Pattern symbols
+    int words;                 // 64-bit blocks covering the pattern
+    int rows;
+    uint64_t *peq;             // rows x words match masks
+    uint64_t *pv;              // Vertical delta vectors (scratch)
+    uint64_t *mv;
+} MyersPattern;
+
+// What a danger verdict was based on
+typedef struct {
+    const char *rule;          // Blocklist line (NULL for DANGER_ALLOW)
+    long rule_id;              // Its index in the loaded blocklist (-1 when none)
+    DangerIndex *index;        // Index rule_id refers to (NULL when none)
+    int token_distance;        // DANGER_WARN: edit distance to the rule in tokens
+    int char_distance;         // and in characters, over the canonical forms
+} DangerMatch;
+
+// Remembered canonical_command_name() result for an absolute path
+typedef struct {
+    unsigned long long hash;
+    char *name;
+    char *canonical;
+} CanonicalName;
+
+// Remembered danger verdict for one argument vector
+typedef struct {
+    unsigned long long hash;   // hash_args() of the arguments
+    char *key;                 // Arguments, each NUL-terminated, back to back
+    size_t key_len;
+    int verdict;               // DANGER_*
+    long rule_id;              // Matched rule (-1 for DANGER_ALLOW)
+    int token_distance;
+    int char_distance;
+    int lru_prev;              // LRU list links (-1 terminates)
+    int lru_next;
+    int bucket_next;           // Next entry in the same hash bucket (-1 terminates)
+    int in_use;
+} VerdictEntry;
+
+/**** LOG RING ****/
+// One queued log record. seq is the slot's position in the ring protocol: equal to the
+// write position when free, position + 1 once committed, and advanced by a full lap
+// when the writer has released it. It is stored less the slot's index, so the
+// zero-filled ring starts out valid (log_slot_seq)
+typedef struct {
+    uint64_t seq;
+    uint64_t pos;              // Write position the slot was claimed for
+    int target;                // LOG_TARGET_*
+    int truncated;             // Text did not fit in LOG_RECORD_MAX
+    uint32_t length;
+    char text[LOG_RECORD_MAX];
+} LogRecord;
+
+/**** PERFORMANCE COUNTERS ****/
+// perf_event counter group attached to one child
+typedef struct {
+    int kind;                  // EXECLOG_PERF_*, 0 when nothing is attached
+    int fds[PERF_COUNTERS];    // Leader first; -1 when not open
+} PerfGroup;
+
+// What a group counted, read when its child is reaped
+typedef struct {
+    int kind;                  // EXECLOG_PERF_*, 0 when nothing was counted
+    uint64_t values[PERF_COUNTERS]; // In ExecLogPerf order, scaled for multiplexing
+} PerfCounts;
+
+// A background command awaiting its SIGCHLD, for the structured log and `stats`
+typedef struct {
+    pid_t pid;                 // 0 when the slot is free
+    struct timespec start;
+    PerfGroup perf;            // Counters attached to it
+    char name[COMMAND_STATS_NAME]; // Canonical command name
+    char command[MAX_INPUT_LENGTHH];
+} BackgroundJob;
+
+/**** EXECUTION TRACE ****/
+// One complete ("X") trace event
+typedef struct {
+    const char *category;      // Static strings
+    const char *name;
+    int64_t begin_ns;          // CLOCK_MONOTONIC
+    int64_t end_ns;
+    int32_t tid;               // Track: a thread, or a child pid for process lifetimes
+    int32_t arg;               // Shown as args.value when nonzero
+    char detail[TRACE_DETAIL_MAX]; // Shown as args.detail when not empty
+} TraceEvent;
+
+// Events of one thread. Only that thread appends; buffers are linked into
+// trace_buffers when created and written out and freed by `trace off`
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int32_t tid;
+    const char *thread_name;
+    TraceEvent *events;
+    uint32_t count;
+    uint32_t capacity;
+} TraceBuffer;
+
+/**** COMMAND STATISTICS ****/
+// Aggregates for one command name. The sketch counts run times in log-spaced
+// microsecond buckets, so percentiles cost a bucket walk instead of kept samples
+typedef struct {
+    uint64_t hash;
+    char name[COMMAND_STATS_NAME]; // "" when the slot is free
+    uint32_t count;
+    uint32_t failures;             // Nonzero exit status or killed by a signal
+    uint64_t total_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint32_t perf_runs;            // Runs with performance counters
+    int perf_kind;                 // EXECLOG_PERF_* of perf_totals
+    uint64_t perf_totals[PERF_COUNTERS];
+    uint32_t sketch[SKETCH_BUCKETS];
+} CommandStats;
+
+// One `stats` output line
+typedef struct {
+    const CommandStats *stats;
+    uint64_t p50, p90, p99;
+} CommandStatsRow;
+
+#ifdef MINISHELL_MEMSTATS
+/**** ALLOCATION STATISTICS ****/
+// One allocation call site. The allocation macros create one in place per call and
+// it joins memstats_sites on its first allocation. Counters are updated atomically,
+// since any thread may allocate
+typedef struct AllocSite {
+    struct AllocSite *next;
+    const char *function;
+    int line;
+    int registered;
+    long allocs;
+    long frees;                // Blocks from this site freed, wherever that happened
+    long bytes;                // Allocated in total
+    long live_bytes;
+    long peak_bytes;           // Highest live_bytes seen
+} AllocSite;
+
+// In front of every tracked block: its site and its size, tagged with MEMSTATS_MAGIC
+// in the top 16 bits (cleared on free, so double frees are caught)
+typedef struct {
+    AllocSite *site;
+    uint64_t tag;
+} AllocHeader;
+
+// Allocation counts at one point, for per-line and per-mcalc deltas
+typedef struct {
+    long allocs;
+    long bytes;
+} AllocTotals;
+#endif
+
+/**** MAPPED LINE FILES ****/
+// One line of a mapped file: trimmed, never empty, not NUL-terminated
+typedef struct {
+    size_t offset;
+    size_t length;
+} LineView;
+
+// A text file mapped read-only with the offsets of its non-blank lines
+typedef struct {
+    const char *data;          // Mapping of the whole file (NULL when the file is empty)
+    size_t size;
+    LineView *lines;
+    size_t count;
+} LineFile;
+
+/**** EVENT LOOP ****/
+// Descriptor serviced while the shell waits for input
+typedef void (*event_handler_fn)(int fd);
+
+typedef struct {
+    int fd;
+    event_handler_fn handler;
+} EventSource;
+
+/**** PARSED COMMAND CACHE ENTRY ****/
+// Everything main() derives from a raw input line before spawning it
+typedef struct ParsedCommand {
+    unsigned long long hash;   // Hash of the raw input line
+    char *line;                // Raw input line (guards against hash collisions)
+    int pip_flag;              // Whether the line is a pipeline
+    char **l_args;             // Parsed left command
+    int l_args_len;
+    char **r_args;             // Parsed right command (NULL without a pipe)
+    int r_args_len;
+    Redirections l_redir;      // Redirections of each side
+    Redirections r_redir;
+    int l_verdict;             // Danger verdicts (DANGER_*) and the rules that produced them
+    int r_verdict;
+    DangerMatch l_match;
+    DangerMatch r_match;
+    int lru_prev;              // LRU list links (-1 terminates)
+    int lru_next;
+    int bucket_next;           // Next entry in the same hash bucket (-1 terminates)
+    int in_use;
+} ParsedCommand;
+
 
 typedef struct {
     int rows;
@@ -40,6 +506,9 @@ typedef struct {
 /**** FUNCTION PROTOTYPES ****/
 // Input handling
 void get_string(char* buffer, size_t buffer_size);
+void read_input_line(char *buffer, size_t buffer_size);
+int stdin_buffer_empty(void);
+void line_edit(char *buffer, size_t buffer_size);
 char** split_to_args(const char *string, const char *delimiter, int *count);
 int checkMultipleSpaces(const char* input);
 char* trim_inplace(char* str);
@@ -47,19 +516,112 @@ void free_args(char **args);
 int pipe_split(char *input, char *left_cmd, char *right_cmd);
 void strip_crlf(char *str);
 
+// Log writer
+int log_start(const char *command_log);
+void log_writer_ensure(void);
+void log_shutdown(void);
+LogRecord* log_reserve(int target);
+void log_appendf(LogRecord *rec, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_commit(LogRecord *rec);
+void log_command_time(const char *command, float seconds);
+void log_command_record(const char *command, int64_t duration_ns, int flags, pid_t pid, int status,
+                        pid_t pid2, int status2, const struct rusage *usage, const PerfCounts *perf);
+void background_job_add(pid_t pid, const struct timespec *started, const char *name, const char *command,
+                        const PerfGroup *perf);
+void background_job_finished(pid_t pid, int status, const struct rusage *usage);
+void* log_writer_thread(void *arg);
+int log_builtin(char **args, int args_len);
+
+// Per-command statistics
+void command_stats_record(const char *name, int64_t duration_ns, int status, const PerfCounts *perf);
+uint64_t sketch_quantile(const CommandStats *stats, double q);
+int command_stats_snapshot(CommandStats **out);
+int stats_builtin(char **args, int args_len);
+
+// Performance counters of child processes
+void perf_init(void);
+int perf_sync_open(int sync[2]);
+void perf_sync_wait(int sync[2]);
+void perf_attach(pid_t pid, int sync[2], PerfGroup *group);
+void perf_group_read(PerfGroup *group, PerfCounts *out);
+void perf_group_close(PerfGroup *group);
+
+// Execution trace
+int64_t trace_now(void);
+void trace_span(const char *category, const char *name, int64_t begin_ns, int32_t tid, int32_t arg,
+                const char *detail);
+void trace_signal_span(const char *category, const char *name, int64_t begin_ns, int32_t tid,
+                       const char *detail);
+void trace_thread_name(const char *name);
+int trace_start(const char *path);
+int trace_stop(void);
+int trace_builtin(char **args, int args_len);
+
+// Prometheus metrics
+char* metrics_render(size_t *length);
+void metrics_start(void);
+void metrics_accept_handler(int fd);
+void metrics_timer_handler(int fd);
+int metrics_write_textfile(void);
+void metrics_shutdown(void);
+int metrics_builtin(char **args, int args_len);
+
+// Shared-memory counters for external monitors
+void shm_stats_open(void);
+void shm_stats_publish(void);
+void shm_stats_close(void);
+
 // File operations
-char** read_file_lines(const char* filename, int* num_lines);
-void append_to_log(const char *filename, char* val1, float val2);
+LineView* index_lines(const char *data, size_t size, size_t *count);
+int line_file_open(const char *path, LineFile *file);
+void line_file_close(LineFile *file);
+int bench_lines(const char *path);
 void write_to_file(const char *filename, const char *content, int append);
 
 // Command processing
 int is_dangerous_command(char **user_args, int user_args_len);
+int classify_dangerous_command(char **user_args, int user_args_len, DangerMatch *match);
+void classify_expanded_command(char **user_args, int user_args_len, int *verdict, DangerMatch *match);
+static int classify_against_index(DangerIndex *index, char **user_args, int user_args_len, DangerMatch *match);
+static int verdict_cache_lookup(const DangerIndex *index, char **args, int count, DangerMatch *match);
+static void verdict_cache_store(const DangerIndex *index, char **args, int count, int verdict, const DangerMatch *match);
+int report_danger_verdict(int verdict, const DangerMatch *match);
+DangerIndex* danger_index_build(const char *text, const LineView *lines, int count);
+void danger_index_free(DangerIndex *index);
+void danger_rule_record_hit(DangerIndex *index, long rule_id, int verdict);
+void danger_rule_stats_carry(const DangerIndex *from, DangerIndex *to);
+const char* danger_rule_line(const DangerIndex *index, uint32_t rule_id);
+long danger_index_find_exact(const DangerIndex *index, char **args, int count);
+long danger_index_find_head(const DangerIndex *index, const char *name);
+long danger_index_find_canonical(const DangerIndex *index, char **canon, int count);
+void normalize_path(const char *path, char *out);
+void canonical_command_name(const char *name, char *out, size_t size);
+char **canonical_args(char **args, int count, int *out_count);
+uint64_t token_signature(char **tokens, int count);
+void myers_prepare(MyersPattern *pat, int length, int rows);
+void myers_free(MyersPattern *pat);
+int myers_distance(MyersPattern *pat, const uint32_t *text, int n, int limit);
+long danger_index_closest(const DangerIndex *index, long head_rule, char **canon, int count,
+                          int *token_distance, int *char_distance);
+long danger_index_match_patterns(DangerIndex *index, char **args, int count);
+DangerIndex* danger_index_load(const char *path);
+DangerIndex* danger_index_map(int fd, const char *path);
+int compile_blocklist(const char *in_path, const char *out_path);
+int bench_policy(void);
 float time_diff(struct timespec start, struct timespec end);
 void update_min_max_time(double current_time, double *min_time, double *max_time);
 void prompt(void);
+void format_prompt(char *out, size_t size);
 void check_append_flag(char **args, int args_len, int *append_flg);
-void redirect_stderr_to_file(const char *filename);
-void check_and_redirect_stderr(char **l_args);
+
+// Redirections
+int parse_redirections(char **args, int *args_len, Redirections *redir);
+const char* redirection_operator(const char *token, int *fd, int *flags, int *dup_fd);
+int apply_redirections(const Redirections *redir);
+int save_and_apply_redirections(const Redirections *redir, int saved[3]);
+void restore_redirections(int saved[3]);
+void copy_redirections(Redirections *dst, const Redirections *src);
+void free_redirections(Redirections *redir);
 
 // Signal handlers
 void sigchld_handler(int sig);
@@ -75,11 +637,15 @@ void show_all_resource_limits(void);
 
 // Error handling
 void handle_execvp_errors_in_child(char **args);
-void* safe_malloc(size_t size);
-void restore_stderr(void);
+void* (safe_malloc)(size_t size);
 
 // Custom commands
 int my_tee_handler(void);
+
+// Builtin commands (run inside the shell process)
+int cmdcache_builtin(char **args, int args_len);
+int history_builtin(char **args, int args_len);
+int policy_builtin(char **args, int args_len);
 // matrix handler
 void mcalc_handler(char* input);
 int parse_input(const char* input, Matrix* matrices, int* matrix_count, char* operation_out);
@@ -91,6 +657,91 @@ void* matrix_thread_operation(void* arg);
 Matrix copy_matrix(Matrix* original);
 Matrix hierarchical_matrix_calculation(Matrix* matrices, int matrix_count, char* operation);//
 
+// Parsed-command cache
+unsigned long long hash_string(const char *str);
+unsigned long long hash_bytes(const char *data, size_t len);
+unsigned long long hash_args(char **args, int count);
+int compare_strings(const void *a, const void *b);
+char **dup_args(char **args);
+void cmd_cache_flush(void);
+ParsedCommand* cmd_cache_lookup(const char *line);
+void verdict_cache_flush(void);
+void cmd_cache_store(const char *line, int pipe, char **largs, int largs_len, char **rargs, int rargs_len,
+                     const Redirections *lredir, const Redirections *rredir,
+                     int l_verdict, const DangerMatch *l_match, int r_verdict, const DangerMatch *r_match);
+
+// History
+void history_open(void);
+void history_close(void);
+long history_count(void);
+HistoryRecord* history_record(long n);
+const char* history_text(HistoryRecord *rec);
+long history_append(const char *line);
+void history_set_result(long n, int exit_status, double duration);
+int history_search_prefix(const char *prefix, long *matches, int max);
+long history_find_prefix(const char *prefix);
+int expand_history(char *input, size_t size);
+
+// Completion
+int scan_directory(const char *path, dir_entry_fn fn, void *ctx);
+void trie_insert(CompletionTrie *trie, const char *word);
+void trie_free(CompletionTrie *trie);
+void command_trie_refresh(void);
+
+// Glob expansion
+int has_glob_chars(const char *str);
+void glob_compile(const char *pattern, GlobPattern *out);
+int glob_match(const GlobPattern *pattern, const char *name);
+int glob_expand_word(const char *word, StringList *out);
+int args_have_globs(char **args);
+char **expand_globs(char **args, int *args_len);
+
+// Event loop and blocklist hot reload
+int event_loop_add(int fd, event_handler_fn handler);
+void event_loop_wait(int fd);
+int policy_watch_start(const char *path);
+void policy_watch_handler(int fd);
+void policy_request_reload(void);
+void* policy_reload_thread(void *arg);
+void policy_sync(void);
+void policy_shutdown(void);
+DangerIndex* policy_ensure_loaded(void);
+void startup_step(const char *name);
+void startup_first_use(const char *name, struct timespec begin);
+
+// Allocation statistics
+int memstats_builtin(char **args, int args_len);
+#ifdef MINISHELL_MEMSTATS
+void* memstats_malloc(size_t size, AllocSite *site);
+void* memstats_calloc(size_t count, size_t size, AllocSite *site);
+void* memstats_realloc(void *ptr, size_t size, AllocSite *site);
+char* memstats_strdup(const char *str, AllocSite *site);
+void* memstats_safe_malloc(size_t size, AllocSite *site);
+void memstats_free(void *ptr);
+void memstats_line_done(void);
+void memstats_mcalc_begin(void);
+void memstats_mcalc_end(void);
+
+// Built with -DMINISHELL_MEMSTATS, every allocation and free below goes through the
+// counting versions, tagged with its call site. Otherwise these are the libc calls
+#define MEMSTATS_SITE() \
+    ({ static AllocSite memstats_site = {NULL, __func__, __LINE__, 0, 0, 0, 0, 0, 0}; &memstats_site; })
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef free
+#define malloc(size) memstats_malloc((size), MEMSTATS_SITE())
+#define calloc(count, size) memstats_calloc((count), (size), MEMSTATS_SITE())
+#define realloc(ptr, size) memstats_realloc((ptr), (size), MEMSTATS_SITE())
+#define strdup(str) memstats_strdup((str), MEMSTATS_SITE())
+#define safe_malloc(size) memstats_safe_malloc((size), MEMSTATS_SITE())
+#define free(ptr) memstats_free(ptr)
+#else
+#define memstats_line_done() ((void)0)
+#define memstats_mcalc_begin() ((void)0)
+#define memstats_mcalc_end() ((void)0)
+#endif
 
 /////MONITORING
 // Add these to your global variables
@@ -107,38 +758,39 @@ MatrixStats matrix_stats = {0, 0, 0, 0, 0, 0};
 
 // Add this function to log matrix operations
 void log_matrix_operation(Matrix* matrices, int count, const char* operation, int success) {
-    FILE* log = fopen("matrix_operations.log", "a");
+    LogRecord *log = log_reserve(LOG_TARGET_MATRIX);
     if (!log) return;
 
     time_t now = time(NULL);
     char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    struct tm tm_now;
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm_now));
 
-    fprintf(log, "[%s] Operation: %s, Matrices: %d, Success: %s\n",
-            timestamp, operation, count, success ? "YES" : "NO");
+    log_appendf(log, "[%s] Operation: %s, Matrices: %d, Success: %s\n",
+                timestamp, operation, count, success ? "YES" : "NO");
 
     if (success) {
-        fprintf(log, "  Dimensions: (%d,%d)\n", matrices[0].rows, matrices[0].cols);
+        log_appendf(log, "  Dimensions: (%d,%d)\n", matrices[0].rows, matrices[0].cols);
 
         for (int i = 0; i < count; i++) {
-            fprintf(log, "  Matrix #%d: (", i+1);
+            log_appendf(log, "  Matrix #%d: (", i+1);
             for (int j = 0; j < matrices[i].rows * matrices[i].cols; j++) {
-                fprintf(log, "%d", matrices[i].data[j]);
+                log_appendf(log, "%d", matrices[i].data[j]);
                 if (j < matrices[i].rows * matrices[i].cols - 1)
-                    fprintf(log, ",");
+                    log_appendf(log, ",");
             }
-            fprintf(log, ")\n");
+            log_appendf(log, ")\n");
         }
     } else {
-        fprintf(log, "  ERROR: Operation failed\n");
+        log_appendf(log, "  ERROR: Operation failed\n");
     }
 
-    fprintf(log, "  Stats: Total Ops=%d, Errors=%d, ADD=%d, SUB=%d\n",
-            matrix_stats.operation_count, matrix_stats.error_count,
-            matrix_stats.add_operations, matrix_stats.sub_operations);
-    fprintf(log, "--------------------------------------------------\n");
+    log_appendf(log, "  Stats: Total Ops=%d, Errors=%d, ADD=%d, SUB=%d\n",
+                matrix_stats.operation_count, matrix_stats.error_count,
+                matrix_stats.add_operations, matrix_stats.sub_operations);
+    log_appendf(log, "--------------------------------------------------\n");
 
-    fclose(log);
+    log_commit(log);
 }
 //////////////////////////////////////////////////////////////////////
 /**** GLOBAL VARIABLES ****/
@@ -148,11 +800,23 @@ CustomCommand custom_commands[] = {
         {NULL, NULL, 0, 0, 0}                // Terminator entry
 };
 
+// Builtin commands table
+BuiltinCommand builtin_commands[] = {
+        {"cmdcache", cmdcache_builtin},      // Parsed-command cache statistics
+        {"history", history_builtin},        // Persistent command history
+        {"log", log_builtin},                // Log writer counters and fsync policy
+        {"memstats", memstats_builtin},      // Allocations per call site (-DMINISHELL_MEMSTATS)
+        {"metrics", metrics_builtin},        // Prometheus exposition of the shell's metrics
+        {"policy", policy_builtin},          // Blocklist generation and reloads
+        {"stats", stats_builtin},            // Per-command counts and latencies
+        {"trace", trace_builtin},            // Chrome trace-event recording
+        {NULL, NULL}                         // Terminator entry
+};
+
 // Command handling
-char **Danger_CMD = NULL;      // List of dangerous commands loaded from file
+DangerIndex *danger_index = NULL; // Dangerous commands list, indexed at load time
 int l_args_len = 0;            // Arguments count in left command
 int r_args_len = 0;            // Arguments count in right command
-int numLines = 0;              // Number of dangerous commands
 char **l_args = NULL;          // Arguments array for left command
 char **r_args = NULL;          // Arguments array for right command
 struct timespec start, end;    // Timestamps for timing command execution
@@ -167,6 +831,7 @@ double total_time_all = 0;            // Sum of execution times
 double min_time = 0;                  // Minimum command time
 double max_time = 0;                  // Maximum command time
 int semi_dangerous_cmd_count = 0;     // Similar-but-allowed commands count
+long danger_warned_total = 0;         // Warnings given (never decremented, unlike the above)
 
 // Pipe and command state
 int pip_flag = 0;              // Flag for pipe existence
@@ -178,15 +843,161 @@ char userInput[MAX_INPUT_LENGTHH]; // Buffer for user input
 int background_flag = 0;       // Flag for background execution
 char current_command[MAX_INPUT_LENGTHH]; // Current command for logging
 const char *output_file = NULL;   // Path to output log file
-int original_stderr_fd = -1;      // Original stderr for restoration
-int stderr_redirected = 0;        // Flag if stderr was redirected
+int startup_trace = 0;            // --startup-trace: report the time spent in each init step
+struct timespec startup_begin;    // Entry to main()
+struct timespec startup_mark;     // End of the previous traced step
+Redirections l_redir;             // Redirections of the left command
+Redirections r_redir;             // Redirections of the right command
 pid_t left_pid;                   // PID of left command process
 
+// Parsed-command cache
+ParsedCommand cmd_cache[CMD_CACHE_SIZE];  // Cache entries
+int cmd_cache_buckets[CMD_CACHE_BUCKETS]; // First entry per bucket (-1 when empty)
+int cmd_cache_lru_head = -1;              // Most recently used entry
+int cmd_cache_lru_tail = -1;              // Least recently used entry
+int cmd_cache_count = 0;                  // Entries in use
+int cmd_cache_ready = 0;                  // Buckets initialized
+long cmd_cache_hits = 0;                  // Lookups served from the cache
+long cmd_cache_misses = 0;                // Lookups that had to parse
+int policy_generation = 0;                // Bumped whenever the blocklist is (re)loaded
+int similarity_threshold = -1;            // Max token distance for a warning (-1 = any rule sharing the command)
+int cmd_cache_generation = -1;            // Policy generation the cache was filled under
+unsigned long long cmd_cache_path_hash = 0; // PATH the cache was filled under
+
+// Danger verdict cache
+VerdictEntry verdict_cache[VERDICT_CACHE_SIZE];     // Cache entries
+int verdict_cache_buckets[VERDICT_CACHE_BUCKETS];   // First entry per bucket (-1 when empty)
+int verdict_cache_lru_head = -1;                    // Most recently used entry
+int verdict_cache_lru_tail = -1;                    // Least recently used entry
+int verdict_cache_count = 0;                        // Entries in use
+int verdict_cache_ready = 0;                        // Buckets initialized
+long verdict_cache_hits = 0;                        // Verdicts served from the cache
+long verdict_cache_misses = 0;                      // Verdicts computed against the index
+double verdict_cache_hit_seconds = 0;               // Time spent answering hits
+double verdict_cache_miss_seconds = 0;              // Time spent classifying misses
+int verdict_cache_generation = -1;                  // Policy generation the cache was filled under
+const DangerIndex *verdict_cache_index = NULL;      // Index the rule ids refer to
+unsigned long long verdict_cache_path_hash = 0;     // PATH the cache was filled under
+
+// Event loop
+EventSource event_sources[MAX_EVENT_SOURCES]; // Descriptors dispatched while waiting for input
+int event_source_count = 0;
+
+// Log writer
+LogRecord log_ring[LOG_RING_SLOTS];       // Records between the producers and the writer thread
+uint64_t log_tail = 0;                    // Next write position claimed by a producer
+uint64_t log_head = 0;                    // Next record the writer will take
+int log_enabled = 0;                      // log_start has configured the logs
+int log_wake_fd = -1;                     // eventfd waking the writer (-1 when not running)
+int log_stopping = 0;                     // Writer drains the ring and exits
+pthread_t log_writer;
+const char *log_paths[LOG_TARGETS];       // File per LOG_TARGET_*
+int log_fds[LOG_TARGETS] = {-1, -1};      // Opened by the writer on its first record for them
+int log_fsync_seconds = -1;               // -1 never, 0 after every flush, N at most every N seconds
+int log_format = LOG_FORMAT_TEXT;         // Command log format (MINISHELL_LOG_FORMAT)
+long long log_rotate_bytes = 64LL << 20;  // Binary log size that starts a new file (0 = never)
+int log_rotate_seconds = 0;               // Binary log age that starts a new file (0 = never)
+int log_keep = 4;                         // Rotated binary logs kept as <log>.1 .. <log>.N
+long long log_file_size = 0;              // Writer's view of the open binary log
+int64_t log_file_created_ns = 0;          // Its creation time, from the file header
+long log_rotations = 0;
+BackgroundJob background_jobs[MAX_BACKGROUND_JOBS]; // Updated by main with SIGCHLD blocked
+
+// Per-command statistics (main updates and reads them with SIGCHLD blocked,
+// since the handler records background commands)
+CommandStats command_stats[COMMAND_STATS_SLOTS]; // Open addressing on the name hash
+CommandStats command_stats_other;                // Names that arrived once the table was full
+int command_stats_used = 0;
+
+#ifdef MINISHELL_MEMSTATS
+// Allocation statistics (updated atomically by every thread)
+AllocSite *memstats_sites = NULL;         // Sites that have allocated, newest first
+AllocTotals memstats_total;               // Allocations since the shell started
+long memstats_live_bytes = 0;
+long memstats_peak_bytes = 0;
+AllocTotals memstats_line_mark;           // memstats_total when the current line began
+AllocTotals memstats_last_line;           // What the previous line allocated
+AllocTotals memstats_mcalc_mark;          // memstats_total when the running mcalc began
+AllocTotals memstats_mcalc_total;         // What all mcalc operations allocated
+long memstats_mcalc_operations = 0;
+#endif
+
+// Shared-memory counters (shmstats.h)
+ShellStatsSegment *shm_stats = NULL;      // Mapped segment (NULL when not publishing)
+char shm_stats_name[64];                  // Its shm_open name
+volatile sig_atomic_t shm_stats_writing = 0; // main is inside shm_stats_publish()
+volatile sig_atomic_t shm_stats_dirty = 0;   // The handler found it busy; publish again
+int command_running = 0;                  // A foreground command is executing
+
+// Performance counters
+int perf_kind = 0;                        // EXECLOG_PERF_* attached to children, 0 when off
+int perf_exclude_kernel = 0;              // Kernel counting is not permitted
+int perf_probed = 0;                      // perf_init has run (on the first spawn)
+
+// Execution trace
+int tracing = 0;                          // `trace on` is active
+int trace_generation = 0;                 // Bumped by every `trace off`; stale thread buffers are replaced
+TraceBuffer *trace_buffers = NULL;        // Every thread buffer of the current trace
+TraceBuffer trace_signal_buffer;          // Filled by the SIGCHLD handler, preallocated
+char trace_path[PATH_MAX];                // Output of the current trace
+int64_t trace_started_ns = 0;             // Time zero of the trace
+long trace_dropped = 0;                   // Events lost to full buffers
+static __thread TraceBuffer *trace_thread_buffer = NULL; // Calling thread's buffer
+static __thread int trace_thread_generation = -1;        // Trace it belongs to
+static __thread const char *trace_thread_label = NULL;   // Track name for the next buffer
+
+// Prometheus metrics
+int metrics_listen_fd = -1;               // Unix socket served from the event loop (-1 when off)
+char metrics_socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+int metrics_timer_fd = -1;                // timerfd driving the textfile rewrites (-1 when off)
+const char *metrics_file = NULL;          // Textfile collector output (MINISHELL_METRICS_FILE)
+int metrics_top_k = METRICS_TOP_K;        // Commands given their own label
+long metrics_scrapes = 0;                 // Requests answered on the socket
+long log_records = 0;                     // Records written
+long log_bytes = 0;
+long log_dropped = 0;                     // Records lost to a full ring
+long log_truncated = 0;                   // Records cut at LOG_RECORD_MAX
+long log_write_errors = 0;                // Records that could not be written
+long log_flushes = 0;                     // writev batches (with their fsync, if any)
+uint64_t log_flush_ns = 0;                // Total and worst time spent per flush
+uint64_t log_flush_max_ns = 0;
+
+// Blocklist hot reload
+char policy_path[PATH_MAX];               // Absolute path of the blocklist file
+const char *policy_watch_name = NULL;     // File name inotify events are filtered on
+int policy_watch_fd = -1;                 // inotify descriptor (-1 when not watching)
+int policy_reload_pending = 0;            // Set by the watcher, consumed by the reload thread
+int policy_reload_running = 0;            // A reload thread is alive
+DangerIndex *policy_retired = NULL;       // Replaced indexes awaiting release on the main thread
+DangerIndex *policy_seen = NULL;          // Index the main thread last synchronized with
+long policy_reloads = 0;                  // Reloads that produced a new index
+long policy_reload_failures = 0;          // Reloads that kept the old index
+
+// Canonical command names (shared by the main and reload threads)
+CanonicalName canon_cache[CANON_CACHE_SLOTS]; // Absolute paths already resolved
+int canon_cache_used = 0;                     // Slots filled
+unsigned long long canon_cache_path_hash = 0; // PATH the cache was filled under
+pthread_mutex_t canon_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// History
+int hist_data_fd = -1;                    // Record file
+int hist_index_fd = -1;                   // Index file (also used as the append lock)
+char *hist_data = NULL;                   // Shared mapping of the record file
+char *hist_index = NULL;                  // Shared mapping of the index file
+long history_current = -1;                // Record of the command being executed
+int hist_opened = 0;                      // history_open has run (on first use)
+
+// Completion
+CompletionTrie command_trie = {NULL, 0, 0};   // Executables on PATH plus builtins
+int command_trie_built = 0;                   // Trie has been built at least once
+unsigned long long command_trie_path_hash = 0; // PATH the trie was built from
+struct timespec command_trie_mtimes[COMPLETION_MAX_PATH_DIRS]; // PATH directory mtimes at build time
+
 
 /**** UTILITY FUNCTIONS ****/
 
 // Safe memory allocation with error handling
-void* safe_malloc(size_t size) {
+void* (safe_malloc)(size_t size) {
     void* ptr = malloc(size);
     if (ptr == NULL) {
         fprintf(stderr, "Memory allocation failed!\n");
@@ -195,6 +1006,241 @@ void* safe_malloc(size_t size) {
     return ptr;
 }
 
+#ifdef MINISHELL_MEMSTATS
+// Add delta to a live counter and raise its peak if it went above it
+static void memstats_add_live(long *live, long *peak, long delta) {
+    long now = __atomic_add_fetch(live, delta, __ATOMIC_RELAXED);
+    long seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (now > seen &&
+           !__atomic_compare_exchange_n(peak, &seen, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// Fill in the header of a new block, count it against its site and return the
+// caller's part of it. A site is put on memstats_sites on its first block
+static void* memstats_track(AllocHeader *header, size_t size, AllocSite *site) {
+    if (!__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL)) {
+        AllocSite *head = __atomic_load_n(&memstats_sites, __ATOMIC_ACQUIRE);
+        do {
+            site->next = head;
+        } while (!__atomic_compare_exchange_n(&memstats_sites, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+
+    header->site = site;
+    header->tag = MEMSTATS_MAGIC << 48 | size;
+    __atomic_add_fetch(&site->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->bytes, (long)size, __ATOMIC_RELAXED);
+    memstats_add_live(&site->live_bytes, &site->peak_bytes, (long)size);
+    __atomic_add_fetch(&memstats_total.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memstats_total.bytes, (long)size, __ATOMIC_RELAXED);
+    memstats_add_live(&memstats_live_bytes, &memstats_peak_bytes, (long)size);
+    return header + 1;
+}
+
+// Take a block's bytes off its site's live count
+static void memstats_untrack(const AllocHeader *header) {
+    long size = (long)(header->tag & ((1ULL << 48) - 1));
+    __atomic_add_fetch(&header->site->frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&header->site->live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memstats_live_bytes, size, __ATOMIC_RELAXED);
+}
+
+// Header of a tracked block. Anything else is a double free or a block from libc
+// freed with the counting free(), and stops the shell
+static AllocHeader* memstats_header(void *ptr, const char *caller) {
+    AllocHeader *header = (AllocHeader*)ptr - 1;
+    if (header->tag >> 48 != MEMSTATS_MAGIC) {
+        fprintf(stderr, "ERR: memstats: %s of a block it did not allocate (%p)\n", caller, ptr);
+        abort();
+    }
+    return header;
+}
+
+// malloc() counted against site
+void* memstats_malloc(size_t size, AllocSite *site) {
+    if (size > SIZE_MAX - sizeof(AllocHeader)) return NULL;
+    AllocHeader *header = (malloc)(sizeof(AllocHeader) + size);
+    return header ? memstats_track(header, size, site) : NULL;
+}
+
+// calloc() counted against site
+void* memstats_calloc(size_t count, size_t size, AllocSite *site) {
+    if (size != 0 && count > (SIZE_MAX - sizeof(AllocHeader)) / size) return NULL;
+    AllocHeader *header = (calloc)(1, sizeof(AllocHeader) + count * size);
+    return header ? memstats_track(header, count * size, site) : NULL;
+}
+
+// realloc(): the old block counts as freed at its site and the new one as
+// allocated here, so growth loops show up as churn at the growing call
+void* memstats_realloc(void *ptr, size_t size, AllocSite *site) {
+    if (ptr == NULL) return memstats_malloc(size, site);
+    AllocHeader *old = memstats_header(ptr, "realloc");
+    if (size > SIZE_MAX - sizeof(AllocHeader)) return NULL;
+
+    AllocHeader before = *old;
+    AllocHeader *header = (realloc)(old, sizeof(AllocHeader) + size);
+    if (header == NULL) return NULL;
+    memstats_untrack(&before);
+    return memstats_track(header, size, site);
+}
+
+// strdup() counted against site
+char* memstats_strdup(const char *str, AllocSite *site) {
+    size_t len = strlen(str) + 1;
+    char *copy = memstats_malloc(len, site);
+    if (copy) memcpy(copy, str, len);
+    return copy;
+}
+
+// safe_malloc() counted against site
+void* memstats_safe_malloc(size_t size, AllocSite *site) {
+    void *ptr = memstats_malloc(size, site);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+// free() of a tracked block
+void memstats_free(void *ptr) {
+    if (ptr == NULL) return;
+
+    AllocHeader *header = memstats_header(ptr, "free");
+    memstats_untrack(header);
+    header->tag = 0;
+    (free)(header);
+}
+
+// Current totals, read field by field
+static AllocTotals memstats_totals_now(void) {
+    AllocTotals now;
+    now.allocs = __atomic_load_n(&memstats_total.allocs, __ATOMIC_RELAXED);
+    now.bytes = __atomic_load_n(&memstats_total.bytes, __ATOMIC_RELAXED);
+    return now;
+}
+
+// A new input line begins: what was allocated since the last one belongs to it
+void memstats_line_done(void) {
+    AllocTotals now = memstats_totals_now();
+    memstats_last_line.allocs = now.allocs - memstats_line_mark.allocs;
+    memstats_last_line.bytes = now.bytes - memstats_line_mark.bytes;
+    memstats_line_mark = now;
+}
+
+// Bracket one mcalc operation
+void memstats_mcalc_begin(void) {
+    memstats_mcalc_mark = memstats_totals_now();
+}
+
+void memstats_mcalc_end(void) {
+    AllocTotals now = memstats_totals_now();
+    memstats_mcalc_total.allocs += now.allocs - memstats_mcalc_mark.allocs;
+    memstats_mcalc_total.bytes += now.bytes - memstats_mcalc_mark.bytes;
+    memstats_mcalc_operations++;
+}
+
+// Sort order for `memstats` (0 live, 1 peak, 2 allocs, 3 bytes), read by compare_alloc_sites()
+static int memstats_sort = 0;
+
+// Largest first on the chosen column, then by place in the source
+static int compare_alloc_sites(const void *a, const void *b) {
+    const AllocSite *x = a, *y = b;
+    long vx, vy;
+
+    if (memstats_sort == 1) {
+        vx = x->peak_bytes;
+        vy = y->peak_bytes;
+    } else if (memstats_sort == 2) {
+        vx = x->allocs;
+        vy = y->allocs;
+    } else if (memstats_sort == 3) {
+        vx = x->bytes;
+        vy = y->bytes;
+    } else {
+        vx = x->live_bytes;
+        vy = y->live_bytes;
+    }
+    if (vx != vy) return vx > vy ? -1 : 1;
+    return x->line - y->line;
+}
+#endif
+
+// memstats [--sort=live|peak|allocs|bytes] [--top N]: allocations per call site,
+// with what the previous line and mcalc operations allocated
+int memstats_builtin(char **args, int args_len) {
+#ifdef MINISHELL_MEMSTATS
+    int sort = 0;
+    long top = MEMSTATS_TOP;
+
+    for (int i = 1; i < args_len; i++) {
+        if (strncmp(args[i], "--sort=", 7) == 0) {
+            const char *key = args[i] + 7;
+            if (strcmp(key, "live") == 0) sort = 0;
+            else if (strcmp(key, "peak") == 0) sort = 1;
+            else if (strcmp(key, "allocs") == 0) sort = 2;
+            else if (strcmp(key, "bytes") == 0) sort = 3;
+            else sort = -1;
+        } else if (strcmp(args[i], "--top") == 0 && i + 1 < args_len) {
+            char *end = NULL;
+            top = strtol(args[++i], &end, 10);
+            if (*end != '\0' || top <= 0) sort = -1;
+        } else {
+            sort = -1;
+        }
+        if (sort < 0) {
+            fprintf(stderr, "ERR: Usage: memstats [--sort=live|peak|allocs|bytes] [--top N]\n");
+            return 1;
+        }
+    }
+
+    // Copy the sites, so sorting does not race with other threads' counting
+    int count = 0;
+    AllocSite *head = __atomic_load_n(&memstats_sites, __ATOMIC_ACQUIRE);
+    for (AllocSite *site = head; site; site = site->next) count++;
+    AllocSite *sites = safe_malloc((count + 1) * sizeof(AllocSite));
+    int n = 0;
+    for (AllocSite *site = head; site && n < count; site = site->next) {
+        sites[n].function = site->function;
+        sites[n].line = site->line;
+        sites[n].allocs = __atomic_load_n(&site->allocs, __ATOMIC_RELAXED);
+        sites[n].frees = __atomic_load_n(&site->frees, __ATOMIC_RELAXED);
+        sites[n].bytes = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+        sites[n].live_bytes = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+        sites[n].peak_bytes = __atomic_load_n(&site->peak_bytes, __ATOMIC_RELAXED);
+        n++;
+    }
+    memstats_sort = sort;
+    qsort(sites, n, sizeof(AllocSite), compare_alloc_sites);
+
+    printf("%-32s %10s %10s %12s %10s %10s\n", "site", "allocs", "frees", "bytes", "live", "peak");
+    for (int i = 0; i < n && i < top; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%d", sites[i].function, sites[i].line);
+        printf("%-32.32s %10ld %10ld %12ld %10ld %10ld\n", name, sites[i].allocs, sites[i].frees,
+               sites[i].bytes, sites[i].live_bytes, sites[i].peak_bytes);
+    }
+    AllocTotals total = memstats_totals_now();
+    printf("%-32s %10ld %10s %12ld %10ld %10ld\n", "total", total.allocs, "", total.bytes,
+           __atomic_load_n(&memstats_live_bytes, __ATOMIC_RELAXED),
+           __atomic_load_n(&memstats_peak_bytes, __ATOMIC_RELAXED));
+    printf("%d sites\n", n);
+    printf("previous line: %ld allocations, %ld bytes\n", memstats_last_line.allocs, memstats_last_line.bytes);
+    if (memstats_mcalc_operations > 0) {
+        printf("mcalc: %ld operations, %.1f allocations and %.0f bytes per operation\n",
+               memstats_mcalc_operations, (double)memstats_mcalc_total.allocs / memstats_mcalc_operations,
+               (double)memstats_mcalc_total.bytes / memstats_mcalc_operations);
+    }
+
+    free(sites);
+    return 0;
+#else
+    (void)args;
+    (void)args_len;
+    fprintf(stderr, "ERR: memstats: this shell was built without -DMINISHELL_MEMSTATS\n");
+    return 1;
+#endif
+}
+
 // Error handling for child processes when exec fails
 void handle_execvp_errors_in_child(char **args) {
     if (!args || !args[0]) {
@@ -239,6 +1285,18 @@ void sigxfsz_handler(int sig) {
     exit(1);
 }
 
+// Find a builtin command by name
+const BuiltinCommand* find_builtin_command(const char *cmd_name) {
+    if (!cmd_name) return NULL;
+
+    for (int i = 0; builtin_commands[i].name != NULL; i++) {
+        if (strcmp(builtin_commands[i].name, cmd_name) == 0) {
+            return &builtin_commands[i];
+        }
+    }
+    return NULL;
+}
+
 // Find a custom command by name
 const CustomCommand* find_custom_command(const char *cmd_name) {
     if (!cmd_name) return NULL;
@@ -274,8 +1332,8 @@ void sigchld_handler(int sig) {
         average_time = total_time_all / total_cmd_count;
         update_min_max_time(total_time, &min_time, &max_time);
 
-        if (current_command[0] != '\0') {
-            append_to_log(output_file, current_command, total_time);
+        if (current_command[0] != '\0' && log_format == LOG_FORMAT_TEXT) {
+            log_command_time(current_command, total_time);
         }
     } else {
         // Check for signal termination
@@ -313,67 +1371,213 @@ void sigchld_handler(int sig) {
     }
 
     // Clean up zombie processes and handle background process success
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
         if (background_flag && pid == left_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
             total_cmd_count += 1;
-            if (current_command[0] != '\0') {
-                append_to_log(output_file, current_command, 0.0);
+            if (current_command[0] != '\0' && log_format == LOG_FORMAT_TEXT) {
+                log_command_time(current_command, 0.0);
             }
         }
+        background_job_finished(pid, status, &usage);
     }
+    shm_stats_publish();
 }
 
-// Redirect stderr to a file
-void redirect_stderr_to_file(const char *filename) {
-    if (original_stderr_fd == -1) {
-        original_stderr_fd = dup(STDERR_FILENO);
+// Move <, >, >>, 2>, 2>> and 2>&1 (with separate or attached targets) out of an argument array.
+// Returns -1 and leaves args untouched on a malformed redirection.
+int parse_redirections(char **args, int *args_len, Redirections *redir) {
+    redir->count = 0;
+    if (!args) return 0;
+
+    // First pass: validate so that args is only modified when everything parses
+    int ops = 0;
+    for (int i = 0; args[i]; i++) {
+        int fd, flags, dup_fd;
+        const char *target = redirection_operator(args[i], &fd, &flags, &dup_fd);
+        if (!target) continue;
+
+        if (dup_fd == -1 && *target == '\0') {
+            if (!args[i + 1]) {
+                printf("ERR: Missing file for redirection\n");
+                return -1;
+            }
+            i++;
+        }
+        if (++ops > MAX_REDIRECTIONS) {
+            printf("ERR: Too many redirections\n");
+            return -1;
+        }
     }
+    if (ops == 0) return 0;
+
+    int out = 0;
+    for (int i = 0; args[i]; i++) {
+        int fd, flags, dup_fd;
+        const char *target = redirection_operator(args[i], &fd, &flags, &dup_fd);
+        if (!target) {
+            args[out++] = args[i];
+            continue;
+        }
 
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        perror("open for stderr redirection");
-        return;
-    }
+        char *operator_token = args[i];
+        char *target_token = NULL;
+        if (dup_fd == -1 && *target == '\0') {
+            target_token = args[++i];
+            target = target_token;
+        }
 
-    if (dup2(fd, STDERR_FILENO) < 0) {
-        perror("dup2 for stderr redirection");
-        close(fd);
-        return;
+        Redirection *op = &redir->ops[redir->count++];
+        op->fd = fd;
+        op->flags = flags;
+        op->dup_fd = dup_fd;
+        op->file = NULL;
+        if (dup_fd == -1) {
+            op->file = strdup(target);
+            if (!op->file) {
+                fprintf(stderr, "Memory allocation failed!\n");
+                exit(1);
+            }
+        }
+
+        free(operator_token);
+        free(target_token);
     }
+    args[out] = NULL;
+    *args_len = out;
+    return 0;
+}
 
-    close(fd);
-    stderr_redirected = 1;
+// Recognize a redirection token; returns the attached target ("" if separate) or NULL
+const char* redirection_operator(const char *token, int *fd, int *flags, int *dup_fd) {
+    *dup_fd = -1;
+
+    if (strcmp(token, "2>&1") == 0) {
+        *fd = STDERR_FILENO;
+        *flags = 0;
+        *dup_fd = STDOUT_FILENO;
+        return token + 4;
+    }
+    if (strncmp(token, "2>>", 3) == 0) {
+        *fd = STDERR_FILENO;
+        *flags = O_WRONLY | O_CREAT | O_APPEND;
+        return token + 3;
+    }
+    if (strncmp(token, "2>", 2) == 0) {
+        *fd = STDERR_FILENO;
+        *flags = O_WRONLY | O_CREAT | O_TRUNC;
+        return token + 2;
+    }
+    if (strncmp(token, ">>", 2) == 0) {
+        *fd = STDOUT_FILENO;
+        *flags = O_WRONLY | O_CREAT | O_APPEND;
+        return token + 2;
+    }
+    if (token[0] == '>') {
+        *fd = STDOUT_FILENO;
+        *flags = O_WRONLY | O_CREAT | O_TRUNC;
+        return token + 1;
+    }
+    if (token[0] == '<') {
+        *fd = STDIN_FILENO;
+        *flags = O_RDONLY;
+        return token + 1;
+    }
+    return NULL;
 }
 
-// Restore stderr to its original file descriptor
-void restore_stderr(void) {
-    if (stderr_redirected && original_stderr_fd != -1) {
-        dup2(original_stderr_fd, STDERR_FILENO);
-        close(original_stderr_fd);
-        original_stderr_fd = -1;
-        stderr_redirected = 0;
+// Apply redirections in order; returns -1 (after reporting) if a file can't be opened
+int apply_redirections(const Redirections *redir) {
+    for (int i = 0; i < redir->count; i++) {
+        const Redirection *op = &redir->ops[i];
+
+        if (op->dup_fd != -1) {
+            if (dup2(op->dup_fd, op->fd) < 0) {
+                perror("dup2");
+                return -1;
+            }
+            continue;
+        }
+
+        int fd = open(op->file, op->flags | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(op->file);
+            return -1;
+        }
+        if (fd != op->fd) {
+            if (dup2(fd, op->fd) < 0) {
+                if (errno == EMFILE) {
+                    fprintf(stderr, "Too many open files!\n");
+                } else {
+                    perror("dup2");
+                }
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        } else {
+            // Landed on the target descriptor itself: keep it across exec
+            fcntl(fd, F_SETFD, 0);
+        }
     }
+    return 0;
 }
 
-// Check command arguments for 2> redirection
-void check_and_redirect_stderr(char **args) {
-    if (!args) return;
+// Apply redirections inside the shell process (builtins, my_tee), saving the descriptors they replace
+int save_and_apply_redirections(const Redirections *redir, int saved[3]) {
+    for (int fd = 0; fd < 3; fd++) saved[fd] = -1;
+    if (redir->count == 0) return 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < redir->count; i++) {
+        int fd = redir->ops[i].fd;
+        if (saved[fd] == -1) saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+    }
+
+    if (apply_redirections(redir) != 0) {
+        restore_redirections(saved);
+        return -1;
+    }
+    return 0;
+}
 
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "2>") == 0 && args[i+1] != NULL) {
-            redirect_stderr_to_file(args[i+1]);
+// Put back descriptors saved by save_and_apply_redirections()
+void restore_redirections(int saved[3]) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved[fd] != -1) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+            saved[fd] = -1;
+        }
+    }
+}
 
-            // Remove the redirection operator and filename from arguments
-            int j;
-            for (j = i; args[j+2] != NULL; j++) {
-                args[j] = args[j+2];
+// Deep copy a redirection list
+void copy_redirections(Redirections *dst, const Redirections *src) {
+    *dst = *src;
+    for (int i = 0; i < src->count; i++) {
+        if (src->ops[i].file) {
+            dst->ops[i].file = strdup(src->ops[i].file);
+            if (!dst->ops[i].file) {
+                fprintf(stderr, "Memory allocation failed!\n");
+                exit(1);
             }
-            args[j] = NULL; // Properly terminate the array
-            break;
         }
     }
 }
 
+// Release the file names of a redirection list
+void free_redirections(Redirections *redir) {
+    for (int i = 0; i < redir->count; i++) {
+        free(redir->ops[i].file);
+        redir->ops[i].file = NULL;
+    }
+    redir->count = 0;
+}
+
 // Check if input contains the -a (append) flag
 void check_append_flag(char **args, int args_len, int *flg) {
     *flg = 0;
@@ -616,6 +1820,7 @@ char **check_rsc_lmt(char **argu, int *args_len) {
             }
             return NULL;
         }
+        PROBE4(rlimit_applied, resource, rtype, soft, hard);
     }
 
     // Count remaining arguments for new array
@@ -681,6 +1886,7 @@ int my_tee_handler(void) {
 
     char buffer[4096];
     ssize_t bytes_read;
+    long total_bytes = 0;
 
     // Open the output file
     FILE *file = NULL;
@@ -705,6 +1911,8 @@ int my_tee_handler(void) {
         if (file && fwrite(buffer, 1, bytes_read, file) != bytes_read) {
             perror("my_tee: write to file error");
         }
+        total_bytes += bytes_read;
+        PROBE3(tee_flush, bytes_read, total_bytes, file ? r_args[1] : NULL);
     }
 
     // Clean up
@@ -757,13 +1965,14 @@ char **split_to_args(const char *string, const char *delimiter, int *count) {
     char **argf = NULL;
     *count = 0;
 
-    // Tokenize the string
-    char *token = strtok(input_copy, delimiter);
+    // Tokenize the string (strtok_r: the policy reload thread splits rules too)
+    char *save = NULL;
+    char *token = strtok_r(input_copy, delimiter, &save);
     while (token != NULL) {
         // Trim whitespace from the token
         char *trimmed_token = trim_inplace(token);
         if (strlen(trimmed_token) == 0) {
-            token = strtok(NULL, delimiter);
+            token = strtok_r(NULL, delimiter, &save);
             continue; // Skip empty tokens after trimming
         }
 
@@ -787,7 +1996,7 @@ char **split_to_args(const char *string, const char *delimiter, int *count) {
         }
 
         (*count)++;
-        token = strtok(NULL, delimiter);
+        token = strtok_r(NULL, delimiter, &save);
     }
 
     // Null-terminate the array if any tokens were added
@@ -882,13 +2091,14 @@ int pipe_split(char *input, char *left_cmd, char *right_cmd) {
         return -1; // Memory allocation failed
     }
 
-    char *token = strtok(input_copy, "|");
+    char *save = NULL;
+    char *token = strtok_r(input_copy, "|", &save);
     int result;
 
     if (token) {
         strcpy(left_cmd, token);
 
-        token = strtok(NULL, "|");
+        token = strtok_r(NULL, "|", &save);
         if (token) {
             strcpy(right_cmd, token);
             result = 1; // pipe exists
@@ -915,172 +2125,5095 @@ void strip_crlf(char *str) {
         len--;
     }
 }
-// Read lines from a file into a string array
-char** read_file_lines(const char* filename, int* num_lines) {
-    FILE* file = fopen(filename, "r");
-    if (!file) {
-        perror("Error opening file for reading");
-        *num_lines = 0;
-        return NULL;
+// Count the newlines in a buffer, 16 bytes per step where SSE2 is available
+static size_t count_newlines(const char *data, size_t size) {
+    size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        count += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+#endif
+    for (; i < size; i++) {
+        count += data[i] == '\n';
     }
+    return count;
+}
 
-    int capacity = 64;
-    char** lines = safe_malloc(capacity * sizeof(char*));
+// Append data[start, end) to lines unless it is blank once spaces, tabs and CR are trimmed
+static void add_line_view(const char *data, size_t start, size_t end, LineView *lines, size_t *count) {
+    while (start < end && (data[start] == ' ' || data[start] == '\t' || data[start] == '\r')) start++;
+    while (end > start && (data[end - 1] == ' ' || data[end - 1] == '\t' || data[end - 1] == '\r')) end--;
+    if (start == end) return;
 
-    char buffer[MAX_INPUT_LENGTH];
-    int count = 0;
+    lines[*count].offset = start;
+    lines[*count].length = end - start;
+    (*count)++;
+}
 
-    while (fgets(buffer, sizeof(buffer), file)) {
-        if (count >= capacity - 1) {
-            capacity *= 2;
-            char** new_lines = realloc(lines, capacity * sizeof(char*));
-            if (!new_lines) {
-                fprintf(stderr, "Memory allocation failed!\n");
-                for (int i = 0; i < count; i++) {
-                    free(lines[i]);
-                }
-                free(lines);
-                fclose(file);
-                *num_lines = 0;
-                return NULL;
-            }
-            lines = new_lines;
+// Index the non-blank lines of a buffer without copying them. A first pass counts
+// newlines so the views are allocated once; the second walks the newline bitmasks
+LineView* index_lines(const char *data, size_t size, size_t *count) {
+    LineView *lines = safe_malloc((count_newlines(data, size) + 1) * sizeof(LineView));
+    size_t n = 0, start = 0, i = 0;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        while (mask) {
+            size_t end = i + (size_t)__builtin_ctz(mask);
+            add_line_view(data, start, end, lines, &n);
+            start = end + 1;
+            mask &= mask - 1;
         }
-
-        buffer[strcspn(buffer, "\n")] = '\0';
-        trim_inplace(buffer);
-
-        if (buffer[0] == '\0') {
-            continue;
+    }
+#endif
+    for (; i < size; i++) {
+        if (data[i] == '\n') {
+            add_line_view(data, start, i, lines, &n);
+            start = i + 1;
         }
+    }
+    add_line_view(data, start, size, lines, &n);   // Last line may lack a newline
 
-        lines[count] = strdup(buffer);
-        if (!lines[count]) {
-            fprintf(stderr, "Memory allocation failed!\n");
-            for (int i = 0; i < count; i++) {
-                free(lines[i]);
-            }
-            free(lines);
-            fclose(file);
-            *num_lines = 0;
-            return NULL;
-        }
+    *count = n;
+    return lines;
+}
 
-        count++;
+// Map a text file read-only and index its lines; lines of any length are kept whole
+int line_file_open(const char *path, LineFile *file) {
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Error opening file for reading");
+        return -1;
     }
 
-    lines[count] = NULL;
-    fclose(file);
-    *num_lines = count;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error opening file for reading");
+        close(fd);
+        return -1;
+    }
 
-    if (count > 0 && count < capacity - 1) {
-        char** new_lines = realloc(lines, (count + 1) * sizeof(char*));
-        if (new_lines) {
-            lines = new_lines;
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Error mapping file");
+            close(fd);
+            return -1;
         }
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        file->data = data;
+        file->size = (size_t)st.st_size;
     }
+    close(fd);
 
-    return lines;
+    file->lines = index_lines(file->data, file->size, &file->count);
+    return 0;
+}
+
+// Unmap a line file and free its index
+void line_file_close(LineFile *file) {
+    if (file->data) munmap((void*)file->data, file->size);
+    free(file->lines);
+    memset(file, 0, sizeof(*file));
 }
 
 // Check if a command is in the list of dangerous commands
 int is_dangerous_command(char **user_args, int user_args_len) {
+    DangerMatch match;
+    int verdict = classify_dangerous_command(user_args, user_args_len, &match);
+    return report_danger_verdict(verdict, &match);
+}
+
+// Classify a command against the dangerous commands list without reporting it
+int classify_dangerous_command(char **user_args, int user_args_len, DangerMatch *match) {
+    match->rule = NULL;
+    match->rule_id = -1;
+    match->index = NULL;
+    match->token_distance = 0;
+    match->char_distance = 0;
     if (user_args == NULL || user_args_len == 0) {
-        return 0;
+        return DANGER_ALLOW;
     }
 
-    int is_exact_match = 0;
-    int is_semi_dangerous = 0;
-    char *similar_command = NULL;
-
-    for (int i = 0; i < numLines; i++) {
-        int temp_count = 0;
-        char **dangerous_args = split_to_args(Danger_CMD[i], delim, &temp_count);
-        if (dangerous_args == NULL) continue;
-
-        // Sanitize each token
-        for (int k = 0; k < temp_count; k++) {
-            strip_crlf(dangerous_args[k]);
-        }
+    // The reload thread may swap the index at any time; use one snapshot throughout
+    DangerIndex *index = policy_ensure_loaded();
+    if (index == NULL) {
+        return DANGER_BLOCK;   // No list to check against: refuse (match->rule stays NULL)
+    }
 
-        for (int k = 0; k < user_args_len; k++) {
-            strip_crlf(user_args[k]);
-        }
+    for (int k = 0; k < user_args_len; k++) {
+        strip_crlf(user_args[k]);
+    }
 
-        // Check if the command name matches
-        if (strcmp(user_args[0], dangerous_args[0]) == 0) {
-            // Check for full exact match
-            if (user_args_len == temp_count) {
-                is_exact_match = 1;
-                for (int j = 0; j < user_args_len; j++) {
-                    if (strcmp(user_args[j], dangerous_args[j]) != 0) {
-                        is_exact_match = 0;
-                        break;
-                    }
-                }
-            }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int verdict = verdict_cache_lookup(index, user_args, user_args_len, match);
+    if (verdict >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        verdict_cache_hit_seconds += time_diff(t0, t1);
+        return verdict;
+    }
 
-            if (is_exact_match) {
-                fprintf(stderr,"ERR: Dangerous command detected (\"%s\"). Execution prevented.\n", Danger_CMD[i]);
-                fflush(stdout);
-                dangerous_cmd_blocked_count++;
-                free_args(dangerous_args);
-                return 1; // BLOCK execution
-            }
+    verdict = classify_against_index(index, user_args, user_args_len, match);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    verdict_cache_miss_seconds += time_diff(t0, t1);
+    verdict_cache_store(index, user_args, user_args_len, verdict, match);
+    return verdict;
+}
 
-            // Not exact, but same base command = semi-dangerous
-            is_semi_dangerous = 1;
-            similar_command = Danger_CMD[i];
-        }
+// Classify the glob-expanded form of a command and keep whichever of its verdict and
+// the one for the line as typed is stricter. Rules may name the files a pattern
+// expands to ("echo danger now" against "echo danger n?w") or the pattern itself
+void classify_expanded_command(char **user_args, int user_args_len, int *verdict, DangerMatch *match) {
+    DangerMatch expanded_match;
+    int expanded = classify_dangerous_command(user_args, user_args_len, &expanded_match);
+    if (expanded > *verdict) {
+        *verdict = expanded;
+        *match = expanded_match;
+    }
+}
 
-        free_args(dangerous_args);
+// Classify CR/LF-stripped arguments against one blocklist index, bypassing the verdict cache
+static int classify_against_index(DangerIndex *index, char **user_args, int user_args_len, DangerMatch *match) {
+    // Canonicalize once so "rm -fr //", "/bin/rm -r -f /." and "rm -rf /" compare equal
+    int canon_count = 0;
+    char **canon = canonical_args(user_args, user_args_len, &canon_count);
+
+    // A full match of the exact, canonical or pattern form blocks, reporting the
+    // first such line in the file
+    long candidates[4] = {
+        danger_index_find_exact(index, user_args, user_args_len),
+        danger_index_find_canonical(index, canon, canon_count),
+        danger_index_match_patterns(index, user_args, user_args_len),
+        danger_index_match_patterns(index, canon, canon_count),
+    };
+    long rule = -1;
+    for (int k = 0; k < 4; k++) {
+        if (candidates[k] >= 0 && (rule < 0 || candidates[k] < rule)) rule = candidates[k];
+    }
+    if (rule >= 0) {
+        free(canon);
+        match->rule = danger_rule_line(index, (uint32_t)rule);
+        match->rule_id = rule;
+        match->index = index;
+        return DANGER_BLOCK;
     }
 
-    if (is_semi_dangerous && similar_command) {
-        fprintf(stderr,"WARNING: Command similar to dangerous command (\"%s\"). Proceed with caution.\n", similar_command);
-        fflush(stdout);
-        semi_dangerous_cmd_count++;
-        flag_semi_dangerous = 1;
+    // Same base command = semi-dangerous, reporting the closest such line in the file
+    rule = danger_index_find_head(index, canon[0]);
+    if (rule >= 0) {
+        rule = danger_index_closest(index, rule, canon, canon_count,
+                                    &match->token_distance, &match->char_distance);
+    }
+    free(canon);
+    if (rule >= 0) {
+        match->rule = danger_rule_line(index, (uint32_t)rule);
+        match->rule_id = rule;
+        match->index = index;
+        return DANGER_WARN;
     }
 
-    return 0; // ALLOW execution
+    return DANGER_ALLOW;
 }
 
-// Calculate time difference between two timespec structs
-float time_diff(struct timespec start, struct timespec end) {
-    long sec_diff = end.tv_sec - start.tv_sec;
-    long nsec_diff = end.tv_nsec - start.tv_nsec;
+// Hash of an argument vector (tokens separated by NUL bytes)
+unsigned long long hash_args(char **args, int count) {
+    unsigned long long hash = 1469598103934665603ULL;
 
-    if (nsec_diff < 0) {
-        nsec_diff += 1000000000;
-        sec_diff -= 1;
+    for (int i = 0; i < count; i++) {
+        for (const char *c = args[i]; *c; c++) {
+            hash ^= (unsigned char)*c;
+            hash *= 1099511628211ULL;
+        }
+        hash *= 1099511628211ULL;   // Token separator
+    }
+    return hash;
+}
+
+// Smallest power of two holding count entries at no more than 50% load
+static uint32_t danger_index_slots(uint32_t count) {
+    uint32_t slots = 16;
+    while (slots < count * 2) slots <<= 1;
+    return slots;
+}
+
+// String at off in the strings section, or "" if off lies outside it
+static const char* danger_string(const DangerIndex *index, uint64_t off) {
+    return off < index->header->strings_size ? index->strings + off : "";
+}
+
+// Rule id, or NULL if there is no such rule or its token range or canonical line
+// does not fit the blob (only a damaged compiled file gets here)
+static const DangerRule* danger_rule(const DangerIndex *index, uint64_t id) {
+    const DangerIndexHeader *hdr = index->header;
+    if (id >= hdr->rule_count) return NULL;
+
+    const DangerRule *rule = &index->rules[id];
+    if ((uint64_t)rule->first_token + rule->token_count > hdr->token_count ||
+        rule->canon_line_off >= hdr->strings_size ||
+        rule->canon_line_len >= hdr->strings_size - rule->canon_line_off) {
+        return NULL;
+    }
+    return rule;
+}
+
+// Previous rule with the same canonical argv[0] as rule r, or -1. Chains only point
+// back, which also ends a damaged one
+static long danger_prev_same_head(const DangerRule *rule, long r) {
+    long prev = (long)rule->prev_same_head - 1;
+    return prev < r ? prev : -1;
+}
+
+// Token t of a rule
+static const char* danger_rule_token(const DangerIndex *index, const DangerRule *rule, uint32_t t) {
+    return danger_string(index, index->tokens[rule->first_token + t]);
+}
+
+// Whether a rule's tokens equal args exactly
+static int danger_rule_equals(const DangerIndex *index, const DangerRule *rule, char **args, int count) {
+    if (rule->token_count != (uint32_t)count) return 0;
+
+    for (int t = 0; t < count; t++) {
+        if (strcmp(danger_rule_token(index, rule, t), args[t]) != 0) return 0;
+    }
+    return 1;
+}
+
+// Point the section pointers of an index at its blob and compile its pattern edges
+static void danger_index_attach(DangerIndex *index) {
+    const char *base = (const char*)index->blob;
+
+    index->header = (const DangerIndexHeader*)base;
+    index->rules = (const DangerRule*)(base + index->header->rules_off);
+    index->tokens = (const uint32_t*)(base + index->header->tokens_off);
+    index->exact = (const uint32_t*)(base + index->header->exact_off);
+    index->head = (const uint32_t*)(base + index->header->head_off);
+    index->canon = (const uint32_t*)(base + index->header->canon_off);
+    index->nodes = (const PatternNode*)(base + index->header->nodes_off);
+    index->edges = (const PatternEdge*)(base + index->header->edges_off);
+    index->strings = base + index->header->strings_off;
+
+    // Matching state lives beside the blob. Zeroed pages come lazily from calloc,
+    // so attaching costs the same for ten rules or a million
+    uint32_t node_count = index->header->node_count;
+    uint32_t edge_count = index->header->edge_count;
+    index->patterns = calloc(edge_count + 1, sizeof(GlobPattern));
+    index->active[0] = calloc(node_count, sizeof(uint32_t));
+    index->active[1] = calloc(node_count, sizeof(uint32_t));
+    index->seen = calloc(node_count, sizeof(uint32_t));
+    if (!index->patterns || !index->active[0] || !index->active[1] || !index->seen) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(1);
+    }
+    index->stamp = 0;
+}
+
+// Whether a blocklist token needs the pattern trie
+static int danger_token_is_pattern(const char *token) {
+    return strcmp(token, "**") == 0 || has_glob_chars(token);
+}
+
+// Trie edge under construction
+typedef struct {
+    unsigned long long hash;
+    const char *text;          // Token (owned by the tokenized lines)
+    uint32_t token;            // Global token index, resolved to a string offset later
+    uint32_t parent;
+    uint32_t child;
+    int is_pattern;
+    int next;                  // Next edge of the same parent (-1 terminates)
+} PatternBuildEdge;
+
+// Trie under construction; flattened into the blob once every rule is in
+typedef struct {
+    PatternNode *nodes;
+    int node_count;
+    int node_capacity;
+    PatternBuildEdge *edges;
+    int edge_count;
+    int edge_capacity;
+    int *first_edge;           // Per node edge list (-1 terminates)
+    int *lookup;               // (parent, token) -> edge + 1, open addressing
+    uint32_t lookup_slots;
+} PatternBuild;
+
+// Add an empty node to a trie under construction
+static uint32_t pattern_build_node(PatternBuild *b, int self_loop) {
+    if (b->node_count == b->node_capacity) {
+        b->node_capacity = b->node_capacity ? b->node_capacity * 2 : 64;
+        b->nodes = realloc(b->nodes, b->node_capacity * sizeof(PatternNode));
+        b->first_edge = realloc(b->first_edge, b->node_capacity * sizeof(int));
+        if (!b->nodes || !b->first_edge) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+    memset(&b->nodes[b->node_count], 0, sizeof(PatternNode));
+    b->nodes[b->node_count].self_loop = (uint32_t)self_loop;
+    b->first_edge[b->node_count] = -1;
+    return (uint32_t)b->node_count++;
+}
+
+// Follow (or create) the edge for one rule token
+static uint32_t pattern_build_step(PatternBuild *b, uint32_t parent, const char *text, uint32_t token) {
+    if (strcmp(text, "**") == 0) {
+        if (b->nodes[parent].star_child == 0) {
+            uint32_t child = pattern_build_node(b, 1);
+            b->nodes[parent].star_child = child + 1;
+        }
+        return b->nodes[parent].star_child - 1;
+    }
+
+    int is_pattern = has_glob_chars(text);
+    unsigned long long hash = hash_string(text);
+    uint32_t mask = b->lookup_slots - 1;
+    uint32_t slot = (uint32_t)((hash ^ (parent * 0x9E3779B97F4A7C15ULL)) >> 7) & mask;
+
+    while (b->lookup[slot] != 0) {
+        PatternBuildEdge *edge = &b->edges[b->lookup[slot] - 1];
+        if (edge->parent == parent && edge->hash == hash && strcmp(edge->text, text) == 0) {
+            return edge->child;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    uint32_t child = pattern_build_node(b, 0);
+    if (b->edge_count == b->edge_capacity) {
+        b->edge_capacity = b->edge_capacity ? b->edge_capacity * 2 : 64;
+        b->edges = realloc(b->edges, b->edge_capacity * sizeof(*b->edges));
+        if (!b->edges) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+    PatternBuildEdge *edge = &b->edges[b->edge_count];
+    edge->hash = hash;
+    edge->text = text;
+    edge->token = token;
+    edge->parent = parent;
+    edge->child = child;
+    edge->is_pattern = is_pattern;
+    edge->next = b->first_edge[parent];
+    b->first_edge[parent] = b->edge_count;
+    b->lookup[slot] = ++b->edge_count;
+
+    if (is_pattern) b->nodes[parent].pattern_count++;
+    else b->nodes[parent].literal_count++;
+    return child;
+}
+
+// Order literal edges by hash so lookups can binary search them
+static int compare_pattern_edges(const void *a, const void *b) {
+    const PatternEdge *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return 0;
+}
+
+// Tokenize the blocklist once and build its lookup tables in a single flat blob
+DangerIndex* danger_index_build(const char *text, const LineView *lines, int count) {
+    // Tokenize every line up front to size the blob
+    char ***line_args = safe_malloc((count + 1) * sizeof(char**));
+    int *line_argc = safe_malloc((count + 1) * sizeof(int));
+    char ***line_canon = safe_malloc((count + 1) * sizeof(char**));
+    int *line_canon_count = safe_malloc((count + 1) * sizeof(int));
+    int *rule_line = safe_malloc((count + 1) * sizeof(int));
+    uint32_t rule_count = 0, token_count = 0, pattern_tokens = 0;
+    uint64_t strings_size = 1;   // offset 0 holds an empty string
+    size_t line_cap = 0;
+    char *line = NULL;           // NUL-terminated copy of the line being tokenized
+
+    for (int i = 0; i < count; i++) {
+        if (lines[i].length + 1 > line_cap) {
+            line_cap = lines[i].length + 1;
+            free(line);
+            line = safe_malloc(line_cap);
+        }
+        memcpy(line, text + lines[i].offset, lines[i].length);
+        line[lines[i].length] = '\0';
+
+        line_args[i] = split_to_args(line, delim, &line_argc[i]);
+        line_canon[i] = NULL;
+        if (line_args[i] != NULL && line_argc[i] == 0) {
+            free_args(line_args[i]);
+            line_args[i] = NULL;
+        }
+        if (line_args[i] == NULL) continue;
+
+        int is_pattern = 0;
+        for (int k = 0; k < line_argc[i]; k++) {
+            strip_crlf(line_args[i][k]);
+            strings_size += strlen(line_args[i][k]) + 1;
+            is_pattern |= danger_token_is_pattern(line_args[i][k]);
+        }
+        if (is_pattern) pattern_tokens += line_argc[i];
+        line_canon[i] = canonical_args(line_args[i], line_argc[i], &line_canon_count[i]);
+        strings_size += strlen(line_canon[i][0]) + 1;
+        for (int k = 0; k < line_canon_count[i]; k++) {
+            strings_size += strlen(line_canon[i][k]) + 1;
+        }
+        strings_size += lines[i].length + 1;
+        rule_line[rule_count] = i;
+        token_count += line_argc[i];
+        rule_count++;
+    }
+
+    // Rules with wildcards go into a token trie; literal ones are fully served by the hash tables
+    PatternBuild build;
+    memset(&build, 0, sizeof(build));
+    build.lookup_slots = danger_index_slots(pattern_tokens);
+    build.lookup = safe_malloc(build.lookup_slots * sizeof(int));
+    memset(build.lookup, 0, build.lookup_slots * sizeof(int));
+    pattern_build_node(&build, 0);
+
+    for (int i = 0, r = 0, t = 0; i < count; i++) {
+        if (line_args[i] == NULL) continue;
+
+        int is_pattern = 0;
+        for (int k = 0; k < line_argc[i]; k++) {
+            is_pattern |= danger_token_is_pattern(line_args[i][k]);
+        }
+        if (is_pattern) {
+            uint32_t node = 0;
+            for (int k = 0; k < line_argc[i]; k++) {
+                node = pattern_build_step(&build, node, line_args[i][k], (uint32_t)(t + k));
+            }
+            // Rule ids grow with file order, so the first rule to end here keeps the node
+            if (build.nodes[node].accept == 0) build.nodes[node].accept = (uint32_t)r + 1;
+        }
+        t += line_argc[i];
+        r++;
+    }
+
+    uint32_t exact_slots = danger_index_slots(rule_count);
+    uint32_t head_slots = danger_index_slots(rule_count);
+    uint32_t canon_slots = danger_index_slots(rule_count);
+    uint32_t node_count = (uint32_t)build.node_count;
+    uint32_t edge_count = (uint32_t)build.edge_count;
+
+    uint64_t rules_off = (sizeof(DangerIndexHeader) + 7) & ~7ULL;
+    uint64_t nodes_off = rules_off + (uint64_t)rule_count * sizeof(DangerRule);
+    uint64_t edges_off = (nodes_off + (uint64_t)node_count * sizeof(PatternNode) + 7) & ~7ULL;
+    uint64_t tokens_off = edges_off + (uint64_t)edge_count * sizeof(PatternEdge);
+    uint64_t exact_off = (tokens_off + (uint64_t)token_count * sizeof(uint32_t) + 7) & ~7ULL;
+    uint64_t head_off = exact_off + (uint64_t)exact_slots * sizeof(uint32_t);
+    uint64_t canon_off = head_off + (uint64_t)head_slots * sizeof(uint32_t);
+    uint64_t strings_off = canon_off + (uint64_t)canon_slots * sizeof(uint32_t);
+    uint64_t total_size = (strings_off + strings_size + 7) & ~7ULL;
+
+    char *blob = safe_malloc(total_size);
+    memset(blob, 0, total_size);
+
+    DangerIndexHeader *hdr = (DangerIndexHeader*)blob;
+    memcpy(hdr->magic, DANGER_INDEX_MAGIC, sizeof(hdr->magic));
+    hdr->version = DANGER_INDEX_VERSION;
+    hdr->rule_count = rule_count;
+    hdr->token_count = token_count;
+    hdr->exact_slots = exact_slots;
+    hdr->head_slots = head_slots;
+    hdr->canon_slots = canon_slots;
+    hdr->node_count = node_count;
+    hdr->edge_count = edge_count;
+    hdr->rules_off = rules_off;
+    hdr->nodes_off = nodes_off;
+    hdr->edges_off = edges_off;
+    hdr->tokens_off = tokens_off;
+    hdr->exact_off = exact_off;
+    hdr->head_off = head_off;
+    hdr->canon_off = canon_off;
+    hdr->strings_off = strings_off;
+    hdr->strings_size = strings_size;
+    hdr->total_size = total_size;
+
+    DangerRule *rules = (DangerRule*)(blob + rules_off);
+    PatternNode *nodes = (PatternNode*)(blob + nodes_off);
+    PatternEdge *edges = (PatternEdge*)(blob + edges_off);
+    uint32_t *tokens = (uint32_t*)(blob + tokens_off);
+    uint32_t *exact = (uint32_t*)(blob + exact_off);
+    uint32_t *head = (uint32_t*)(blob + head_off);
+    uint32_t *canon = (uint32_t*)(blob + canon_off);
+    char *strings = blob + strings_off;
+    uint64_t str_used = 1;
+
+    // The lookups below only need the rule and string sections
+    DangerIndex scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    scratch.rules = rules;
+    scratch.tokens = tokens;
+    scratch.strings = strings;
+
+    uint32_t r = 0, t = 0;
+    for (int i = 0; i < count; i++) {
+        if (line_args[i] == NULL) continue;
+
+        DangerRule *rule = &rules[r];
+        size_t line_len = lines[i].length;
+        memcpy(strings + str_used, text + lines[i].offset, line_len);
+        strings[str_used + line_len] = '\0';
+        rule->line_off = (uint32_t)str_used;
+        str_used += line_len + 1;
+
+        rule->first_token = t;
+        rule->token_count = (uint32_t)line_argc[i];
+        for (int k = 0; k < line_argc[i]; k++) {
+            size_t len = strlen(line_args[i][k]);
+            memcpy(strings + str_used, line_args[i][k], len + 1);
+            tokens[t++] = (uint32_t)str_used;
+            str_used += len + 1;
+        }
+
+        size_t head_len = strlen(line_canon[i][0]);
+        memcpy(strings + str_used, line_canon[i][0], head_len + 1);
+        rule->canon_head_off = (uint32_t)str_used;
+        str_used += head_len + 1;
+
+        rule->canon_line_off = (uint32_t)str_used;
+        rule->canon_token_count = (uint32_t)line_canon_count[i];
+        for (int k = 0; k < line_canon_count[i]; k++) {
+            size_t len = strlen(line_canon[i][k]);
+            if (k > 0) strings[str_used++] = ' ';
+            memcpy(strings + str_used, line_canon[i][k], len);
+            str_used += len;
+        }
+        rule->canon_line_len = (uint32_t)(str_used - rule->canon_line_off);
+        strings[str_used++] = '\0';
+
+        rule->full_hash = hash_args(line_args[i], line_argc[i]);
+        rule->head_hash = hash_string(line_canon[i][0]);
+        rule->canon_hash = hash_args(line_canon[i], line_canon_count[i]);
+        rule->canon_signature = token_signature(line_canon[i], line_canon_count[i]);
+
+        // Exact table keeps the first rule with a given argv (the one the linear scan would report)
+        uint32_t slot = (uint32_t)rule->full_hash & (exact_slots - 1);
+        while (exact[slot] != 0) {
+            const DangerRule *other = &rules[exact[slot] - 1];
+            if (other->full_hash == rule->full_hash &&
+                danger_rule_equals(&scratch, other, line_args[i], line_argc[i])) {
+                break;
+            }
+            slot = (slot + 1) & (exact_slots - 1);
+        }
+        if (exact[slot] == 0) exact[slot] = r + 1;
+
+        // Canonical table likewise keeps the first rule with a given canonical form
+        slot = (uint32_t)rule->canon_hash & (canon_slots - 1);
+        while (canon[slot] != 0) {
+            const DangerRule *other = &rules[canon[slot] - 1];
+            int other_line = rule_line[canon[slot] - 1];
+            if (other->canon_hash == rule->canon_hash &&
+                line_canon_count[other_line] == line_canon_count[i]) {
+                int same = 1;
+                for (int k = 0; k < line_canon_count[i] && same; k++) {
+                    same = strcmp(line_canon[other_line][k], line_canon[i][k]) == 0;
+                }
+                if (same) break;
+            }
+            slot = (slot + 1) & (canon_slots - 1);
+        }
+        if (canon[slot] == 0) canon[slot] = r + 1;
+
+        // Head table keeps the last rule with a given canonical argv[0]; earlier ones hang off prev_same_head
+        slot = (uint32_t)rule->head_hash & (head_slots - 1);
+        while (head[slot] != 0) {
+            const DangerRule *other = &rules[head[slot] - 1];
+            if (other->head_hash == rule->head_hash &&
+                strcmp(strings + other->canon_head_off, line_canon[i][0]) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (head_slots - 1);
+        }
+        rule->prev_same_head = head[slot];
+        head[slot] = r + 1;
+        r++;
+    }
+
+    // Flatten the trie: each node's literal edges (sorted by hash) followed by its pattern edges
+    uint32_t next_edge = 0;
+    for (uint32_t n = 0; n < node_count; n++) {
+        nodes[n] = build.nodes[n];
+        nodes[n].first_edge = next_edge;
+
+        uint32_t literal = next_edge, pattern = next_edge + nodes[n].literal_count;
+        for (int e = build.first_edge[n]; e != -1; e = build.edges[e].next) {
+            PatternEdge *out = &edges[build.edges[e].is_pattern ? pattern++ : literal++];
+            out->hash = build.edges[e].hash;
+            out->str_off = tokens[build.edges[e].token];
+            out->child = build.edges[e].child;
+        }
+        qsort(&edges[next_edge], nodes[n].literal_count, sizeof(PatternEdge), compare_pattern_edges);
+        next_edge = pattern;
+    }
+
+    for (int i = 0; i < count; i++) {
+        free_args(line_args[i]);
+        free(line_canon[i]);
+    }
+    free(line_args);
+    free(line);
+    free(line_argc);
+    free(line_canon);
+    free(line_canon_count);
+    free(rule_line);
+    free(build.nodes);
+    free(build.edges);
+    free(build.first_edge);
+    free(build.lookup);
+
+    DangerIndex *index = safe_malloc(sizeof(DangerIndex));
+    memset(index, 0, sizeof(*index));
+    index->blob = blob;
+    index->blob_size = total_size;
+    danger_index_attach(index);
+    return index;
+}
+
+// Release an index, its blob and its compiled patterns
+void danger_index_free(DangerIndex *index) {
+    if (!index) return;
+
+    for (uint32_t e = 0; e < index->header->edge_count; e++) {
+        free(index->patterns[e].ops);
+    }
+    free(index->patterns);
+    free(index->active[0]);
+    free(index->active[1]);
+    free(index->seen);
+    free(index->stats);
+    if (index->mapped) munmap(index->blob, index->blob_size);
+    else free(index->blob);
+    free(index);
+}
+
+// Text of a rule as written in the blocklist
+const char* danger_rule_line(const DangerIndex *index, uint32_t rule_id) {
+    const DangerRule *rule = danger_rule(index, rule_id);
+    return rule ? danger_string(index, rule->line_off) : "";
+}
+
+// Count a block or warning against the rule that produced it (main thread only)
+void danger_rule_record_hit(DangerIndex *index, long rule_id, int verdict) {
+    if (!index || rule_id < 0 || (uint32_t)rule_id >= index->header->rule_count) return;
+
+    if (!index->stats) {
+        index->stats = calloc(index->header->rule_count, sizeof(RuleStats));
+        if (!index->stats) return;   // Telemetry only; never fail a command over it
+    }
+
+    RuleStats *stats = &index->stats[rule_id];
+    if (verdict == DANGER_BLOCK) stats->blocks++;
+    else stats->warns++;
+    stats->last_hit = (int64_t)time(NULL);
+}
+
+// Add the hit counts of a replaced index to the same rules (same tokens) of its successor
+void danger_rule_stats_carry(const DangerIndex *from, DangerIndex *to) {
+    if (!from || !from->stats || !to) return;
+
+    for (uint32_t r = 0; r < from->header->rule_count; r++) {
+        const RuleStats *old = &from->stats[r];
+        if (old->blocks == 0 && old->warns == 0) continue;
+
+        const DangerRule *rule = danger_rule(from, r);
+        if (!rule) continue;
+        char **tokens = safe_malloc((rule->token_count + 1) * sizeof(char*));
+        for (uint32_t t = 0; t < rule->token_count; t++) {
+            tokens[t] = (char*)danger_rule_token(from, rule, t);
+        }
+        long id = danger_index_find_exact(to, tokens, (int)rule->token_count);
+        free(tokens);
+        if (id < 0) continue;   // Rule was removed
+
+        if (!to->stats) {
+            to->stats = calloc(to->header->rule_count, sizeof(RuleStats));
+            if (!to->stats) return;
+        }
+        RuleStats *stats = &to->stats[id];
+        stats->blocks += old->blocks;
+        stats->warns += old->warns;
+        if (old->last_hit > stats->last_hit) stats->last_hit = old->last_hit;
+    }
+}
+
+// First rule whose argv equals args exactly, or -1
+long danger_index_find_exact(const DangerIndex *index, char **args, int count) {
+    unsigned long long hash = hash_args(args, count);
+    uint32_t mask = index->header->exact_slots - 1;
+
+    for (uint32_t slot = (uint32_t)hash & mask, probes = 0; probes <= mask && index->exact[slot] != 0;
+         slot = (slot + 1) & mask, probes++) {
+        const DangerRule *rule = danger_rule(index, index->exact[slot] - 1);
+        if (rule && rule->full_hash == hash && danger_rule_equals(index, rule, args, count)) {
+            return index->exact[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+// Last rule whose canonical argv[0] equals name (earlier ones follow prev_same_head), or -1
+long danger_index_find_head(const DangerIndex *index, const char *name) {
+    unsigned long long hash = hash_string(name);
+    uint32_t mask = index->header->head_slots - 1;
+
+    for (uint32_t slot = (uint32_t)hash & mask, probes = 0; probes <= mask && index->head[slot] != 0;
+         slot = (slot + 1) & mask, probes++) {
+        const DangerRule *rule = danger_rule(index, index->head[slot] - 1);
+        if (rule && rule->head_hash == hash && strcmp(danger_string(index, rule->canon_head_off), name) == 0) {
+            return index->head[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+// First rule whose canonical form equals canon, or -1
+long danger_index_find_canonical(const DangerIndex *index, char **canon, int count) {
+    unsigned long long hash = hash_args(canon, count);
+    uint32_t mask = index->header->canon_slots - 1;
+
+    for (uint32_t slot = (uint32_t)hash & mask, probes = 0; probes <= mask && index->canon[slot] != 0;
+         slot = (slot + 1) & mask, probes++) {
+        uint32_t rule_id = index->canon[slot] - 1;
+        const DangerRule *rule = danger_rule(index, rule_id);
+        if (!rule || rule->canon_hash != hash) continue;
+
+        // Confirm against the rule's own canonical line
+        if (rule->canon_token_count != (uint32_t)count) continue;
+        const char *line = index->strings + rule->canon_line_off;
+        int same = 1;
+        for (int k = 0; k < count && same; k++) {
+            size_t len = strlen(canon[k]);
+            same = strncmp(line, canon[k], len) == 0 && line[len] == (k + 1 < count ? ' ' : '\0');
+            line += len + 1;
+        }
+        if (same) return rule_id;
+    }
+    return -1;
+}
+
+// 64-bit set of the tokens present (one bit per token hash). A token found on only
+// one side costs at least one edit, so the bits set on one side and not the other
+// bound the token edit distance from below
+uint64_t token_signature(char **tokens, int count) {
+    uint64_t signature = 0;
+    for (int k = 0; k < count; k++) {
+        signature |= 1ULL << (hash_string(tokens[k]) & 63);
+    }
+    return signature;
+}
+
+// Allocate a zeroed pattern of the given length over rows symbols (plus a never-matching row)
+void myers_prepare(MyersPattern *pat, int length, int rows) {
+    pat->length = length;
+    pat->words = length > 0 ? (length + 63) / 64 : 1;
+    pat->rows = rows;
+    pat->peq = calloc((size_t)(rows + 1) * pat->words, sizeof(uint64_t));
+    pat->pv = safe_malloc(pat->words * sizeof(uint64_t));
+    pat->mv = safe_malloc(pat->words * sizeof(uint64_t));
+    if (!pat->peq) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(1);
+    }
+}
+
+// Release a prepared pattern
+void myers_free(MyersPattern *pat) {
+    free(pat->peq);
+    free(pat->pv);
+    free(pat->mv);
+}
+
+// Edit distance between a prepared pattern and a text, by Myers' bit-vector
+// algorithm in Hyyro's blocked form (one 64-bit word per 64 pattern symbols).
+// Gives up with limit + 1 once the result cannot come in at or under limit
+int myers_distance(MyersPattern *pat, const uint32_t *text, int n, int limit) {
+    int m = pat->length, words = pat->words;
+    if (abs(m - n) > limit) return limit + 1;
+    if (m == 0) return n;
+
+    uint64_t last_high = 1ULL << ((m - 1) & 63);
+    for (int w = 0; w < words; w++) {
+        pat->pv[w] = ~0ULL;
+        pat->mv[w] = 0;
+    }
+
+    int score = m;
+    for (int j = 0; j < n; j++) {
+        const uint64_t *eq_row = pat->peq + (size_t)text[j] * words;
+        int carry = 1;   // Row 0 of a global distance grows by one per column
+
+        for (int w = 0; w < words; w++) {
+            uint64_t pv = pat->pv[w], mv = pat->mv[w], eq = eq_row[w];
+            uint64_t high = w == words - 1 ? last_high : 1ULL << 63;
+
+            uint64_t xv = eq | mv;
+            if (carry < 0) eq |= 1;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+
+            int carry_out = (ph & high) ? 1 : (mh & high) ? -1 : 0;
+            ph <<= 1;
+            mh <<= 1;
+            if (carry < 0) mh |= 1;
+            else if (carry > 0) ph |= 1;
+
+            pat->pv[w] = mh | ~(xv | ph);
+            pat->mv[w] = ph & xv;
+            carry = carry_out;
+        }
+
+        score += carry;
+        // Each remaining column lowers the score by at most one
+        if (score - (n - 1 - j) > limit) return limit + 1;
+    }
+    return score;
+}
+
+// Closest rule on the chain starting at head_rule: fewest differing canonical
+// tokens, then fewest differing characters, earlier line on a tie. Rules further
+// than similarity_threshold tokens are skipped (-1 when none is left). Token
+// counts and signatures bound the distance from below, so most candidates are
+// rejected in O(1); the rest stop as soon as they cannot beat the best so far
+long danger_index_closest(const DangerIndex *index, long head_rule, char **canon, int count,
+                          int *token_distance, int *char_distance) {
+    // Token pattern: one row per distinct canonical token. A slot holds a token's
+    // hash, bytes and length; equal hashes only count once the bytes agree
+    uint32_t slots = 16;
+    while (slots < (uint32_t)count * 2) slots <<= 1;
+    unsigned long long *slot_hash = safe_malloc(slots * sizeof(unsigned long long));
+    const char **slot_token = safe_malloc(slots * sizeof(char*));
+    size_t *slot_len = safe_malloc(slots * sizeof(size_t));
+    int *slot_row = safe_malloc(slots * sizeof(int));
+    for (uint32_t i = 0; i < slots; i++) slot_row[i] = -1;
+
+    MyersPattern tokens, chars;
+    myers_prepare(&tokens, count, count);
+    int rows = 0;
+    size_t line_len = 0;
+    for (int k = 0; k < count; k++) {
+        size_t len = strlen(canon[k]);
+        unsigned long long hash = hash_bytes(canon[k], len);
+        uint32_t slot = (uint32_t)hash & (slots - 1);
+        while (slot_row[slot] >= 0 && !(slot_hash[slot] == hash && slot_len[slot] == len &&
+                                         memcmp(slot_token[slot], canon[k], len) == 0)) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (slot_row[slot] < 0) {
+            slot_hash[slot] = hash;
+            slot_token[slot] = canon[k];
+            slot_len[slot] = len;
+            slot_row[slot] = rows++;
+        }
+        tokens.peq[(size_t)slot_row[slot] * tokens.words + k / 64] |= 1ULL << (k % 64);
+        line_len += len + (k > 0);
+    }
+
+    // Character pattern: the canonical tokens joined by spaces, one row per byte value
+    myers_prepare(&chars, (int)line_len, 256);
+    for (int k = 0, pos = 0; k < count; k++) {
+        if (k > 0) {
+            chars.peq[(size_t)' ' * chars.words + pos / 64] |= 1ULL << (pos % 64);
+            pos++;
+        }
+        for (const unsigned char *c = (const unsigned char*)canon[k]; *c; c++, pos++) {
+            chars.peq[(size_t)*c * chars.words + pos / 64] |= 1ULL << (pos % 64);
+        }
+    }
+
+    uint32_t *text = NULL;
+    size_t text_capacity = 0;
+    long best = -1;
+    int best_tokens = 0, best_chars = 0;
+    int max_tokens = similarity_threshold >= 0 ? similarity_threshold : INT_MAX - 1;
+
+    uint64_t signature = token_signature(canon, count);
+
+    const DangerRule *rule;
+    for (long r = head_rule; r >= 0 && (rule = danger_rule(index, (uint64_t)r)) != NULL; r = danger_prev_same_head(rule, r)) {
+        int token_limit = best >= 0 ? best_tokens : max_tokens;
+        int lower = abs((int)rule->canon_token_count - count);
+        int missing = __builtin_popcountll(signature & ~rule->canon_signature);
+        int extra = __builtin_popcountll(rule->canon_signature & ~signature);
+        if (missing > lower) lower = missing;
+        if (extra > lower) lower = extra;
+        if (lower > token_limit) continue;
+
+        // A candidate that can at best tie on tokens must also win on characters
+        if (best >= 0 && lower == best_tokens &&
+            abs((int)rule->canon_line_len - (int)line_len) > best_chars) continue;
+
+        // A line of canon_line_len bytes has at most canon_line_len + 1 tokens
+        size_t needed = (size_t)rule->canon_line_len + 1;
+        if (needed > text_capacity) {
+            text_capacity = needed * 2;
+            free(text);
+            text = safe_malloc(text_capacity * sizeof(uint32_t));
+        }
+
+        // Tokens of the rule's canonical line as pattern rows (unknown tokens never match)
+        const char *line = index->strings + rule->canon_line_off;
+        const char *line_end = line + rule->canon_line_len;
+        int n = 0;
+        for (const char *p = line; ; p++) {
+            const char *start = p;
+            while (p < line_end && *p != ' ') p++;
+            size_t len = (size_t)(p - start);
+            unsigned long long hash = hash_bytes(start, len);
+            uint32_t slot = (uint32_t)hash & (slots - 1);
+            while (slot_row[slot] >= 0 && !(slot_hash[slot] == hash && slot_len[slot] == len &&
+                                             memcmp(slot_token[slot], start, len) == 0)) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            text[n++] = slot_row[slot] >= 0 ? (uint32_t)slot_row[slot] : (uint32_t)rows;
+            if (p >= line_end) break;
+        }
+
+        int td = myers_distance(&tokens, text, n, token_limit);
+        if (td > token_limit) continue;
+
+        int char_limit = (best >= 0 && td == best_tokens) ? best_chars : INT_MAX - 1;
+        for (uint32_t c = 0; c < rule->canon_line_len; c++) text[c] = (unsigned char)line[c];
+        int cd = myers_distance(&chars, text, (int)rule->canon_line_len, char_limit);
+        if (cd > char_limit) continue;
+
+        // The chain runs from the last line back, so a full tie keeps the earlier line
+        best = r;
+        best_tokens = td;
+        best_chars = cd;
+    }
+
+    free(text);
+    free(slot_hash);
+    free(slot_token);
+    free(slot_len);
+    free(slot_row);
+    myers_free(&tokens);
+    myers_free(&chars);
+
+    *token_distance = best_tokens;
+    *char_distance = best_chars;
+    return best;
+}
+
+// Normalize a path lexically: collapse repeated slashes, drop "." components and
+// trailing slashes, and fold ".." into its parent. out needs strlen(path) + 2 bytes
+void normalize_path(const char *path, char *out) {
+    int absolute = path[0] == '/';
+    size_t len = 0, depth = 0;
+
+    if (absolute) out[len++] = '/';
+    size_t base = len;
+
+    for (const char *p = path; *p; ) {
+        while (*p == '/') p++;
+        const char *start = p;
+        while (*p && *p != '/') p++;
+        size_t n = (size_t)(p - start);
+
+        if (n == 0 || (n == 1 && start[0] == '.')) continue;
+        if (n == 2 && start[0] == '.' && start[1] == '.') {
+            if (depth > 0) {
+                while (len > base && out[len - 1] != '/') len--;
+                if (len > base) len--;
+                depth--;
+                continue;
+            }
+            if (absolute) continue;   // "/.." is "/"
+        } else {
+            depth++;
+        }
+
+        if (len > base) out[len++] = '/';
+        memcpy(out + len, start, n);
+        len += n;
+    }
+
+    if (len == 0) out[len++] = '.';
+    out[len] = '\0';
+}
+
+// Canonical command name. A bare name is kept; an absolute path collapses to its
+// bare name when PATH resolves that name to the same file, so /bin/rm and rm
+// compare equal while a different program sharing the name (or a relative path,
+// whose meaning depends on the directory) keeps its normalized path
+void canonical_command_name(const char *name, char *out, size_t size) {
+    if (strchr(name, '/') == NULL) {
+        snprintf(out, size, "%s", name);
+        return;
+    }
+
+    char normalized[PATH_MAX];
+    if (strlen(name) + 2 > sizeof(normalized)) {
+        snprintf(out, size, "%s", name);
+        return;
+    }
+    normalize_path(name, normalized);
+    if (normalized[0] != '/') {
+        // Keep a relative path distinguishable from a PATH lookup ("./rm" is not "rm")
+        snprintf(out, size, "%s%s", strchr(normalized, '/') ? "" : "./", normalized);
+        return;
+    }
+
+    pthread_mutex_lock(&canon_cache_lock);
+
+    // Resolutions depend on PATH, so a new PATH starts a new cache
+    const char *path_env = getenv("PATH");
+    unsigned long long path_hash = hash_string(path_env);
+    if (path_hash != canon_cache_path_hash || canon_cache_used >= CANON_CACHE_SLOTS / 2) {
+        for (int i = 0; i < CANON_CACHE_SLOTS; i++) {
+            free(canon_cache[i].name);
+            free(canon_cache[i].canonical);
+            canon_cache[i].name = canon_cache[i].canonical = NULL;
+        }
+        canon_cache_used = 0;
+        canon_cache_path_hash = path_hash;
+    }
+
+    unsigned long long hash = hash_string(normalized);
+    uint32_t slot = (uint32_t)hash & (CANON_CACHE_SLOTS - 1);
+    while (canon_cache[slot].name != NULL) {
+        if (canon_cache[slot].hash == hash && strcmp(canon_cache[slot].name, normalized) == 0) {
+            snprintf(out, size, "%s", canon_cache[slot].canonical);
+            pthread_mutex_unlock(&canon_cache_lock);
+            return;
+        }
+        slot = (slot + 1) & (CANON_CACHE_SLOTS - 1);
+    }
+
+    const char *canonical = normalized;
+    const char *base = strrchr(normalized, '/') + 1;
+    struct stat target, found;
+
+    if (*base && path_env && stat(normalized, &target) == 0) {
+        char *dirs = strdup(path_env);
+        char candidate[PATH_MAX];
+        for (char *save = NULL, *dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+            snprintf(candidate, sizeof(candidate), "%s/%s", *dir ? dir : ".", base);
+            if (stat(candidate, &found) == 0 && S_ISREG(found.st_mode) && access(candidate, X_OK) == 0) {
+                // The first hit is what the bare name would run
+                if (found.st_dev == target.st_dev && found.st_ino == target.st_ino) canonical = base;
+                break;
+            }
+        }
+        free(dirs);
+    }
+
+    canon_cache[slot].hash = hash;
+    canon_cache[slot].name = strdup(normalized);
+    canon_cache[slot].canonical = strdup(canonical);
+    canon_cache_used++;
+    snprintf(out, size, "%s", canonical);
+    pthread_mutex_unlock(&canon_cache_lock);
+}
+
+// Short option tokens such as -rf (not --long, not a lone -)
+static int is_short_flag_group(const char *arg) {
+    if (arg[0] != '-' || arg[1] == '\0' || arg[1] == '-') return 0;
+    for (const char *c = arg + 1; *c; c++) {
+        if (!isalnum((unsigned char)*c)) return 0;
+    }
+    return 1;
+}
+
+// Canonical argv for matching: canonical_command_name() of argv[0], then short
+// flags split, deduplicated and sorted, then long options sorted, then operands in
+// their original order with paths normalized. Options end at the first operand or
+// at a "--" (which is dropped); anything after that is an operand as written, so
+// "echo rm -fr /" is not "echo rm -rf /". Returned as one NULL-terminated
+// allocation, released with free()
+char **canonical_args(char **args, int count, int *out_count) {
+    char head[PATH_MAX];
+    canonical_command_name(count > 0 ? args[0] : "", head, sizeof(head));
+
+    // Worst case every argument is a flag group: 3 bytes and one token per letter
+    size_t head_len = strlen(head), chars = head_len + 1, max_tokens = 2;
+    for (int i = 1; i < count; i++) {
+        size_t len = strlen(args[i]);
+        chars += 3 * (len + 1);
+        max_tokens += len + 1;
+    }
+
+    // Token pointers, scratch lists for options and operands, then the strings
+    char **out = safe_malloc((max_tokens + 2 * (size_t)count + 2) * sizeof(char*) + chars);
+    char **longs = out + max_tokens;
+    char **operands = longs + count + 1;
+    char *text = (char*)(operands + count + 1);
+    int n = 0;
+
+    out[n++] = text;
+    memcpy(text, head, head_len + 1);
+    text += head_len + 1;
+
+    uint64_t flags[4] = {0, 0, 0, 0};   // Bitmap of short option letters
+    int long_count = 0, operand_count = 0, options_done = 0;
+
+    for (int i = 1; i < count; i++) {
+        char *arg = args[i];
+        if (!options_done && strcmp(arg, "--") == 0) {
+            options_done = 1;
+        } else if (!options_done && is_short_flag_group(arg)) {
+            for (const unsigned char *c = (const unsigned char*)arg + 1; *c; c++) {
+                flags[*c >> 6] |= 1ULL << (*c & 63);
+            }
+        } else if (!options_done && arg[0] == '-' && arg[1] != '\0') {
+            longs[long_count++] = arg;
+        } else {
+            options_done = 1;
+            operands[operand_count++] = arg;
+        }
+    }
+    qsort(longs, long_count, sizeof(char*), compare_strings);
+
+    for (int word = 0; word < 4; word++) {
+        for (uint64_t bits = flags[word]; bits; bits &= bits - 1) {
+            out[n++] = text;
+            *text++ = '-';
+            *text++ = (char)(word * 64 + __builtin_ctzll(bits));
+            *text++ = '\0';
+        }
+    }
+    for (int i = 0; i < long_count; i++) {
+        out[n++] = text;
+        strcpy(text, longs[i]);
+        text += strlen(text) + 1;
+    }
+    for (int i = 0; i < operand_count; i++) {
+        out[n++] = text;
+        if (strchr(operands[i], '/')) normalize_path(operands[i], text);
+        else strcpy(text, operands[i]);
+        text += strlen(text) + 1;
+    }
+    out[n] = NULL;
+
+    *out_count = n;
+    return out;
+}
+
+// Add a trie state and everything reachable from it through ** tokens
+static void pattern_add_state(DangerIndex *index, uint32_t *set, uint32_t *size, uint32_t node) {
+    while (node < index->header->node_count && index->seen[node] != index->stamp) {
+        index->seen[node] = index->stamp;
+        set[(*size)++] = node;
+        if (index->nodes[node].star_child == 0) break;
+        node = index->nodes[node].star_child - 1;
+    }
+}
+
+// Lowest pattern rule matching args, or -1. Each token costs one hash probe per
+// live trie state plus one glob test per distinct pattern at that position, so
+// the rule count only matters through how many rules share a prefix
+long danger_index_match_patterns(DangerIndex *index, char **args, int count) {
+    if (index->header->edge_count == 0 && index->nodes[0].star_child == 0) return -1;
+
+    uint32_t *cur = index->active[0], *next = index->active[1];
+    uint32_t cur_size = 0;
+
+    if (++index->stamp == 0) {
+        memset(index->seen, 0, index->header->node_count * sizeof(uint32_t));
+        index->stamp = 1;
+    }
+    pattern_add_state(index, cur, &cur_size, 0);
+
+    for (int i = 0; i < count && cur_size > 0; i++) {
+        const char *token = args[i];
+        unsigned long long hash = hash_string(token);
+        uint32_t next_size = 0;
+
+        if (++index->stamp == 0) {
+            memset(index->seen, 0, index->header->node_count * sizeof(uint32_t));
+            index->stamp = 1;
+        }
+
+        for (uint32_t s = 0; s < cur_size; s++) {
+            const PatternNode *node = &index->nodes[cur[s]];
+            if (node->self_loop) pattern_add_state(index, next, &next_size, cur[s]);
+            if ((uint64_t)node->first_edge + node->literal_count + node->pattern_count > index->header->edge_count) {
+                continue;   // Damaged compiled file: the node's edges run past the table
+            }
+
+            // Literal edges: binary search on hash, then confirm the text
+            uint32_t lo = node->first_edge, hi = node->first_edge + node->literal_count;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (index->edges[mid].hash < hash) lo = mid + 1;
+                else hi = mid;
+            }
+            for (; lo < node->first_edge + node->literal_count && index->edges[lo].hash == hash; lo++) {
+                if (strcmp(danger_string(index, index->edges[lo].str_off), token) == 0) {
+                    pattern_add_state(index, next, &next_size, index->edges[lo].child);
+                }
+            }
+
+            uint32_t end = node->first_edge + node->literal_count + node->pattern_count;
+            for (uint32_t e = node->first_edge + node->literal_count; e < end; e++) {
+                if (index->patterns[e].ops == NULL) {
+                    glob_compile(danger_string(index, index->edges[e].str_off), &index->patterns[e]);
+                    index->patterns[e].match_dot = 1;   // Arguments are not file names
+                }
+                if (glob_match(&index->patterns[e], token)) {
+                    pattern_add_state(index, next, &next_size, index->edges[e].child);
+                }
+            }
+        }
+
+        uint32_t *swap = cur;
+        cur = next;
+        next = swap;
+        cur_size = next_size;
+    }
+
+    long best = -1;
+    for (uint32_t s = 0; s < cur_size; s++) {
+        uint32_t accept = index->nodes[cur[s]].accept;
+        if (accept != 0 && accept <= index->header->rule_count && (best < 0 || (long)accept - 1 < best)) best = (long)accept - 1;
+    }
+    return best;
+}
+
+// Read and index a blocklist file; NULL if it cannot be read
+DangerIndex* danger_index_load(const char *path) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // A compiled list is used in place; anything else is parsed as text
+    DangerIndex *index = NULL;
+    char magic[sizeof(((DangerIndexHeader*)0)->magic)];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+        memcmp(magic, DANGER_INDEX_MAGIC, sizeof(magic)) == 0) {
+        index = danger_index_map(fd, path);
+        close(fd);
+        if (index == NULL) {
+            return NULL;
+        }
+    } else {
+        if (fd >= 0) close(fd);
+
+        LineFile file;
+        if (line_file_open(path, &file) != 0) {
+            return NULL;
+        }
+        if (file.count > INT_MAX) {
+            fprintf(stderr, "ERR: %s: too many lines\n", path);
+            line_file_close(&file);
+            return NULL;
+        }
+        index = danger_index_build(file.data, file.lines, (int)file.count);
+        line_file_close(&file);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    index->loaded_at = time(NULL);
+    index->load_seconds = time_diff(t0, t1);
+    return index;
+}
+
+// Whether a section of count elements at off lies inside a blob of the given size
+static int danger_section_fits(uint64_t off, uint64_t count, uint64_t elem, uint64_t size) {
+    return off <= size && count <= (size - off) / elem;
+}
+
+// Map a compiled blocklist read-only; the page cache shares it between shells.
+// Only the header and section bounds are checked here, keeping startup independent
+// of the rule count; offsets stored inside the sections are checked where they are
+// read (danger_rule, danger_string), so a damaged file never reads outside the blob
+DangerIndex* danger_index_map(int fd, const char *path) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(DangerIndexHeader)) {
+        fprintf(stderr, "ERR: %s: truncated compiled blocklist\n", path);
+        return NULL;
+    }
+
+    void *blob = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (blob == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    const DangerIndexHeader *hdr = blob;
+    uint64_t size = (uint64_t)st.st_size;
+    if (hdr->version != DANGER_INDEX_VERSION) {
+        fprintf(stderr, "ERR: %s: compiled blocklist version %u, expected %u; recompile it\n",
+                path, hdr->version, DANGER_INDEX_VERSION);
+        munmap(blob, st.st_size);
+        return NULL;
+    }
+
+    int valid = hdr->total_size <= size &&
+                hdr->total_size >= sizeof(DangerIndexHeader) &&
+                hdr->rules_off % 8 == 0 && hdr->edges_off % 8 == 0 &&
+                hdr->nodes_off % 4 == 0 && hdr->tokens_off % 4 == 0 && hdr->exact_off % 4 == 0 &&
+                hdr->head_off % 4 == 0 && hdr->canon_off % 4 == 0 &&
+                hdr->exact_slots != 0 && (hdr->exact_slots & (hdr->exact_slots - 1)) == 0 &&
+                hdr->head_slots != 0 && (hdr->head_slots & (hdr->head_slots - 1)) == 0 &&
+                hdr->node_count != 0 &&
+                danger_section_fits(hdr->rules_off, hdr->rule_count, sizeof(DangerRule), hdr->total_size) &&
+                danger_section_fits(hdr->nodes_off, hdr->node_count, sizeof(PatternNode), hdr->total_size) &&
+                danger_section_fits(hdr->edges_off, hdr->edge_count, sizeof(PatternEdge), hdr->total_size) &&
+                danger_section_fits(hdr->tokens_off, hdr->token_count, sizeof(uint32_t), hdr->total_size) &&
+                danger_section_fits(hdr->exact_off, hdr->exact_slots, sizeof(uint32_t), hdr->total_size) &&
+                danger_section_fits(hdr->head_off, hdr->head_slots, sizeof(uint32_t), hdr->total_size) &&
+                hdr->canon_slots != 0 && (hdr->canon_slots & (hdr->canon_slots - 1)) == 0 &&
+                danger_section_fits(hdr->canon_off, hdr->canon_slots, sizeof(uint32_t), hdr->total_size) &&
+                danger_section_fits(hdr->strings_off, hdr->strings_size, 1, hdr->total_size) &&
+                hdr->strings_size > 0 &&
+                ((const char*)blob)[hdr->strings_off + hdr->strings_size - 1] == '\0';
+    if (!valid) {
+        fprintf(stderr, "ERR: %s: corrupt compiled blocklist\n", path);
+        munmap(blob, st.st_size);
+        return NULL;
+    }
+
+    DangerIndex *index = safe_malloc(sizeof(DangerIndex));
+    memset(index, 0, sizeof(*index));
+    index->blob = blob;
+    index->blob_size = st.st_size;
+    index->mapped = 1;
+    danger_index_attach(index);
+    return index;
+}
+
+// Write the indexed form of a blocklist for shells to map at startup
+int compile_blocklist(const char *in_path, const char *out_path) {
+    DangerIndex *index = danger_index_load(in_path);
+    if (index == NULL) {
+        fprintf(stderr, "Failed to load dangerous commands\n");
+        return 1;
+    }
+
+    // Write beside the target and rename over it: shells that mapped the old
+    // file keep their pages, and the watcher sees a single complete update
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", out_path, (int)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp_path);
+        danger_index_free(index);
+        return 1;
+    }
+
+    const char *data = index->blob;
+    size_t size = index->header->total_size, done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += (size_t)n;
+    }
+    if (done < size || fsync(fd) != 0 || close(fd) != 0 || rename(tmp_path, out_path) != 0) {
+        perror(out_path);
+        unlink(tmp_path);
+        danger_index_free(index);
+        return 1;
+    }
+
+    printf("%s: %u rules, %u pattern nodes, %zu bytes\n",
+           out_path, index->header->rule_count, index->header->node_count, size);
+    danger_index_free(index);
+    return 0;
+}
+
+// Register a descriptor whose readiness is dispatched while waiting for input
+int event_loop_add(int fd, event_handler_fn handler) {
+    if (event_source_count >= MAX_EVENT_SOURCES) {
+        return -1;
+    }
+    event_sources[event_source_count].fd = fd;
+    event_sources[event_source_count].handler = handler;
+    event_source_count++;
+    return 0;
+}
+
+// Dispatch ready event sources until fd is readable; with fd < 0 only dispatch what is already ready
+void event_loop_wait(int fd) {
+    struct pollfd fds[MAX_EVENT_SOURCES + 1];
+    int first = fd >= 0 ? 1 : 0;
+
+    if (fd < 0 && event_source_count == 0) return;
+
+    for (;;) {
+        if (fd >= 0) {
+            fds[0].fd = fd;
+            fds[0].events = POLLIN;
+            fds[0].revents = 0;
+        }
+        for (int i = 0; i < event_source_count; i++) {
+            fds[first + i].fd = event_sources[i].fd;
+            fds[first + i].events = POLLIN;
+            fds[first + i].revents = 0;
+        }
+
+        int ready = poll(fds, first + event_source_count, fd >= 0 ? -1 : 0);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        for (int i = 0; i < event_source_count; i++) {
+            if (fds[first + i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                event_sources[i].handler(event_sources[i].fd);
+            }
+        }
+        if (fd < 0 || fds[0].revents != 0) return;
+    }
+}
+
+// Watch the blocklist's directory so saves through rename are seen as well as in-place writes
+int policy_watch_start(const char *path) {
+    if (realpath(path, policy_path) == NULL) {
+        return -1;
+    }
+
+    char dir[PATH_MAX];
+    char *slash = strrchr(policy_path, '/');
+    size_t dir_len = slash == policy_path ? 1 : (size_t)(slash - policy_path);
+    memcpy(dir, policy_path, dir_len);
+    dir[dir_len] = '\0';
+    policy_watch_name = slash + 1;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        event_loop_add(fd, policy_watch_handler) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    policy_watch_fd = fd;
+    return 0;
+}
+
+// Drain inotify events and start a reload if the blocklist itself changed
+void policy_watch_handler(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            if (event->len > 0 && strcmp(event->name, policy_watch_name) == 0) {
+                changed = 1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (changed) {
+        policy_request_reload();
+    }
+}
+
+// Ask for the blocklist to be re-read; a running reload thread picks up repeated requests
+void policy_request_reload(void) {
+    __atomic_store_n(&policy_reload_pending, 1, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&policy_reload_running, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    // Keep signals (SIGCHLD in particular) on the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, policy_reload_thread, NULL) == 0) {
+        pthread_detach(thread);
+    } else {
+        __atomic_store_n(&policy_reload_running, 0, __ATOMIC_RELEASE);
+        perror("pthread_create");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Build a fresh index off the input path and publish it with a single pointer swap
+void* policy_reload_thread(void *arg) {
+    (void)arg;
+    do {
+        while (__atomic_exchange_n(&policy_reload_pending, 0, __ATOMIC_ACQ_REL)) {
+            DangerIndex *fresh = danger_index_load(policy_path);
+            if (fresh == NULL) {
+                __atomic_add_fetch(&policy_reload_failures, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            DangerIndex *old = __atomic_exchange_n(&danger_index, fresh, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&policy_reloads, 1, __ATOMIC_RELAXED);
+            if (old == NULL) {
+                continue;   // The list had not been loaded yet
+            }
+
+            // The main thread may still be reading the old index; hand it over for release
+            old->retired_next = __atomic_load_n(&policy_retired, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&policy_retired, &old->retired_next, old, 0,
+                                                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        }
+        __atomic_store_n(&policy_reload_running, 0, __ATOMIC_RELEASE);
+
+        // A request may have arrived between the last check and clearing the running flag
+    } while (__atomic_load_n(&policy_reload_pending, __ATOMIC_ACQUIRE) &&
+             !__atomic_exchange_n(&policy_reload_running, 1, __ATOMIC_ACQ_REL));
+
+    return NULL;
+}
+
+// The blocklist, indexed on first use so startup does not pay for it (main thread only).
+// Startup only checks that the file is readable; if it cannot be loaded now, NULL (the
+// next call tries again) and commands are refused rather than the shell exiting
+DangerIndex* policy_ensure_loaded(void) {
+    DangerIndex *index = __atomic_load_n(&danger_index, __ATOMIC_ACQUIRE);
+    if (index != NULL) {
+        return index;
+    }
+
+    DangerIndex *fresh = danger_index_load(policy_path);
+    if (fresh == NULL) {
+        fprintf(stderr, "ERR: Failed to load dangerous commands from %s\n", policy_path);
+        return NULL;
+    }
+
+    // A reload triggered by an edit may have published a list in the meantime
+    DangerIndex *expected = NULL;
+    if (!__atomic_compare_exchange_n(&danger_index, &expected, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        danger_index_free(fresh);
+        fresh = expected;
+    }
+    policy_sync();
+
+    if (startup_trace) {
+        fprintf(stderr, "startup: blocklist indexed on first use: %u rules in %.3f ms\n",
+                fresh->header->rule_count, fresh->load_seconds * 1000.0);
+    }
+    return fresh;
+}
+
+// Adopt a newly published index and free the ones it replaced (main thread only)
+void policy_sync(void) {
+    // Take the retired list before reading the current index: anything retired was
+    // swapped out before it was pushed, so the load below already sees its successor
+    DangerIndex *retired = __atomic_exchange_n(&policy_retired, NULL, __ATOMIC_ACQUIRE);
+    DangerIndex *current = __atomic_load_n(&danger_index, __ATOMIC_ACQUIRE);
+
+    if (current != policy_seen) {
+        policy_seen = current;
+        policy_generation++;   // Drops cached verdicts that point into retired indexes
+    }
+
+    while (retired) {
+        DangerIndex *next = retired->retired_next;
+        danger_rule_stats_carry(retired, current);
+        danger_index_free(retired);
+        retired = next;
+    }
+}
+
+// Wait for an in-progress reload and release every index
+void policy_shutdown(void) {
+    __atomic_store_n(&policy_reload_pending, 0, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&policy_reload_running, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    policy_sync();
+    danger_index_free(danger_index);
+    danger_index = NULL;
+
+    if (policy_watch_fd >= 0) {
+        close(policy_watch_fd);
+        policy_watch_fd = -1;
+    }
+}
+
+// Print (or reset) verdict cache statistics. Time saved is the average cost of a
+// miss times the hits, less what the hits themselves took
+static int policy_cache_command(char **args, int args_len) {
+    if (args_len > 2 && strcmp(args[2], "clear") == 0) {
+        verdict_cache_flush();
+        verdict_cache_hits = 0;
+        verdict_cache_misses = 0;
+        verdict_cache_hit_seconds = 0;
+        verdict_cache_miss_seconds = 0;
+        return 0;
+    }
+    if (args_len > 2) {
+        fprintf(stderr, "ERR: Usage: policy cache [clear]\n");
+        return 1;
+    }
+
+    long lookups = verdict_cache_hits + verdict_cache_misses;
+    double miss_cost = verdict_cache_misses ? verdict_cache_miss_seconds / verdict_cache_misses : 0.0;
+    double saved = verdict_cache_hits * miss_cost - verdict_cache_hit_seconds;
+    if (saved < 0) saved = 0;
+
+    printf("verdict cache: entries=%d/%d hits=%ld misses=%ld hit_rate=%.1f%%\n",
+           verdict_cache_count, VERDICT_CACHE_SIZE, verdict_cache_hits, verdict_cache_misses,
+           lookups ? 100.0 * verdict_cache_hits / lookups : 0.0);
+    printf("avg miss: %.2f us, avg hit: %.2f us, saved: %.3f ms\n",
+           miss_cost * 1e6,
+           verdict_cache_hits ? verdict_cache_hit_seconds / verdict_cache_hits * 1e6 : 0.0,
+           saved * 1000.0);
+    return 0;
+}
+
+// Hit counts of one rule, for sorting
+typedef struct {
+    uint32_t rule_id;
+    RuleStats stats;
+} RuleHit;
+
+// Most hits first, then the most recent, then the earlier line
+static int compare_rule_hits(const void *a, const void *b) {
+    const RuleHit *x = a, *y = b;
+    uint64_t hx = (uint64_t)x->stats.blocks + x->stats.warns;
+    uint64_t hy = (uint64_t)y->stats.blocks + y->stats.warns;
+
+    if (hx != hy) return hx > hy ? -1 : 1;
+    if (x->stats.last_hit != y->stats.last_hit) return x->stats.last_hit > y->stats.last_hit ? -1 : 1;
+    return x->rule_id < y->rule_id ? -1 : (x->rule_id > y->rule_id);
+}
+
+// policy stats [N]: the N (default 10) rules that fired most, and how many never did
+static int policy_stats_command(DangerIndex *index, char **args, int args_len) {
+    long top = 10;
+    if (args_len > 2) {
+        char *end = NULL;
+        top = strtol(args[2], &end, 10);
+        if (*end != '\0' || top <= 0) {
+            fprintf(stderr, "ERR: Usage: policy stats [N]\n");
+            return 1;
+        }
+    }
+
+    uint32_t rule_count = index ? index->header->rule_count : 0;
+    uint32_t hit_count = 0;
+    RuleHit *hits = NULL;
+    if (index && index->stats) {
+        hits = safe_malloc((rule_count + 1) * sizeof(RuleHit));
+        for (uint32_t r = 0; r < rule_count; r++) {
+            if (index->stats[r].blocks == 0 && index->stats[r].warns == 0) continue;
+            hits[hit_count].rule_id = r;
+            hits[hit_count].stats = index->stats[r];
+            hit_count++;
+        }
+        qsort(hits, hit_count, sizeof(RuleHit), compare_rule_hits);
+    }
+
+    printf("rules: %u, fired: %u, never fired: %u\n", rule_count, hit_count, rule_count - hit_count);
+    if (hit_count > 0) {
+        printf("%8s %8s  %-19s  %s\n", "blocks", "warns", "last hit", "rule");
+    }
+    for (uint32_t i = 0; i < hit_count && i < (uint32_t)top; i++) {
+        char when[32];
+        time_t last = (time_t)hits[i].stats.last_hit;
+        struct tm tm_last;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&last, &tm_last));
+        printf("%8u %8u  %-19s  %s\n", hits[i].stats.blocks, hits[i].stats.warns, when,
+               danger_rule_line(index, hits[i].rule_id));
+    }
+
+    free(hits);
+    return 0;
+}
+
+// policy dump <file>: write every rule with its counts as tab-separated lines
+// (rule id, blocks, warns, last hit in epoch seconds or 0, rule text)
+static int policy_dump_command(DangerIndex *index, char **args, int args_len) {
+    if (args_len != 3) {
+        fprintf(stderr, "ERR: Usage: policy dump <file>\n");
+        return 1;
+    }
+
+    FILE *out = fopen(args[2], "w");
+    if (!out) {
+        fprintf(stderr, "ERR: Cannot open %s: %s\n", args[2], strerror(errno));
+        return 1;
+    }
+
+    fprintf(out, "# source=%s generation=%d dumped=%lld\n", policy_path, policy_generation, (long long)time(NULL));
+    fprintf(out, "# rule_id\tblocks\twarns\tlast_hit\trule\n");
+    uint32_t rule_count = index ? index->header->rule_count : 0;
+    for (uint32_t r = 0; r < rule_count; r++) {
+        RuleStats stats = {0, 0, 0};
+        if (index->stats) stats = index->stats[r];
+        fprintf(out, "%u\t%u\t%u\t%lld\t%s\n", r, stats.blocks, stats.warns,
+                (long long)stats.last_hit, danger_rule_line(index, r));
+    }
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "ERR: Cannot write %s: %s\n", args[2], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// policy [reload | cache [clear] | stats [N] | dump <file> | threshold [N|off]]: show the
+// loaded blocklist, re-read it now, show verdict cache or per-rule statistics, or set how
+// many canonical tokens a command may differ by and still be warned about
+int policy_builtin(char **args, int args_len) {
+    if (args_len > 1 && strcmp(args[1], "reload") == 0) {
+        policy_request_reload();
+        return 0;
+    }
+
+    // stats and dump need the rules themselves; the rest works without a list
+    if (policy_ensure_loaded() == NULL && args_len > 1 &&
+        (strcmp(args[1], "stats") == 0 || strcmp(args[1], "dump") == 0)) {
+        return 1;
+    }
+    if (args_len > 1 && strcmp(args[1], "cache") == 0) {
+        return policy_cache_command(args, args_len);
+    }
+    if (args_len > 1 && strcmp(args[1], "stats") == 0) {
+        return policy_stats_command(__atomic_load_n(&danger_index, __ATOMIC_ACQUIRE), args, args_len);
+    }
+    if (args_len > 1 && strcmp(args[1], "dump") == 0) {
+        return policy_dump_command(__atomic_load_n(&danger_index, __ATOMIC_ACQUIRE), args, args_len);
+    }
+    if (args_len > 1 && strcmp(args[1], "threshold") == 0) {
+        if (args_len > 2) {
+            char *end = NULL;
+            long value = strtol(args[2], &end, 10);
+            if (strcmp(args[2], "off") == 0) {
+                value = -1;
+            } else if (*end != '\0' || value < 0 || value > INT_MAX - 1) {
+                fprintf(stderr, "ERR: Usage: policy threshold [N|off]\n");
+                return 1;
+            }
+            similarity_threshold = (int)value;
+            policy_generation++;   // Cached warnings were decided under the old threshold
+        }
+        if (similarity_threshold < 0) printf("threshold: off\n");
+        else printf("threshold: %d tokens\n", similarity_threshold);
+        return 0;
+    }
+    if (args_len > 1) {
+        fprintf(stderr, "ERR: Usage: policy [reload | cache [clear] | stats [N] | dump <file> | threshold [N|off]]\n");
+        return 1;
+    }
+
+    DangerIndex *index = __atomic_load_n(&danger_index, __ATOMIC_ACQUIRE);
+    char loaded[32] = "-";
+    if (index) {
+        struct tm tm_loaded;
+        strftime(loaded, sizeof(loaded), "%Y-%m-%d %H:%M:%S", localtime_r(&index->loaded_at, &tm_loaded));
+    }
+
+    printf("generation: %d\n", policy_generation);
+    printf("rules: %u\n", index ? index->header->rule_count : 0);
+    printf("loaded: %s (%.3f ms)\n", loaded, index ? index->load_seconds * 1000.0 : 0.0);
+    printf("source: %s (%s)\n", policy_path, index && index->mapped ? "compiled, mapped" : "text");
+    printf("watch: %s\n", policy_watch_fd >= 0 ? "inotify" : "off");
+    if (similarity_threshold < 0) printf("threshold: off\n");
+    else printf("threshold: %d tokens\n", similarity_threshold);
+    printf("reloads: %ld (%ld failed)\n",
+           __atomic_load_n(&policy_reloads, __ATOMIC_RELAXED),
+           __atomic_load_n(&policy_reload_failures, __ATOMIC_RELAXED));
+    return 0;
+}
+
+// Time blocklist lookups against synthetic lists of growing size
+int bench_policy(void) {
+    const int sizes[] = {10, 100, 1000, 10000, 100000};
+    const int iterations = 200000;
+    const char *probes[][2] = {
+        {"miss", "ls -la /tmp"},
+        {"exact", "cmd7 --opt7 /path/7"},
+        {"pattern", "cmd0 -fr /srv/x/0"},
+        {"canonical", "cmd3 --opt3 /path//3/."},
+        {"warn", "cmd7 --other"},
+    };
+    int probe_count = sizeof(probes) / sizeof(probes[0]);
+    DangerIndex *saved = danger_index;
+
+    printf("%8s %10s", "rules", "build_ms");
+    for (int p = 0; p < probe_count; p++) printf(" %9s_ns", probes[p][0]);
+    printf("\n");
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int n = sizes[s];
+        char *text = safe_malloc((size_t)n * 64);
+        size_t text_size = 0;
+
+        // One rule in ten is a pattern; command names repeat so heads share chains
+        for (int i = 0; i < n; i++) {
+            if (i % 10 == 0) text_size += sprintf(text + text_size, "cmd%d -*r* /srv/*/%d\n", i % 997, i);
+            else text_size += sprintf(text + text_size, "cmd%d --opt%d /path/%d\n", i % 997, i, i);
+        }
+        size_t line_count = 0;
+        LineView *lines = index_lines(text, text_size, &line_count);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        danger_index = danger_index_build(text, lines, (int)line_count);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("%8d %10.2f", n, time_diff(t0, t1) * 1000.0);
+        fflush(stdout);
+
+        for (int p = 0; p < probe_count; p++) {
+            int argc_probe = 0;
+            char **args = split_to_args(probes[p][1], delim, &argc_probe);
+            DangerMatch match;
+            volatile int sink = 0;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (int it = 0; it < iterations; it++) {
+                sink += classify_against_index(danger_index, args, argc_probe, &match);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            (void)sink;
+
+            printf(" %12.1f", time_diff(t0, t1) * 1e9 / iterations);
+            free_args(args);
+        }
+        printf("\n");
+
+        danger_index_free(danger_index);
+        free(lines);
+        free(text);
+    }
+
+    danger_index = saved;
+    return 0;
+}
+
+// Time mapping and indexing a text file; prints throughput in GB/s
+int bench_lines(const char *path) {
+    LineFile file;
+    if (line_file_open(path, &file) != 0) {
+        return 1;
+    }
+    size_t lines = file.count;
+    line_file_close(&file);
+
+    // Repeat until at least half a second has passed so small files still measure well
+    struct timespec t0, t1;
+    double open_seconds = 0, scan_seconds = 0;
+    long open_runs = 0, scan_runs = 0;
+
+    while (open_seconds < 0.5 || open_runs < 3) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (line_file_open(path, &file) != 0) return 1;
+        line_file_close(&file);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        open_seconds += time_diff(t0, t1);
+        open_runs++;
+    }
+
+    if (line_file_open(path, &file) != 0) return 1;
+    while (scan_seconds < 0.5 || scan_runs < 3) {
+        size_t count = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        free(index_lines(file.data, file.size, &count));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        scan_seconds += time_diff(t0, t1);
+        scan_runs++;
+    }
+    double size = (double)file.size;
+    line_file_close(&file);
+
+#ifdef __SSE2__
+    const char *scan_kind = "sse2";
+#else
+    const char *scan_kind = "scalar";
+#endif
+    printf("%s: %.0f bytes, %zu lines\n", path, size, lines);
+    printf("index (%s): %10.3f ms %8.2f GB/s\n", scan_kind,
+           scan_seconds / scan_runs * 1000.0, size * scan_runs / scan_seconds / 1e9);
+    printf("map + index:   %10.3f ms %8.2f GB/s\n",
+           open_seconds / open_runs * 1000.0, size * open_runs / open_seconds / 1e9);
+    return 0;
+}
+
+// Print the message for a danger verdict and update the counters; returns 1 if execution is blocked
+int report_danger_verdict(int verdict, const DangerMatch *match) {
+    PROBE5(danger_verdict, current_command, verdict, match->rule, match->rule_id, match->token_distance);
+
+    if (verdict == DANGER_BLOCK && match->rule == NULL) {
+        fprintf(stderr,"ERR: Dangerous commands list unavailable. Execution prevented.\n");
+        fflush(stdout);
+        return 1; // BLOCK execution
+    }
+
+    if (verdict == DANGER_BLOCK) {
+        fprintf(stderr,"ERR: Dangerous command detected (\"%s\"). Execution prevented.\n", match->rule);
+        fflush(stdout);
+        dangerous_cmd_blocked_count++;
+        danger_rule_record_hit(match->index, match->rule_id, verdict);
+        return 1; // BLOCK execution
+    }
+
+    if (verdict == DANGER_WARN) {
+        fprintf(stderr,"WARNING: Command similar to dangerous command (\"%s\", distance %d tokens / %d chars). Proceed with caution.\n",
+                match->rule, match->token_distance, match->char_distance);
+        fflush(stdout);
+        semi_dangerous_cmd_count++;
+        danger_warned_total++;
+        flag_semi_dangerous = 1;
+        danger_rule_record_hit(match->index, match->rule_id, verdict);
+    }
+
+    return 0; // ALLOW execution
+}
+
+// FNV-1a hash of a NUL-terminated string
+unsigned long long hash_string(const char *str) {
+    unsigned long long hash = 1469598103934665603ULL;
+    if (!str) return hash;
+
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// FNV-1a hash of a byte range
+unsigned long long hash_bytes(const char *data, size_t len) {
+    unsigned long long hash = 1469598103934665603ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Deep copy a NULL-terminated argument array
+char **dup_args(char **args) {
+    if (!args) return NULL;
+
+    int len = 0;
+    while (args[len]) len++;
+
+    char **copy = safe_malloc((len + 1) * sizeof(char *));
+    for (int i = 0; i < len; i++) {
+        copy[i] = strdup(args[i]);
+        if (!copy[i]) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            exit(1);
+        }
+    }
+    copy[len] = NULL;
+    return copy;
+}
+
+// Unlink an entry from the LRU list
+static void cmd_cache_lru_unlink(int idx) {
+    ParsedCommand *entry = &cmd_cache[idx];
+
+    if (entry->lru_prev != -1) cmd_cache[entry->lru_prev].lru_next = entry->lru_next;
+    else cmd_cache_lru_head = entry->lru_next;
+
+    if (entry->lru_next != -1) cmd_cache[entry->lru_next].lru_prev = entry->lru_prev;
+    else cmd_cache_lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = -1;
+}
+
+// Put an entry at the most recently used end of the LRU list
+static void cmd_cache_lru_push_front(int idx) {
+    ParsedCommand *entry = &cmd_cache[idx];
+
+    entry->lru_prev = -1;
+    entry->lru_next = cmd_cache_lru_head;
+    if (cmd_cache_lru_head != -1) cmd_cache[cmd_cache_lru_head].lru_prev = idx;
+    cmd_cache_lru_head = idx;
+    if (cmd_cache_lru_tail == -1) cmd_cache_lru_tail = idx;
+}
+
+// Release an entry and remove it from its hash bucket
+static void cmd_cache_evict(int idx) {
+    ParsedCommand *entry = &cmd_cache[idx];
+    int *link = &cmd_cache_buckets[entry->hash & (CMD_CACHE_BUCKETS - 1)];
+
+    while (*link != -1 && *link != idx) {
+        link = &cmd_cache[*link].bucket_next;
+    }
+    if (*link == idx) *link = entry->bucket_next;
+
+    cmd_cache_lru_unlink(idx);
+    free(entry->line);
+    free_args(entry->l_args);
+    free_args(entry->r_args);
+    free_redirections(&entry->l_redir);
+    free_redirections(&entry->r_redir);
+    memset(entry, 0, sizeof(*entry));
+    entry->lru_prev = entry->lru_next = entry->bucket_next = -1;
+    cmd_cache_count--;
+}
+
+// Drop every cached entry
+void cmd_cache_flush(void) {
+    if (!cmd_cache_ready) {
+        for (int i = 0; i < CMD_CACHE_BUCKETS; i++) cmd_cache_buckets[i] = -1;
+        for (int i = 0; i < CMD_CACHE_SIZE; i++) {
+            cmd_cache[i].lru_prev = cmd_cache[i].lru_next = cmd_cache[i].bucket_next = -1;
+        }
+        cmd_cache_ready = 1;
+    }
+
+    for (int i = 0; i < CMD_CACHE_SIZE; i++) {
+        if (cmd_cache[i].in_use) cmd_cache_evict(i);
+    }
+}
+
+// Flush the cache if the blocklist or PATH changed since it was filled
+static void cmd_cache_validate(void) {
+    unsigned long long path_hash = hash_string(getenv("PATH"));
+
+    if (!cmd_cache_ready || cmd_cache_generation != policy_generation || cmd_cache_path_hash != path_hash) {
+        cmd_cache_flush();
+        cmd_cache_generation = policy_generation;
+        cmd_cache_path_hash = path_hash;
+    }
+}
+
+// Look up a raw input line; returns the cached parse or NULL
+ParsedCommand* cmd_cache_lookup(const char *line) {
+    cmd_cache_validate();
+
+    unsigned long long hash = hash_string(line);
+    int idx = cmd_cache_buckets[hash & (CMD_CACHE_BUCKETS - 1)];
+
+    while (idx != -1) {
+        ParsedCommand *entry = &cmd_cache[idx];
+        if (entry->hash == hash && strcmp(entry->line, line) == 0) {
+            cmd_cache_lru_unlink(idx);
+            cmd_cache_lru_push_front(idx);
+            cmd_cache_hits++;
+            return entry;
+        }
+        idx = entry->bucket_next;
+    }
+
+    cmd_cache_misses++;
+    return NULL;
+}
+
+// Remember the parse and danger verdicts of a raw input line
+void cmd_cache_store(const char *line, int pipe, char **largs, int largs_len, char **rargs, int rargs_len,
+                     const Redirections *lredir, const Redirections *rredir,
+                     int l_verdict, const DangerMatch *l_match, int r_verdict, const DangerMatch *r_match) {
+    cmd_cache_validate();
+
+    int idx = -1;
+    if (cmd_cache_count == CMD_CACHE_SIZE) {
+        idx = cmd_cache_lru_tail;
+        cmd_cache_evict(idx);
+    } else {
+        for (int i = 0; i < CMD_CACHE_SIZE; i++) {
+            if (!cmd_cache[i].in_use) {
+                idx = i;
+                break;
+            }
+        }
+    }
+
+    ParsedCommand *entry = &cmd_cache[idx];
+    entry->hash = hash_string(line);
+    entry->line = strdup(line);
+    if (!entry->line) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(1);
+    }
+    entry->pip_flag = pipe;
+    entry->l_args = dup_args(largs);
+    entry->l_args_len = largs_len;
+    entry->r_args = dup_args(rargs);
+    entry->r_args_len = rargs_len;
+    copy_redirections(&entry->l_redir, lredir);
+    copy_redirections(&entry->r_redir, rredir);
+    entry->l_verdict = l_verdict;
+    entry->l_match = *l_match;
+    entry->r_verdict = r_verdict;
+    entry->r_match = *r_match;
+    entry->in_use = 1;
+
+    int *bucket = &cmd_cache_buckets[entry->hash & (CMD_CACHE_BUCKETS - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = idx;
+    cmd_cache_lru_push_front(idx);
+    cmd_cache_count++;
+}
+
+// cmdcache [clear] - show (or reset) parsed-command cache statistics
+int cmdcache_builtin(char **args, int args_len) {
+    if (args_len > 1 && strcmp(args[1], "clear") == 0) {
+        cmd_cache_flush();
+        cmd_cache_hits = 0;
+        cmd_cache_misses = 0;
+        return 0;
+    }
+
+    long lookups = cmd_cache_hits + cmd_cache_misses;
+    printf("cmdcache: entries=%d/%d hits=%ld misses=%ld hit_rate=%.1f%%\n",
+           cmd_cache_count, CMD_CACHE_SIZE, cmd_cache_hits, cmd_cache_misses,
+           lookups ? 100.0 * cmd_cache_hits / lookups : 0.0);
+    return 0;
+}
+
+// Unlink an entry from the verdict LRU list
+static void verdict_cache_lru_unlink(int idx) {
+    VerdictEntry *entry = &verdict_cache[idx];
+
+    if (entry->lru_prev != -1) verdict_cache[entry->lru_prev].lru_next = entry->lru_next;
+    else verdict_cache_lru_head = entry->lru_next;
+
+    if (entry->lru_next != -1) verdict_cache[entry->lru_next].lru_prev = entry->lru_prev;
+    else verdict_cache_lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = -1;
+}
+
+// Put an entry at the most recently used end of the verdict LRU list
+static void verdict_cache_lru_push_front(int idx) {
+    VerdictEntry *entry = &verdict_cache[idx];
+
+    entry->lru_prev = -1;
+    entry->lru_next = verdict_cache_lru_head;
+    if (verdict_cache_lru_head != -1) verdict_cache[verdict_cache_lru_head].lru_prev = idx;
+    verdict_cache_lru_head = idx;
+    if (verdict_cache_lru_tail == -1) verdict_cache_lru_tail = idx;
+}
+
+// Release a verdict entry and remove it from its hash bucket
+static void verdict_cache_evict(int idx) {
+    VerdictEntry *entry = &verdict_cache[idx];
+    int *link = &verdict_cache_buckets[entry->hash & (VERDICT_CACHE_BUCKETS - 1)];
+
+    while (*link != -1 && *link != idx) {
+        link = &verdict_cache[*link].bucket_next;
+    }
+    if (*link == idx) *link = entry->bucket_next;
+
+    verdict_cache_lru_unlink(idx);
+    free(entry->key);
+    memset(entry, 0, sizeof(*entry));
+    entry->lru_prev = entry->lru_next = entry->bucket_next = -1;
+    verdict_cache_count--;
+}
+
+// Drop every cached verdict
+void verdict_cache_flush(void) {
+    if (!verdict_cache_ready) {
+        for (int i = 0; i < VERDICT_CACHE_BUCKETS; i++) verdict_cache_buckets[i] = -1;
+        for (int i = 0; i < VERDICT_CACHE_SIZE; i++) {
+            verdict_cache[i].lru_prev = verdict_cache[i].lru_next = verdict_cache[i].bucket_next = -1;
+        }
+        verdict_cache_ready = 1;
+    }
+
+    for (int i = 0; i < VERDICT_CACHE_SIZE; i++) {
+        if (verdict_cache[i].in_use) verdict_cache_evict(i);
+    }
+}
+
+// Flush the verdicts if the index, policy generation or PATH changed since they were
+// computed. The index is compared too: the reload thread can swap it between two
+// classifications of the same input line, before policy_sync() bumps the generation
+static void verdict_cache_validate(const DangerIndex *index) {
+    unsigned long long path_hash = hash_string(getenv("PATH"));
+
+    if (!verdict_cache_ready || verdict_cache_index != index ||
+        verdict_cache_generation != policy_generation || verdict_cache_path_hash != path_hash) {
+        verdict_cache_flush();
+        verdict_cache_index = index;
+        verdict_cache_generation = policy_generation;
+        verdict_cache_path_hash = path_hash;
+    }
+}
+
+// Bytes of the key for an argument vector (each token NUL-terminated)
+static size_t verdict_key_length(char **args, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) len += strlen(args[i]) + 1;
+    return len;
+}
+
+// Whether an entry's key holds exactly these arguments
+static int verdict_key_equals(const VerdictEntry *entry, char **args, int count, size_t len) {
+    if (entry->key_len != len) return 0;
+
+    const char *key = entry->key;
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(args[i]) + 1;
+        if (memcmp(key, args[i], n) != 0) return 0;
+        key += n;
+    }
+    return 1;
+}
+
+// Look up the verdict for an argument vector; returns DANGER_* or -1 on a miss
+static int verdict_cache_lookup(const DangerIndex *index, char **args, int count, DangerMatch *match) {
+    verdict_cache_validate(index);
+
+    unsigned long long hash = hash_args(args, count);
+    size_t len = verdict_key_length(args, count);
+    int idx = verdict_cache_buckets[hash & (VERDICT_CACHE_BUCKETS - 1)];
+
+    while (idx != -1) {
+        VerdictEntry *entry = &verdict_cache[idx];
+        if (entry->hash == hash && verdict_key_equals(entry, args, count, len)) {
+            verdict_cache_lru_unlink(idx);
+            verdict_cache_lru_push_front(idx);
+            verdict_cache_hits++;
+
+            match->rule_id = entry->rule_id;
+            match->rule = entry->rule_id >= 0 ? danger_rule_line(index, (uint32_t)entry->rule_id) : NULL;
+            match->index = entry->rule_id >= 0 ? (DangerIndex*)index : NULL;
+            match->token_distance = entry->token_distance;
+            match->char_distance = entry->char_distance;
+            return entry->verdict;
+        }
+        idx = entry->bucket_next;
+    }
+
+    verdict_cache_misses++;
+    return -1;
+}
+
+// Remember the verdict computed for an argument vector
+static void verdict_cache_store(const DangerIndex *index, char **args, int count, int verdict, const DangerMatch *match) {
+    verdict_cache_validate(index);
+
+    int idx = -1;
+    if (verdict_cache_count == VERDICT_CACHE_SIZE) {
+        idx = verdict_cache_lru_tail;
+        verdict_cache_evict(idx);
+    } else {
+        for (int i = 0; i < VERDICT_CACHE_SIZE; i++) {
+            if (!verdict_cache[i].in_use) {
+                idx = i;
+                break;
+            }
+        }
+    }
+
+    VerdictEntry *entry = &verdict_cache[idx];
+    entry->key_len = verdict_key_length(args, count);
+    entry->key = safe_malloc(entry->key_len);
+    char *key = entry->key;
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(args[i]) + 1;
+        memcpy(key, args[i], n);
+        key += n;
+    }
+    entry->hash = hash_args(args, count);
+    entry->verdict = verdict;
+    entry->rule_id = match->rule_id;
+    entry->token_distance = match->token_distance;
+    entry->char_distance = match->char_distance;
+    entry->in_use = 1;
+
+    int *bucket = &verdict_cache_buckets[entry->hash & (VERDICT_CACHE_BUCKETS - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = idx;
+    verdict_cache_lru_push_front(idx);
+    verdict_cache_count++;
+}
+
+// Map an open history file, reserving room for it to grow without remapping
+static void* hist_map_file(int fd, size_t map_max) {
+    void *map = mmap(NULL, map_max, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Grow a history file (in HIST_GROW_STEP chunks) so that 'needed' bytes are backed
+static int hist_ensure_size(int fd, uint64_t needed, uint64_t map_max) {
+    struct stat st;
+    if (needed > map_max || fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if ((uint64_t)st.st_size >= needed) {
+        return 0;
+    }
+
+    uint64_t new_size = (needed + HIST_GROW_STEP - 1) / HIST_GROW_STEP * HIST_GROW_STEP;
+    if (new_size > map_max) new_size = map_max;
+    return ftruncate(fd, (off_t)new_size);
+}
+
+static HistoryIndexHeader* hist_header(void) {
+    return (HistoryIndexHeader*)hist_index;
+}
+
+static uint64_t* hist_buckets(int level) {
+    return (uint64_t*)(hist_index + sizeof(HistoryIndexHeader)) + (size_t)level * HIST_BUCKETS;
+}
+
+static uint64_t* hist_offsets(void) {
+    return (uint64_t*)(hist_index + HIST_INDEX_OFFSETS);
+}
+
+// Bytes a record with 'len' bytes of text takes in the record file
+static uint64_t hist_record_size(uint32_t len) {
+    return (sizeof(HistoryRecord) + len + 1 + 7) & ~(uint64_t)7;
+}
+
+// Whether a whole record (header and NUL-terminated text) starts at offset within data_end
+static int hist_record_fits(uint64_t offset, uint64_t data_end) {
+    if (offset % 8 != 0 || offset > data_end || data_end - offset < hist_record_size(0)) {
+        return 0;
+    }
+    const HistoryRecord *rec = (const HistoryRecord*)(hist_data + offset);
+    if (rec->len > data_end - offset - sizeof(HistoryRecord) - 1) {
+        return 0;
+    }
+    return ((const char*)(rec + 1))[rec->len] == '\0';
+}
+
+// Link record n into the prefix bucket of each level
+static void hist_link(HistoryRecord *rec, uint64_t n) {
+    const char *line = (const char*)(rec + 1);
+    for (int level = 0; level < HIST_PREFIX_LEVELS; level++) {
+        if (rec->len <= (uint32_t)level) {
+            rec->prev[level] = 0;
+            continue;
+        }
+        uint64_t *bucket = &hist_buckets(level)[hash_bytes(line, level + 1) & (HIST_BUCKETS - 1)];
+        rec->prev[level] = *bucket;
+        *bucket = n + 1;
+    }
+}
+
+// Whether the index header fits the two files. Only the header is checked here, so
+// opening costs the same for any history size; offsets and bucket links are checked
+// as each entry is read (history_record, history_search_prefix)
+static int hist_index_valid(uint64_t data_size, uint64_t index_size) {
+    HistoryIndexHeader *hdr = hist_header();
+    return hdr->data_end <= data_size && index_size >= HIST_INDEX_OFFSETS &&
+           hdr->count <= (index_size - HIST_INDEX_OFFSETS) / sizeof(uint64_t);
+}
+
+// Rebuild the index from the record file, keeping records up to the first damaged one.
+// Returns the number of records kept
+static long hist_rebuild_index(uint64_t data_size) {
+    HistoryIndexHeader *hdr = hist_header();
+    memset(hist_buckets(0), 0, (size_t)HIST_PREFIX_LEVELS * HIST_BUCKETS * sizeof(uint64_t));
+
+    uint64_t n = 0;
+    uint64_t offset = 0;
+    while (hist_record_fits(offset, data_size)) {
+        HistoryRecord *rec = (HistoryRecord*)(hist_data + offset);
+        // Zero-filled space past the last record (files grow in steps) ends the scan
+        if (rec->timestamp <= 0 || rec->len == 0 || memchr(rec + 1, '\0', rec->len) != NULL) break;
+        if (hist_ensure_size(hist_index_fd, HIST_INDEX_OFFSETS + (n + 1) * sizeof(uint64_t), HIST_INDEX_MAP_MAX) != 0) break;
+
+        hist_offsets()[n] = offset;
+        hist_link(rec, n);
+        offset += hist_record_size(rec->len);
+        n++;
+    }
+
+    hdr->data_end = offset;
+    hdr->count = n;
+    return (long)n;
+}
+
+// Open (or create) the history files the first time history is used; history is
+// disabled if this fails
+void history_open(void) {
+    if (hist_opened) return;
+    hist_opened = 1;
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    char path[PATH_MAX];
+    const char *file = getenv("MINISHELL_HISTFILE");
+
+    if (file == NULL || file[0] == '\0') {
+        const char *home = getenv("HOME");
+        if (home == NULL || home[0] == '\0') return;
+        snprintf(path, sizeof(path), "%s/.minishell_history", home);
+    } else {
+        snprintf(path, sizeof(path), "%s", file);
+    }
+
+    char index_path[PATH_MAX + 8];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+
+    hist_data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    hist_index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (hist_data_fd < 0 || hist_index_fd < 0) {
+        perror("history: open");
+        history_close();
+        return;
+    }
+
+    flock(hist_index_fd, LOCK_EX);
+    int ok = hist_ensure_size(hist_index_fd, HIST_INDEX_OFFSETS + sizeof(uint64_t), HIST_INDEX_MAP_MAX) == 0;
+    if (ok) {
+        hist_index = hist_map_file(hist_index_fd, HIST_INDEX_MAP_MAX);
+        hist_data = hist_map_file(hist_data_fd, HIST_DATA_MAP_MAX);
+        ok = hist_index != NULL && hist_data != NULL;
+    }
+    int fresh = 0;
+    if (ok) {
+        HistoryIndexHeader *hdr = hist_header();
+        if (hdr->magic[0] == '\0') {
+            memcpy(hdr->magic, HIST_MAGIC, sizeof(hdr->magic));
+            fresh = 1;
+        } else if (memcmp(hdr->magic, HIST_MAGIC, sizeof(hdr->magic)) != 0) {
+            fprintf(stderr, "history: %s is not a history index, history disabled\n", index_path);
+            ok = 0;
+        }
+    }
+
+    // An index whose header does not fit its files (or a new index next to old
+    // records) is rebuilt from the records rather than trusted
+    struct stat data_st, index_st;
+    if (ok && (ok = fstat(hist_data_fd, &data_st) == 0 && fstat(hist_index_fd, &index_st) == 0)) {
+        if ((fresh && data_st.st_size > 0) || !hist_index_valid((uint64_t)data_st.st_size, (uint64_t)index_st.st_size)) {
+            long kept = hist_rebuild_index((uint64_t)data_st.st_size);
+            fprintf(stderr, "history: rebuilt %s from %s (%ld commands)\n", index_path, path, kept);
+        }
+    }
+    flock(hist_index_fd, LOCK_UN);
+
+    if (!ok) {
+        history_close();
+    }
+    startup_first_use("history", begin);
+}
+
+// Unmap and close the history files
+void history_close(void) {
+    if (hist_data) munmap(hist_data, HIST_DATA_MAP_MAX);
+    if (hist_index) munmap(hist_index, HIST_INDEX_MAP_MAX);
+    if (hist_data_fd >= 0) close(hist_data_fd);
+    if (hist_index_fd >= 0) close(hist_index_fd);
+    hist_data = NULL;
+    hist_index = NULL;
+    hist_data_fd = -1;
+    hist_index_fd = -1;
+}
+
+// Number of records in the history (all sessions)
+long history_count(void) {
+    history_open();
+    return hist_index ? (long)hist_header()->count : 0;
+}
+
+// Get record n (0-based), or NULL if out of range or its offset and length do not fit
+// the record file
+HistoryRecord* history_record(long n) {
+    if (n < 0 || n >= history_count()) return NULL;
+    uint64_t offset = hist_offsets()[n];
+    if (!hist_record_fits(offset, hist_header()->data_end)) return NULL;
+    return (HistoryRecord*)(hist_data + offset);
+}
+
+// Command text of a history record
+const char* history_text(HistoryRecord *rec) {
+    return (const char*)(rec + 1);
+}
+
+// Append a command line to the history; returns its record number or -1
+long history_append(const char *line) {
+    history_open();
+    if (!hist_index) return -1;
+
+    uint32_t len = (uint32_t)strlen(line);
+    uint64_t rec_size = hist_record_size(len);
+
+    flock(hist_index_fd, LOCK_EX);
+    HistoryIndexHeader *hdr = hist_header();
+    uint64_t n = hdr->count;
+    uint64_t offset = hdr->data_end;
+
+    if (hist_ensure_size(hist_data_fd, offset + rec_size, HIST_DATA_MAP_MAX) != 0 ||
+        hist_ensure_size(hist_index_fd, HIST_INDEX_OFFSETS + (n + 1) * sizeof(uint64_t), HIST_INDEX_MAP_MAX) != 0) {
+        flock(hist_index_fd, LOCK_UN);
+        return -1;
+    }
+
+    HistoryRecord *rec = (HistoryRecord*)(hist_data + offset);
+    rec->timestamp = (int64_t)time(NULL);
+    rec->duration = -1;
+    rec->exit_status = -1;
+    rec->len = len;
+    memcpy((char*)(rec + 1), line, len + 1);
+    hist_link(rec, n);
+
+    hist_offsets()[n] = offset;
+    hdr->data_end = offset + rec_size;
+    hdr->count = n + 1;
+    flock(hist_index_fd, LOCK_UN);
+
+    return (long)n;
+}
+
+// Store the exit status and duration of a finished command
+void history_set_result(long n, int exit_status, double duration) {
+    HistoryRecord *rec = history_record(n);
+    if (!rec) return;
+
+    rec->duration = duration;
+    rec->exit_status = exit_status;
+}
+
+// Find up to max records starting with prefix, newest first, by walking the bucket
+// chain of its first 1..HIST_PREFIX_LEVELS characters; returns how many were found
+int history_search_prefix(const char *prefix, long *matches, int max) {
+    size_t len = strlen(prefix);
+    history_open();
+    if (!hist_index || len == 0) return 0;
+
+    int level = len < HIST_PREFIX_LEVELS ? (int)len : HIST_PREFIX_LEVELS;
+    uint64_t n = hist_buckets(level - 1)[hash_bytes(prefix, level) & (HIST_BUCKETS - 1)];
+    int found = 0;
+
+    while (n != 0 && found < max) {
+        HistoryRecord *rec = history_record((long)n - 1);
+        if (!rec) break;
+        if (rec->len >= len && strncmp(history_text(rec), prefix, len) == 0) {
+            matches[found++] = (long)n - 1;
+        }
+        // Chains only point back in time; anything else is damage, not a longer chain
+        if (rec->prev[level - 1] >= n) break;
+        n = rec->prev[level - 1];
+    }
+    return found;
+}
+
+// Find the most recent record starting with prefix; returns -1 if none
+long history_find_prefix(const char *prefix) {
+    long n;
+    return history_search_prefix(prefix, &n, 1) == 1 ? n : -1;
+}
+
+// Expand a leading !!, !n, !-n or !prefix event in place; returns -1 if the event is unknown
+int expand_history(char *input, size_t size) {
+    if (input[0] != '!' || input[1] == '\0' || input[1] == ' ') {
+        return 0;
+    }
+
+    const char *rest = input + 1;
+    long n = -1;
+
+    if (*rest == '!') {
+        n = history_count() - 1;
+        rest++;
+    } else if (isdigit((unsigned char)*rest) || (*rest == '-' && isdigit((unsigned char)rest[1]))) {
+        char *endptr;
+        long num = strtol(rest, &endptr, 10);
+        n = num < 0 ? history_count() + num : num - 1;
+        rest = endptr;
+    } else {
+        char prefix[MAX_INPUT_LENGTHH];
+        size_t len = strcspn(rest, " ");
+        memcpy(prefix, rest, len);
+        prefix[len] = '\0';
+        n = history_find_prefix(prefix);
+        rest += len;
+    }
+
+    HistoryRecord *rec = history_record(n);
+    if (!rec) {
+        printf("ERR: event not found: %s\n", input);
+        return -1;
+    }
+
+    char expanded[MAX_INPUT_LENGTHH];
+    int written = snprintf(expanded, sizeof(expanded), "%s%s", history_text(rec), rest);
+    if (written < 0 || (size_t)written >= size || written > MAX_INPUT_LENGTH) {
+        printf("ERR\n");
+        return -1;
+    }
+
+    strcpy(input, expanded);
+    printf("%s\n", input);
+    fflush(stdout);
+    return 0;
+}
+
+// Print one history record with its recorded outcome
+static void history_print(long n) {
+    HistoryRecord *rec = history_record(n);
+    if (!rec) return;
+
+    printf("%6ld  %s", n + 1, history_text(rec));
+    if (rec->exit_status >= 0) {
+        printf("  [%.5f sec, exit %d]", rec->duration, rec->exit_status);
+    }
+    printf("\n");
+}
+
+// history [N] | history -s <prefix> - list recent commands, or the latest ones starting with prefix
+int history_builtin(char **args, int args_len) {
+    history_open();
+    if (!hist_index) {
+        printf("history: not available\n");
+        return 1;
+    }
+
+    long count = history_count();
+
+    if (args_len > 1 && strcmp(args[1], "-s") == 0) {
+        if (args_len < 3) {
+            printf("ERR: Usage: history -s <prefix>\n");
+            return 1;
+        }
+
+        // The words after -s, joined by single spaces, are the prefix
+        char prefix[MAX_INPUT_LENGTHH];
+        size_t used = 0;
+        for (int i = 2; i < args_len && used < sizeof(prefix) - 1; i++) {
+            used += snprintf(prefix + used, sizeof(prefix) - used, "%s%s", i > 2 ? " " : "", args[i]);
+        }
+
+        long matches[HIST_DEFAULT_SHOW];
+        int found = history_search_prefix(prefix, matches, HIST_DEFAULT_SHOW);
+        for (int i = found - 1; i >= 0; i--) {
+            history_print(matches[i]);
+        }
+        return 0;
+    }
+
+    long show = HIST_DEFAULT_SHOW;
+    if (args_len > 1) {
+        show = strtol(args[1], NULL, 10);
+        if (show <= 0) {
+            printf("ERR: Usage: history [N] | history -s <prefix>\n");
+            return 1;
+        }
+    }
+
+    for (long n = count > show ? count - show : 0; n < count; n++) {
+        history_print(n);
+    }
+    return 0;
+}
+
+// Read a directory with large getdents64 batches, calling fn for each entry except . and ..
+// Stops early (and returns 1) when fn returns non-zero; returns -1 if the directory can't be read
+int scan_directory(const char *path, dir_entry_fn fn, void *ctx) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    char *buffer = safe_malloc(DIR_SCAN_BUFFER);
+    int result = 0;
+    long nread;
+
+    while (result == 0 && (nread = syscall(SYS_getdents64, fd, buffer, DIR_SCAN_BUFFER)) > 0) {
+        for (long off = 0; off < nread;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64*)(buffer + off);
+            off += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (fn(name, entry->d_type, ctx) != 0) {
+                result = 1;
+                break;
+            }
+        }
+    }
+    if (result == 0 && nread < 0) result = -1;
+
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// Add a word to a completion trie
+void trie_insert(CompletionTrie *trie, const char *word) {
+    if (trie->count == 0) {
+        trie->capacity = 1024;
+        trie->nodes = safe_malloc(trie->capacity * sizeof(TrieNode));
+        trie->nodes[0] = (TrieNode){0, 0, -1, -1};
+        trie->count = 1;
+    }
+
+    int node = 0;
+    for (; *word; word++) {
+        // Children are kept sorted so completions list alphabetically
+        int prev = -1;
+        int child = trie->nodes[node].child;
+        while (child != -1 && trie->nodes[child].ch < *word) {
+            prev = child;
+            child = trie->nodes[child].next;
+        }
+
+        if (child == -1 || trie->nodes[child].ch != *word) {
+            if (trie->count == trie->capacity) {
+                trie->capacity *= 2;
+                TrieNode *grown = realloc(trie->nodes, trie->capacity * sizeof(TrieNode));
+                if (!grown) {
+                    fprintf(stderr, "Memory allocation failed!\n");
+                    exit(1);
+                }
+                trie->nodes = grown;
+            }
+            int created = trie->count++;
+            trie->nodes[created] = (TrieNode){*word, 0, -1, child};
+            if (prev == -1) trie->nodes[node].child = created;
+            else trie->nodes[prev].next = created;
+            child = created;
+        }
+        node = child;
+    }
+    trie->nodes[node].terminal = 1;
+}
+
+// Free a completion trie
+void trie_free(CompletionTrie *trie) {
+    free(trie->nodes);
+    trie->nodes = NULL;
+    trie->count = trie->capacity = 0;
+}
+
+// Node reached by following prefix from the root, or -1
+static int trie_find(CompletionTrie *trie, const char *prefix) {
+    if (trie->count == 0) return -1;
+
+    int node = 0;
+    for (; *prefix; prefix++) {
+        int child = trie->nodes[node].child;
+        while (child != -1 && trie->nodes[child].ch != *prefix) {
+            child = trie->nodes[child].next;
+        }
+        if (child == -1) return -1;
+        node = child;
+    }
+    return node;
+}
+
+// Collect up to max words below node (each prefixed with word[0..depth))
+static void trie_collect(CompletionTrie *trie, int node, char *word, int depth, char **out, int *found, int max) {
+    if (*found >= max || depth >= MAX_INPUT_LENGTH) return;
+
+    if (trie->nodes[node].terminal) {
+        word[depth] = '\0';
+        out[(*found)++] = strdup(word);
+    }
+    for (int child = trie->nodes[node].child; child != -1 && *found < max; child = trie->nodes[child].next) {
+        word[depth] = trie->nodes[child].ch;
+        trie_collect(trie, child, word, depth + 1, out, found, max);
+    }
+}
+
+static int command_trie_add_entry(const char *name, unsigned char d_type, void *ctx) {
+    // Symlinks and unknown types may still be executables; directories never are
+    if (d_type != DT_DIR) {
+        trie_insert((CompletionTrie*)ctx, name);
+    }
+    return 0;
+}
+
+// Build the command trie if PATH or any PATH directory changed since the last build
+void command_trie_refresh(void) {
+    const char *path_env = getenv("PATH");
+    unsigned long long path_hash = hash_string(path_env);
+    char *path_copy = strdup(path_env ? path_env : "");
+    if (!path_copy) return;
+
+    int stale = !command_trie_built || path_hash != command_trie_path_hash;
+    int dirs = 0;
+    struct timespec mtimes[COMPLETION_MAX_PATH_DIRS];
+
+    char *save = NULL;
+    for (char *dir = strtok_r(path_copy, ":", &save); dir && dirs < COMPLETION_MAX_PATH_DIRS;
+         dir = strtok_r(NULL, ":", &save)) {
+        struct stat st;
+        if (stat(dir, &st) != 0) {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        mtimes[dirs] = st.st_mtim;
+        if (!stale && (mtimes[dirs].tv_sec != command_trie_mtimes[dirs].tv_sec ||
+                       mtimes[dirs].tv_nsec != command_trie_mtimes[dirs].tv_nsec)) {
+            stale = 1;
+        }
+        dirs++;
+    }
+
+    if (stale) {
+        trie_free(&command_trie);
+        for (int i = 0; builtin_commands[i].name != NULL; i++) trie_insert(&command_trie, builtin_commands[i].name);
+        for (int i = 0; custom_commands[i].name != NULL; i++) trie_insert(&command_trie, custom_commands[i].name);
+        trie_insert(&command_trie, "done");
+        trie_insert(&command_trie, "rlimit");
+        trie_insert(&command_trie, "mcalc");
+
+        strcpy(path_copy, path_env ? path_env : "");
+        int i = 0;
+        for (char *dir = strtok_r(path_copy, ":", &save); dir && i < dirs;
+             dir = strtok_r(NULL, ":", &save), i++) {
+            scan_directory(dir, command_trie_add_entry, &command_trie);
+        }
+
+        memcpy(command_trie_mtimes, mtimes, sizeof(mtimes[0]) * dirs);
+        command_trie_path_hash = path_hash;
+        command_trie_built = 1;
+    }
+
+    free(path_copy);
+}
+
+// Candidate collector for file name completion
+typedef struct {
+    const char *prefix;
+    size_t prefix_len;
+    char **names;
+    unsigned char *is_dir;
+    int found;
+    int max;
+    const char *dir;
+} FileCompletion;
+
+static int file_completion_add_entry(const char *name, unsigned char d_type, void *ctx) {
+    FileCompletion *fc = (FileCompletion*)ctx;
+
+    if (strncmp(name, fc->prefix, fc->prefix_len) != 0) return 0;
+    if (name[0] == '.' && fc->prefix[0] != '.') return 0;
+
+    if (d_type == DT_UNKNOWN || d_type == DT_LNK) {
+        char full[PATH_MAX];
+        struct stat st;
+        snprintf(full, sizeof(full), "%s/%s", fc->dir, name);
+        d_type = (stat(full, &st) == 0 && S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+    }
+
+    fc->names[fc->found] = strdup(name);
+    fc->is_dir[fc->found] = d_type == DT_DIR;
+    fc->found++;
+    return fc->found >= fc->max;
+}
+
+// Build the prompt string shown before each command
+void format_prompt(char *out, size_t size) {
+    snprintf(out, size, "#cmd:%d|#dangerous_cmd_blocked:%d|last_cmd_time:%.5f|avg_time:%.5f|min_time:%.5f|max_time:%.5f>>",
+             total_cmd_count,
+             dangerous_cmd_blocked_count,
+             last_cmd_time,
+             average_time,
+             min_time,
+             max_time);
+}
+
+// Redraw the prompt and the line being edited, leaving the cursor at pos
+static void line_refresh(const char *buffer, size_t len, size_t pos) {
+    char prompt_text[256];
+    char seq[32];
+
+    format_prompt(prompt_text, sizeof(prompt_text));
+    write(STDOUT_FILENO, "\r", 1);
+    write(STDOUT_FILENO, prompt_text, strlen(prompt_text));
+    write(STDOUT_FILENO, buffer, len);
+    write(STDOUT_FILENO, "\x1b[K", 3);
+    if (len > pos) {
+        int n = snprintf(seq, sizeof(seq), "\x1b[%zuD", len - pos);
+        write(STDOUT_FILENO, seq, n);
+    }
+}
+
+// Complete the word before the cursor: commands for the first word, file names otherwise
+static void line_complete(char *buffer, size_t *len, size_t *pos, size_t buffer_size) {
+    size_t start = *pos;
+    while (start > 0 && buffer[start - 1] != ' ') start--;
+
+    char word[MAX_INPUT_LENGTHH];
+    size_t word_len = *pos - start;
+    memcpy(word, buffer + start, word_len);
+    word[word_len] = '\0';
+
+    int is_command = 1;
+    for (size_t i = 0; i < start; i++) {
+        if (buffer[i] != ' ') {
+            is_command = 0;
+            break;
+        }
+    }
+    // The first word after a pipe is a command as well
+    for (size_t i = start; i > 0; i--) {
+        if (buffer[i - 1] == '|') {
+            is_command = 1;
+            break;
+        }
+        if (buffer[i - 1] != ' ') break;
+    }
+    if (strchr(word, '/')) is_command = 0;
+
+    char *matches[COMPLETION_MAX_LIST + 1];
+    unsigned char is_dir[COMPLETION_MAX_LIST + 1];
+    int found = 0;
+    const char *name_part = word;
+
+    if (is_command) {
+        command_trie_refresh();
+        int node = trie_find(&command_trie, word);
+        if (node != -1) {
+            char scratch[MAX_INPUT_LENGTHH];
+            memcpy(scratch, word, word_len);
+            trie_collect(&command_trie, node, scratch, (int)word_len, matches, &found, COMPLETION_MAX_LIST + 1);
+        }
+        memset(is_dir, 0, sizeof(is_dir));
+    } else {
+        char dir[MAX_INPUT_LENGTHH];
+        char *slash = strrchr(word, '/');
+        if (slash) {
+            size_t dir_len = slash - word;
+            memcpy(dir, word, dir_len);
+            dir[dir_len] = '\0';
+            if (dir_len == 0) strcpy(dir, "/");
+            name_part = slash + 1;
+        } else {
+            strcpy(dir, ".");
+        }
+
+        FileCompletion fc = {name_part, strlen(name_part), matches, is_dir, 0, COMPLETION_MAX_LIST + 1, dir};
+        scan_directory(dir, file_completion_add_entry, &fc);
+        found = fc.found;
+        // Sort names together with their directory flags
+        for (int i = 1; i < found; i++) {
+            for (int j = i; j > 0 && strcmp(matches[j - 1], matches[j]) > 0; j--) {
+                char *tmp = matches[j]; matches[j] = matches[j - 1]; matches[j - 1] = tmp;
+                unsigned char t = is_dir[j]; is_dir[j] = is_dir[j - 1]; is_dir[j - 1] = t;
+            }
+        }
+    }
+
+    if (found == 0) {
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+
+    // Longest common prefix of all candidates (only the part after the typed name)
+    size_t typed = strlen(name_part);
+    size_t common = strlen(matches[0]);
+    for (int i = 1; i < found; i++) {
+        size_t k = typed;
+        while (k < common && matches[i][k] == matches[0][k]) k++;
+        common = k;
+    }
+
+    char insert[MAX_INPUT_LENGTHH];
+    size_t insert_len = common > typed ? common - typed : 0;
+    memcpy(insert, matches[0] + typed, insert_len);
+    if (found == 1) {
+        insert[insert_len++] = is_dir[0] ? '/' : ' ';
+    }
+
+    if (insert_len > 0 && *len + insert_len < buffer_size && *len + insert_len <= MAX_INPUT_LENGTH) {
+        memmove(buffer + *pos + insert_len, buffer + *pos, *len - *pos);
+        memcpy(buffer + *pos, insert, insert_len);
+        *len += insert_len;
+        *pos += insert_len;
+    } else if (found > 1) {
+        // Nothing left to add: list the candidates below the line
+        write(STDOUT_FILENO, "\r\n", 2);
+        for (int i = 0; i < found && i < COMPLETION_MAX_LIST; i++) {
+            write(STDOUT_FILENO, matches[i], strlen(matches[i]));
+            write(STDOUT_FILENO, is_dir[i] ? "/  " : "  ", is_dir[i] ? 3 : 2);
+        }
+        if (found > COMPLETION_MAX_LIST) write(STDOUT_FILENO, "...", 3);
+        write(STDOUT_FILENO, "\r\n", 2);
+    }
+
+    for (int i = 0; i < found; i++) free(matches[i]);
+}
+
+// Read a line with editing, history navigation and tab completion (stdin is a terminal)
+void line_edit(char *buffer, size_t buffer_size) {
+    struct termios orig, raw;
+    if (tcgetattr(STDIN_FILENO, &orig) != 0) {
+        get_string(buffer, buffer_size);
+        return;
+    }
+
+    raw = orig;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+    size_t len = 0, pos = 0;
+    long hist_pos = history_count();
+    buffer[0] = '\0';
+
+    for (;;) {
+        char c;
+        event_loop_wait(STDIN_FILENO);
+        ssize_t r = read(STDIN_FILENO, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0 || (c == 4 && len == 0)) {     // End of input, or Ctrl-D on an empty line: finish like `done`
+            len = strlen(strcpy(buffer, "done"));
+            if (r > 0) write(STDOUT_FILENO, buffer, len);
+            break;
+        }
+
+        if (c == '\r' || c == '\n') {
+            break;
+        } else if (c == 3) {                      // Ctrl-C: drop the line
+            len = pos = 0;
+            write(STDOUT_FILENO, "^C\r\n", 4);
+        } else if (c == '\t') {
+            line_complete(buffer, &len, &pos, buffer_size);
+        } else if (c == 127 || c == 8) {          // Backspace
+            if (pos > 0) {
+                memmove(buffer + pos - 1, buffer + pos, len - pos);
+                pos--;
+                len--;
+            }
+        } else if (c == 1) {                      // Ctrl-A
+            pos = 0;
+        } else if (c == 5) {                      // Ctrl-E
+            pos = len;
+        } else if (c == 21) {                     // Ctrl-U
+            memmove(buffer, buffer + pos, len - pos);
+            len -= pos;
+            pos = 0;
+        } else if (c == 27) {                     // Escape sequences: arrows, Home/End, Delete
+            char seq[3];
+            if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) continue;
+            if (seq[0] != '[' && seq[0] != 'O') continue;
+
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') continue;
+                if (seq[1] == '3' && pos < len) {
+                    memmove(buffer + pos, buffer + pos + 1, len - pos - 1);
+                    len--;
+                } else if (seq[1] == '1' || seq[1] == '7') {
+                    pos = 0;
+                } else if (seq[1] == '4' || seq[1] == '8') {
+                    pos = len;
+                }
+            } else if (seq[1] == 'C') {
+                if (pos < len) pos++;
+            } else if (seq[1] == 'D') {
+                if (pos > 0) pos--;
+            } else if (seq[1] == 'H') {
+                pos = 0;
+            } else if (seq[1] == 'F') {
+                pos = len;
+            } else if (seq[1] == 'A' || seq[1] == 'B') {
+                long count = history_count();
+                long next = hist_pos + (seq[1] == 'A' ? -1 : 1);
+                // Skip entries that cannot be read (damaged record file)
+                while (next >= 0 && next < count && history_record(next) == NULL) {
+                    next += seq[1] == 'A' ? -1 : 1;
+                }
+                if (next < 0 || next > count) continue;
+                hist_pos = next;
+
+                const char *text = next < count ? history_text(history_record(next)) : "";
+                len = strlen(text);
+                if (len > buffer_size - 1) len = buffer_size - 1;
+                memcpy(buffer, text, len);
+                pos = len;
+            }
+        } else if ((unsigned char)c >= 32) {
+            if (len >= buffer_size - 1 || len >= MAX_INPUT_LENGTH) {
+                write(STDOUT_FILENO, "\a", 1);
+                continue;
+            }
+            memmove(buffer + pos + 1, buffer + pos, len - pos);
+            buffer[pos++] = c;
+            len++;
+        }
+
+        buffer[len] = '\0';
+        line_refresh(buffer, len, pos);
+    }
+
+    buffer[len] = '\0';
+    write(STDOUT_FILENO, "\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig);
+}
+
+// Read a command line: the line editor on a terminal, plain reads otherwise
+void read_input_line(char *buffer, size_t buffer_size) {
+    if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+        line_edit(buffer, buffer_size);
+    } else {
+        // Only block in poll() when stdio has nothing buffered, or buffered lines would stall
+        event_loop_wait(stdin_buffer_empty() ? STDIN_FILENO : -1);
+        get_string(buffer, buffer_size);
+    }
+}
+
+// Whether stdin's stdio buffer is drained, so the next getchar() reads the descriptor
+int stdin_buffer_empty(void) {
+#ifdef __GLIBC__
+    return stdin->_IO_read_ptr >= stdin->_IO_read_end;
+#else
+    return 0;   // Unknown: never block ahead of stdio
+#endif
+}
+
+// True if a word contains glob metacharacters
+int has_glob_chars(const char *str) {
+    return strpbrk(str, "*?[") != NULL;
+}
+
+// Closing ']' of the bracket expression opening at p, or NULL if it is unterminated
+// (the '[' is then a literal). A ']' right after the '[' or '[!' is a member
+static const char* glob_class_end(const char *p) {
+    const char *c = p + 1;
+    if (*c == '!' || *c == '^') c++;
+    if (*c == '\0') return NULL;
+    return strchr(c + 1, ']');
+}
+
+// Compile one path segment of a glob pattern into match operations
+void glob_compile(const char *pattern, GlobPattern *out) {
+    size_t len = strlen(pattern);
+    out->ops = safe_malloc((len + 1) * sizeof(GlobOp));
+    out->count = 0;
+    out->match_dot = pattern[0] == '.';
+
+    for (const char *p = pattern; *p; p++) {
+        GlobOp *op = &out->ops[out->count];
+        memset(op, 0, sizeof(*op));
+
+        if (*p == '*') {
+            // Consecutive stars behave as one
+            if (out->count > 0 && out->ops[out->count - 1].type == GLOB_STAR) continue;
+            op->type = GLOB_STAR;
+        } else if (*p == '?') {
+            op->type = GLOB_ANY;
+        } else if (*p == '[' && glob_class_end(p) != NULL) {
+            const char *c = p + 1;
+            int negate = (*c == '!' || *c == '^');
+            if (negate) c++;
+
+            op->type = GLOB_CLASS;
+            // A ']' right after the opening bracket is a literal member
+            int first = 1;
+            for (; *c && (*c != ']' || first); c++, first = 0) {
+                unsigned char lo = (unsigned char)*c, hi = lo;
+                if (c[1] == '-' && c[2] && c[2] != ']') {
+                    hi = (unsigned char)c[2];
+                    c += 2;
+                }
+                for (unsigned int ch = lo; ch <= hi; ch++) {
+                    op->set[ch >> 3] |= (unsigned char)(1u << (ch & 7));
+                }
+            }
+            if (negate) {
+                for (int i = 0; i < 32; i++) op->set[i] = (unsigned char)~op->set[i];
+            }
+            p = c;
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            op->type = GLOB_LITERAL;
+            op->ch = (unsigned char)*p;
+        }
+        out->count++;
+    }
+}
+
+// Match a name against a compiled segment (single pass with star backtracking)
+int glob_match(const GlobPattern *pattern, const char *name) {
+    if (name[0] == '.' && !pattern->match_dot) return 0;
+
+    int op = 0, star_op = -1;
+    const char *s = name, *star_s = NULL;
+
+    while (*s) {
+        if (op < pattern->count) {
+            const GlobOp *cur = &pattern->ops[op];
+            unsigned char ch = (unsigned char)*s;
+
+            if (cur->type == GLOB_STAR) {
+                star_op = op++;
+                star_s = s;
+                continue;
+            }
+            if ((cur->type == GLOB_ANY) ||
+                (cur->type == GLOB_LITERAL && cur->ch == ch) ||
+                (cur->type == GLOB_CLASS && (cur->set[ch >> 3] & (1u << (ch & 7))))) {
+                op++;
+                s++;
+                continue;
+            }
+        }
+        if (star_op == -1) return 0;
+
+        // Let the last star absorb one more character and retry
+        op = star_op + 1;
+        s = ++star_s;
+    }
+
+    while (op < pattern->count && pattern->ops[op].type == GLOB_STAR) op++;
+    return op == pattern->count;
+}
+
+// Append a copy of str to a growable string list
+static void string_list_add(StringList *list, const char *str) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        char **grown = realloc(list->items, list->capacity * sizeof(char*));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            exit(1);
+        }
+        list->items = grown;
+    }
+
+    list->items[list->count] = strdup(str);
+    if (!list->items[list->count]) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(1);
+    }
+    list->count++;
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void glob_walk(GlobWalk *walk, size_t path_len, int segment, int verified);
+
+// Append name to the walk path; returns the new length or 0 if it doesn't fit
+static size_t glob_path_append(GlobWalk *walk, size_t path_len, const char *name) {
+    size_t name_len = strlen(name);
+    size_t sep = (path_len > 0 && walk->path[path_len - 1] != '/') ? 1 : 0;
+
+    if (path_len + sep + name_len + 1 > sizeof(walk->path)) return 0;
+    if (sep) walk->path[path_len] = '/';
+    memcpy(walk->path + path_len + sep, name, name_len + 1);
+    return path_len + sep + name_len;
+}
+
+// Whether the entry at walk->path is a directory (stat only when d_type does not say)
+static int glob_entry_is_dir(GlobWalk *walk, unsigned char d_type, int follow_links) {
+    if (d_type == DT_DIR) return 1;
+    if (d_type != DT_UNKNOWN && !(d_type == DT_LNK && follow_links)) return 0;
+
+    struct stat st;
+    int rc = follow_links ? stat(walk->path, &st) : lstat(walk->path, &st);
+    return rc == 0 && S_ISDIR(st.st_mode);
+}
+
+typedef struct {
+    GlobWalk *walk;
+    size_t path_len;
+    int segment;
+} GlobScan;
+
+static int glob_scan_entry(const char *name, unsigned char d_type, void *ctx) {
+    GlobScan *scan = (GlobScan*)ctx;
+    GlobWalk *walk = scan->walk;
+    const char *seg = walk->segments[scan->segment];
+
+    if (strcmp(seg, "**") == 0) {
+        // Descend into real (non-symlink, non-hidden) directories and try the same segment again
+        if (name[0] == '.') return 0;
+        size_t len = glob_path_append(walk, scan->path_len, name);
+        if (len && glob_entry_is_dir(walk, d_type, 0)) {
+            glob_walk(walk, len, scan->segment, 1);
+        }
+        return 0;
+    }
+
+    if (!glob_match(&walk->compiled[scan->segment], name)) return 0;
+
+    size_t len = glob_path_append(walk, scan->path_len, name);
+    if (!len) return 0;
+
+    // Only directories can lead to further segments
+    if (scan->segment + 1 < walk->segment_count && !glob_entry_is_dir(walk, d_type, 1)) return 0;
+
+    glob_walk(walk, len, scan->segment + 1, 1);
+    return 0;
+}
+
+// Match segments[segment..] below walk->path[0..path_len)
+static void glob_walk(GlobWalk *walk, size_t path_len, int segment, int verified) {
+    walk->path[path_len] = '\0';
+
+    if (segment == walk->segment_count) {
+        struct stat st;
+        if (path_len > 0 && (verified || lstat(walk->path, &st) == 0)) {
+            string_list_add(&walk->results, walk->path);
+        }
+        return;
+    }
+
+    const char *seg = walk->segments[segment];
+
+    if (strcmp(seg, "**") == 0) {
+        // ** matches zero directories ...
+        glob_walk(walk, path_len, segment + 1, verified);
+        walk->path[path_len] = '\0';
+    } else if (!walk->is_glob[segment]) {
+        size_t len = glob_path_append(walk, path_len, seg);
+        if (len || seg[0] == '\0') glob_walk(walk, len ? len : path_len, segment + 1, 0);
+        return;
+    }
+
+    // ... or one level more; glob segments scan the directory once
+    char dir[PATH_MAX];
+    strcpy(dir, path_len ? walk->path : ".");
+    GlobScan scan = {walk, path_len, segment};
+    scan_directory(dir, glob_scan_entry, &scan);
+}
+
+// Expand one glob word into sorted matches; returns 0 (and adds nothing) if nothing matched
+int glob_expand_word(const char *word, StringList *out) {
+    GlobWalk *walk = safe_malloc(sizeof(GlobWalk));
+    memset(walk, 0, sizeof(*walk));
+
+    char *copy = strdup(word);
+    if (!copy) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(1);
+    }
+
+    // Split into path segments; an absolute pattern starts from "/"
+    size_t path_len = 0;
+    if (copy[0] == '/') {
+        strcpy(walk->path, "/");
+        path_len = 1;
+    }
+
+    int capacity = 8;
+    walk->segments = safe_malloc(capacity * sizeof(char*));
+    char *cursor = copy + (copy[0] == '/');
+    for (;;) {
+        if (walk->segment_count == capacity) {
+            capacity *= 2;
+            char **grown = realloc(walk->segments, capacity * sizeof(char*));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed!\n");
+                exit(1);
+            }
+            walk->segments = grown;
+        }
+        walk->segments[walk->segment_count++] = cursor;
+        char *slash = strchr(cursor, '/');
+        if (!slash) break;
+        *slash = '\0';
+        cursor = slash + 1;
+    }
+
+    walk->compiled = safe_malloc(walk->segment_count * sizeof(GlobPattern));
+    walk->is_glob = safe_malloc(walk->segment_count);
+    for (int i = 0; i < walk->segment_count; i++) {
+        walk->is_glob[i] = has_glob_chars(walk->segments[i]);
+        walk->compiled[i].ops = NULL;
+        walk->compiled[i].count = 0;
+        if (walk->is_glob[i]) glob_compile(walk->segments[i], &walk->compiled[i]);
+    }
+
+    glob_walk(walk, path_len, 0, 1);
+
+    int found = walk->results.count;
+    if (found > 0) {
+        qsort(walk->results.items, found, sizeof(char*), compare_strings);
+        for (int i = 0; i < found; i++) {
+            string_list_add(out, walk->results.items[i]);
+            free(walk->results.items[i]);
+        }
+    }
+
+    for (int i = 0; i < walk->segment_count; i++) free(walk->compiled[i].ops);
+    free(walk->compiled);
+    free(walk->is_glob);
+    free(walk->segments);
+    free(walk->results.items);
+    free(walk);
+    free(copy);
+    return found;
+}
+
+// Whether any argument contains glob characters
+int args_have_globs(char **args) {
+    if (!args) return 0;
+
+    for (int i = 0; args[i]; i++) {
+        if (has_glob_chars(args[i])) return 1;
+    }
+    return 0;
+}
+
+// Replace glob words in an argument array with their matches (unmatched words stay literal).
+// Expanded arrays may exceed MAX_ARGC; the limit applies to what the user typed.
+char **expand_globs(char **args, int *args_len) {
+    if (!args) return NULL;
+    if (!args_have_globs(args)) return args;
+
+    StringList expanded = {NULL, 0, 0};
+    for (int i = 0; args[i]; i++) {
+        if (!has_glob_chars(args[i]) || glob_expand_word(args[i], &expanded) == 0) {
+            string_list_add(&expanded, args[i]);
+        }
+    }
+
+    // NULL-terminate in place of argv
+    string_list_add(&expanded, "");
+    free(expanded.items[expanded.count - 1]);
+    expanded.items[expanded.count - 1] = NULL;
+
+    free_args(args);
+    *args_len = expanded.count - 1;
+    return expanded.items;
+}
+
+// Calculate time difference between two timespec structs
+float time_diff(struct timespec start, struct timespec end) {
+    long sec_diff = end.tv_sec - start.tv_sec;
+    long nsec_diff = end.tv_nsec - start.tv_nsec;
+
+    if (nsec_diff < 0) {
+        nsec_diff += 1000000000;
+        sec_diff -= 1;
+    }
+
+    float total_time = (float)((double)sec_diff + (double)nsec_diff / 1000000000.0);
+    return total_time;
+}
+
+// Parse a fsync policy: "never", "flush" or a number of seconds; -2 if invalid
+static int log_parse_fsync(const char *text) {
+    if (strcmp(text, "never") == 0) return -1;
+    if (strcmp(text, "flush") == 0) return 0;
+
+    char *end = NULL;
+    long seconds = strtol(text, &end, 10);
+    if (*end != '\0' || end == text || seconds <= 0 || seconds > INT_MAX) return -2;
+    return (int)seconds;
+}
+
+// Configure the logs. The writer thread is started by log_writer_ensure() once a record
+// is queued, so a session that logs nothing never starts it
+int log_start(const char *command_log) {
+    log_paths[LOG_TARGET_COMMANDS] = command_log;
+    log_paths[LOG_TARGET_MATRIX] = "matrix_operations.log";
+
+    const char *policy = getenv("MINISHELL_LOG_FSYNC");
+    if (policy && policy[0]) {
+        int seconds = log_parse_fsync(policy);
+        if (seconds == -2) fprintf(stderr, "ERR: MINISHELL_LOG_FSYNC must be never, flush or seconds\n");
+        else log_fsync_seconds = seconds;
+    }
+
+    const char *format = getenv("MINISHELL_LOG_FORMAT");
+    if (format && strcmp(format, "binary") == 0) log_format = LOG_FORMAT_BINARY;
+    else if (format && format[0] && strcmp(format, "text") != 0) {
+        fprintf(stderr, "ERR: MINISHELL_LOG_FORMAT must be text or binary\n");
+    }
+
+    const char *value;
+    if ((value = getenv("MINISHELL_LOG_MAX_BYTES")) && value[0]) log_rotate_bytes = atoll(value);
+    if ((value = getenv("MINISHELL_LOG_ROTATE_SECONDS")) && value[0]) log_rotate_seconds = atoi(value);
+    if ((value = getenv("MINISHELL_LOG_KEEP")) && value[0]) log_keep = atoi(value);
+    if (log_rotate_bytes < 0) log_rotate_bytes = 0;
+    if (log_rotate_seconds < 0) log_rotate_seconds = 0;
+    if (log_keep < 1) log_keep = 1;
+
+    log_enabled = 1;
+    return 0;
+}
+
+// A ring slot's seq for write position pos (stored relative to the slot's index)
+static uint64_t log_slot_seq(uint64_t pos) {
+    uint64_t slot = pos & (LOG_RING_SLOTS - 1);
+    return __atomic_load_n(&log_ring[slot].seq, __ATOMIC_ACQUIRE) + slot;
+}
+
+static void log_slot_set_seq(uint64_t pos, uint64_t seq) {
+    uint64_t slot = pos & (LOG_RING_SLOTS - 1);
+    __atomic_store_n(&log_ring[slot].seq, seq - slot, __ATOMIC_RELEASE);
+}
+
+// Start the writer thread if records are queued and it is not running (main thread
+// only: producers in signal handlers just fill the ring). The writer owns the files
+void log_writer_ensure(void) {
+    if (!log_enabled || log_wake_fd >= 0 || __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        perror("eventfd");
+        log_enabled = 0;
+        return;
+    }
+
+    log_wake_fd = fd;
+
+    // Keep signals (SIGCHLD in particular) on the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&log_writer, NULL, log_writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        fprintf(stderr, "ERR: log writer: %s\n", strerror(err));
+        log_wake_fd = -1;
+        log_enabled = 0;
+        close(fd);
+        return;
+    }
+    startup_first_use("log writer", begin);
+}
+
+// Claim a ring slot for a record to the given log; NULL (counted as dropped) when the
+// ring is full. Safe in signal handlers: a producer never waits for another one
+LogRecord* log_reserve(int target) {
+    if (!log_enabled) {
+        return NULL;
+    }
+
+    uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    LogRecord *rec;
+    for (;;) {
+        rec = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        int64_t diff = (int64_t)(log_slot_seq(pos) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->pos = pos;
+    rec->target = target;
+    rec->truncated = 0;
+    rec->length = 0;
+    return rec;
+}
+
+// Format more text onto a claimed record
+void log_appendf(LogRecord *rec, const char *fmt, ...) {
+    size_t room = LOG_RECORD_MAX - rec->length;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text + rec->length, room, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) return;
+    if ((size_t)n >= room) {
+        rec->length = LOG_RECORD_MAX - 1;
+        rec->truncated = 1;
+    } else {
+        rec->length += (uint32_t)n;
+    }
+}
+
+// Hand a record to the writer, waking it once enough records are queued
+void log_commit(LogRecord *rec) {
+    if (rec->truncated) {
+        rec->text[rec->length - 1] = '\n';
+        __atomic_add_fetch(&log_truncated, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t pos = rec->pos;
+    log_slot_set_seq(pos, pos + 1);
+
+    // Before the writer is started the main loop picks the records up (log_writer_ensure)
+    if (log_wake_fd >= 0 && pos + 1 - __atomic_load_n(&log_head, __ATOMIC_ACQUIRE) == LOG_FLUSH_RECORDS) {
+        uint64_t one = 1;
+        ssize_t n = write(log_wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+// Queue a command and its execution time for the command log
+void log_command_time(const char *command, float seconds) {
+    LogRecord *log = log_reserve(LOG_TARGET_COMMANDS);
+    if (!log) return;
+
+    log_appendf(log, "%s : %.5f sec\n", command, seconds);
+    log_commit(log);
+}
+
+// Nanoseconds on a clock
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Queue a structured record for the binary command log. Only uses memcpy and
+// clock_gettime, so the SIGCHLD handler may call it
+void log_command_record(const char *command, int64_t duration_ns, int flags, pid_t pid, int status,
+                        pid_t pid2, int status2, const struct rusage *usage, const PerfCounts *perf) {
+    LogRecord *log = log_reserve(LOG_TARGET_COMMANDS);
+    if (!log) return;
+
+    if (perf && perf->kind != 0) flags |= EXECLOG_F_PERF;
+    uint32_t len = (uint32_t)strlen(command);
+    while (execlog_record_units(len, flags) * EXECLOG_UNIT > LOG_RECORD_MAX) {
+        len = LOG_RECORD_MAX / 2;
+        flags |= EXECLOG_F_TRUNCATED;
+    }
+
+    ExecLogRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = EXECLOG_RECORD_MAGIC;
+    rec.units = (uint16_t)execlog_record_units(len, flags);
+    rec.command_len = len;
+    rec.status = status;
+    rec.status2 = status2;
+    rec.pid = pid;
+    rec.pid2 = pid2;
+    rec.mono_ns = clock_ns(CLOCK_MONOTONIC);
+    rec.wall_ns = clock_ns(CLOCK_REALTIME);
+    rec.duration_ns = duration_ns;
+    if (usage) {
+        flags |= EXECLOG_F_RUSAGE;
+        rec.utime_us = (int64_t)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+        rec.stime_us = (int64_t)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+        rec.maxrss_kb = usage->ru_maxrss;
+        rec.minflt = (uint32_t)usage->ru_minflt;
+        rec.majflt = (uint32_t)usage->ru_majflt;
+        rec.nvcsw = (uint32_t)usage->ru_nvcsw;
+        rec.nivcsw = (uint32_t)usage->ru_nivcsw;
+    }
+    rec.flags = (uint16_t)flags;
+
+    // The slot text is not 8-byte aligned; assemble units on the stack and copy them in
+    uint32_t used = len < sizeof(rec.command) ? len : (uint32_t)sizeof(rec.command);
+    memcpy(rec.command, command, used);
+    memcpy(log->text, &rec, sizeof(rec));
+    log->length = sizeof(rec);
+
+    while (used < len) {
+        ExecLogCont cont;
+        memset(&cont, 0, sizeof(cont));
+        cont.magic = EXECLOG_CONT_MAGIC;
+        uint32_t n = len - used < sizeof(cont.command) ? len - used : (uint32_t)sizeof(cont.command);
+        memcpy(cont.command, command + used, n);
+        memcpy(log->text + log->length, &cont, sizeof(cont));
+        log->length += sizeof(cont);
+        used += n;
+    }
+    if (flags & EXECLOG_F_PERF) {
+        ExecLogPerf counters;
+        memset(&counters, 0, sizeof(counters));
+        counters.magic = EXECLOG_PERF_MAGIC;
+        counters.kind = (uint32_t)perf->kind;
+        memcpy(counters.values, perf->values, sizeof(counters.values));
+        memcpy(log->text + log->length, &counters, sizeof(counters));
+        log->length += sizeof(counters);
+    }
+    log_commit(log);
+}
+
+// Remember a background command so its record can be written when it is reaped
+// (call with SIGCHLD blocked)
+void background_job_add(pid_t pid, const struct timespec *started, const char *name, const char *command,
+                        const PerfGroup *perf) {
+    for (int i = 0; i < MAX_BACKGROUND_JOBS; i++) {
+        if (background_jobs[i].pid == 0) {
+            background_jobs[i].start = *started;
+            background_jobs[i].perf = *perf;
+            snprintf(background_jobs[i].name, sizeof(background_jobs[i].name), "%s", name);
+            snprintf(background_jobs[i].command, sizeof(background_jobs[i].command), "%s", command);
+            background_jobs[i].pid = pid;
+            return;
+        }
+    }
+
+    // Untracked, so nobody would read its counters
+    PerfGroup untracked = *perf;
+    perf_group_close(&untracked);
+}
+
+// Log and count a reaped background command (SIGCHLD handler)
+void background_job_finished(pid_t pid, int status, const struct rusage *usage) {
+    for (int i = 0; i < MAX_BACKGROUND_JOBS; i++) {
+        BackgroundJob *job = &background_jobs[i];
+        if (job->pid != pid) continue;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t duration = (int64_t)(now.tv_sec - job->start.tv_sec) * 1000000000LL +
+                           (now.tv_nsec - job->start.tv_nsec);
+        PROBE3(reaped, pid, status, duration);
+        PerfCounts counts;
+        perf_group_read(&job->perf, &counts);
+        command_stats_record(job->name, duration, status, &counts);
+        if (tracing) {
+            trace_signal_span("process", "process", clock_ns(CLOCK_MONOTONIC) - duration, pid, job->name);
+        }
+        if (log_format == LOG_FORMAT_BINARY) {
+            log_command_record(job->command, duration, EXECLOG_F_BACKGROUND, pid, status, 0, 0, usage, &counts);
+        }
+        job->pid = 0;
+        return;
+    }
+}
+
+// Move <log> to <log>.1, <log>.1 to <log>.2 and so on, dropping the oldest
+static int log_rotate_files(const char *path) {
+    char from[PATH_MAX + 16], to[PATH_MAX + 16];
+
+    for (int i = log_keep - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", path, i);
+        snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+        if (rename(from, to) != 0 && errno != ENOENT) return -1;
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    if (rename(path, to) != 0 && errno != ENOENT) return -1;
+
+    __atomic_add_fetch(&log_rotations, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Open the binary command log for appending. Records of earlier sessions are kept
+// (a torn unit at the end is cut off); a file that is not a binary log is rotated away
+static int log_open_binary(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror("Error opening log file");
+        return -1;
+    }
+
+    struct stat st;
+    ExecLogFileHeader header;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+            memcmp(header.magic, EXECLOG_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+            header.version == EXECLOG_VERSION && header.unit_size == EXECLOG_UNIT) {
+            off_t whole = st.st_size / EXECLOG_UNIT * EXECLOG_UNIT;
+            if (whole != st.st_size && ftruncate(fd, whole) != 0) {
+                perror("Error repairing log file");
+            }
+            log_file_size = whole;
+            log_file_created_ns = header.created_ns;
+            return fd;
+        }
+
+        close(fd);
+        if (log_rotate_files(path) != 0) {
+            perror("Error rotating log file");
+            return -1;
+        }
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            perror("Error opening log file");
+            return -1;
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXECLOG_FILE_MAGIC, sizeof(header.magic));
+    header.version = EXECLOG_VERSION;
+    header.unit_size = EXECLOG_UNIT;
+    header.created_ns = clock_ns(CLOCK_REALTIME);
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        perror("Error writing log file");
+        close(fd);
+        return -1;
+    }
+    log_file_size = sizeof(header);
+    log_file_created_ns = header.created_ns;
+    return fd;
+}
+
+// Whether the open binary command log should give way to a new file before
+// incoming more bytes are written to it
+static int log_needs_rotation(size_t incoming) {
+    if (log_file_size <= (long long)sizeof(ExecLogFileHeader)) {
+        return 0;   // Never rotate a file with no records
+    }
+    if (log_rotate_bytes > 0 && log_file_size + (long long)incoming > log_rotate_bytes) {
+        return 1;
+    }
+    return log_rotate_seconds > 0 &&
+           clock_ns(CLOCK_REALTIME) - log_file_created_ns >= (int64_t)log_rotate_seconds * 1000000000LL;
+}
+
+// File descriptor of a log. The text command log is truncated by the session's first
+// record; the binary one is appended to and rotated once it is too big or too old
+static int log_target_fd(int target, size_t incoming) {
+    if (target == LOG_TARGET_COMMANDS && log_format == LOG_FORMAT_BINARY) {
+        if (log_fds[target] < 0) {
+            log_fds[target] = log_open_binary(log_paths[target]);
+        }
+        if (log_fds[target] >= 0 && log_needs_rotation(incoming)) {
+            close(log_fds[target]);
+            if (log_rotate_files(log_paths[target]) != 0) perror("Error rotating log file");
+            log_fds[target] = log_open_binary(log_paths[target]);
+        }
+        return log_fds[target];
+    }
+
+    if (log_fds[target] < 0) {
+        int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        if (target == LOG_TARGET_COMMANDS) flags |= O_TRUNC;
+        log_fds[target] = open(log_paths[target], flags, 0666);
+        if (log_fds[target] < 0) perror("Error opening log file");
+    }
+    return log_fds[target];
+}
+
+// writev everything, continuing after short writes
+static int log_writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Write ring records [head, head + count): each run of records for the same file
+// goes out in one writev, straight from the ring slots, split where the binary
+// log has to rotate
+static void log_flush_batch(uint64_t head, int count) {
+    static struct timespec last_sync;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    struct iovec iov[LOG_BATCH_MAX];
+    int synced[LOG_TARGETS] = {0, 0};
+    int fsync_seconds = __atomic_load_n(&log_fsync_seconds, __ATOMIC_RELAXED);
+    long bytes = 0;
+
+    for (int i = 0; i < count; ) {
+        int target = log_ring[(head + i) & (LOG_RING_SLOTS - 1)].target;
+        int n = 0;
+        size_t run_bytes = 0;
+        while (i + n < count) {
+            LogRecord *rec = &log_ring[(head + i + n) & (LOG_RING_SLOTS - 1)];
+            if (rec->target != target) break;
+            // A run must not carry the binary log past its size limit; cut it
+            // there so the next run goes to a fresh file
+            if (n > 0 && target == LOG_TARGET_COMMANDS && log_format == LOG_FORMAT_BINARY &&
+                log_rotate_bytes > 0 && log_file_size + (long long)(run_bytes + rec->length) > log_rotate_bytes) {
+                break;
+            }
+            iov[n].iov_base = rec->text;
+            iov[n].iov_len = rec->length;
+            run_bytes += rec->length;
+            n++;
+        }
+
+        int fd = log_target_fd(target, run_bytes);
+        if (fd < 0 || log_writev_all(fd, iov, n) != 0) {
+            __atomic_add_fetch(&log_write_errors, n, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&log_records, n, __ATOMIC_RELAXED);
+            bytes += (long)run_bytes;
+            if (target == LOG_TARGET_COMMANDS) log_file_size += (long long)run_bytes;
+            if (fsync_seconds == 0 && !synced[target]) {
+                fdatasync(fd);
+                synced[target] = 1;
+            }
+        }
+        i += n;
+    }
+
+    if (fsync_seconds > 0 && time_diff(last_sync, t0) >= fsync_seconds) {
+        for (int target = 0; target < LOG_TARGETS; target++) {
+            if (log_fds[target] >= 0) fdatasync(log_fds[target]);
+        }
+        last_sync = t0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000ULL + (uint64_t)(t1.tv_nsec - t0.tv_nsec);
+    __atomic_add_fetch(&log_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&log_flushes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&log_flush_ns, ns, __ATOMIC_RELAXED);
+    if (ns > __atomic_load_n(&log_flush_max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&log_flush_max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+// Take committed records off the ring in order and write them in batches. Woken early
+// by log_commit() once LOG_FLUSH_RECORDS are queued, otherwise every LOG_FLUSH_INTERVAL_MS
+void* log_writer_thread(void *arg) {
+    (void)arg;
+    uint64_t head = 0;
+
+    for (;;) {
+        int count = 0;
+        while (count < LOG_BATCH_MAX && log_slot_seq(head + count) == head + count + 1) {
+            count++;
+        }
+
+        if (count > 0) {
+            log_flush_batch(head, count);
+            for (int i = 0; i < count; i++) {
+                log_slot_set_seq(head + i, head + i + LOG_RING_SLOTS);
+            }
+            head += (uint64_t)count;
+            __atomic_store_n(&log_head, head, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE)) break;
+
+        struct pollfd pfd = {log_wake_fd, POLLIN, 0};
+        if (poll(&pfd, 1, LOG_FLUSH_INTERVAL_MS) > 0) {
+            uint64_t value;
+            ssize_t n = read(log_wake_fd, &value, sizeof(value));
+            (void)n;
+        }
+    }
+    return NULL;
+}
+
+// Drain the ring, stop the writer and close the logs. A session that logged nothing
+// still leaves an empty command log behind
+void log_shutdown(void) {
+    log_writer_ensure();
+    if (log_wake_fd >= 0) {
+        __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        ssize_t n = write(log_wake_fd, &one, sizeof(one));
+        (void)n;
+        pthread_join(log_writer, NULL);
+        close(log_wake_fd);
+        log_wake_fd = -1;
+    }
+
+    if (log_fds[LOG_TARGET_COMMANDS] < 0 && log_paths[LOG_TARGET_COMMANDS]) {
+        log_target_fd(LOG_TARGET_COMMANDS, 0);
+    }
+    for (int target = 0; target < LOG_TARGETS; target++) {
+        if (log_fds[target] >= 0) {
+            if (log_fsync_seconds >= 0) fdatasync(log_fds[target]);
+            close(log_fds[target]);
+            log_fds[target] = -1;
+        }
+    }
+}
+
+// log [fsync never|flush|N]: show the writer's counters, or set when it syncs to disk
+int log_builtin(char **args, int args_len) {
+    if (args_len > 1 && strcmp(args[1], "fsync") == 0) {
+        int seconds = args_len == 3 ? log_parse_fsync(args[2]) : -2;
+        if (seconds == -2) {
+            fprintf(stderr, "ERR: Usage: log fsync never|flush|<seconds>\n");
+            return 1;
+        }
+        __atomic_store_n(&log_fsync_seconds, seconds, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (args_len > 1) {
+        fprintf(stderr, "ERR: Usage: log [fsync never|flush|<seconds>]\n");
+        return 1;
+    }
+
+    long flushes = __atomic_load_n(&log_flushes, __ATOMIC_RELAXED);
+    uint64_t flush_ns = __atomic_load_n(&log_flush_ns, __ATOMIC_RELAXED);
+    uint64_t queued = __atomic_load_n(&log_tail, __ATOMIC_RELAXED) - __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+
+    printf("records: %ld (%ld bytes), queued: %llu/%d\n",
+           __atomic_load_n(&log_records, __ATOMIC_RELAXED), __atomic_load_n(&log_bytes, __ATOMIC_RELAXED),
+           (unsigned long long)queued, LOG_RING_SLOTS);
+    printf("dropped: %ld, truncated: %ld, write errors: %ld\n",
+           __atomic_load_n(&log_dropped, __ATOMIC_RELAXED), __atomic_load_n(&log_truncated, __ATOMIC_RELAXED),
+           __atomic_load_n(&log_write_errors, __ATOMIC_RELAXED));
+    printf("flushes: %ld, avg %.1f us, max %.1f us\n", flushes,
+           flushes ? flush_ns / 1000.0 / flushes : 0.0,
+           __atomic_load_n(&log_flush_max_ns, __ATOMIC_RELAXED) / 1000.0);
+    if (log_fsync_seconds < 0) printf("fsync: never\n");
+    else if (log_fsync_seconds == 0) printf("fsync: every flush\n");
+    else printf("fsync: every %d s\n", log_fsync_seconds);
+    if (log_format == LOG_FORMAT_BINARY) {
+        printf("format: binary, rotate at %lld bytes / %d s (0 = never), keep %d, rotations: %ld\n",
+               log_rotate_bytes, log_rotate_seconds, log_keep, __atomic_load_n(&log_rotations, __ATOMIC_RELAXED));
+    } else {
+        printf("format: text\n");
+    }
+    return 0;
+}
+
+// Events of each counter kind, in ExecLogPerf order
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[2][PERF_COUNTERS] = {
+    [EXECLOG_PERF_HARDWARE - 1] = {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                                   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                                   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                                   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}},
+    [EXECLOG_PERF_SOFTWARE - 1] = {{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+                                   {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+                                   {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+                                   {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS}},
+};
+
+// Open a counter group of one kind on pid. The leader starts disabled and is enabled
+// by the child's exec, so the shell code the child runs first is not counted; inherit
+// carries the counters into the threads and processes the command creates
+static int perf_group_open(pid_t pid, int kind, int exclude_kernel, PerfGroup *group) {
+    group->kind = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++) group->fds[i] = -1;
+
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[kind - 1][i].type;
+        attr.config = perf_events[kind - 1][i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = i == 0;
+        attr.enable_on_exec = i == 0;
+        attr.inherit = 1;
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+
+        long fd = syscall(SYS_perf_event_open, &attr, pid, -1, group->fds[0], PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            perf_group_close(group);
+            return -1;
+        }
+        group->fds[i] = (int)fd;
+    }
+    group->kind = kind;
+    return 0;
+}
+
+// Pick the counters children get: hardware events if the CPU exposes them to us,
+// otherwise software ones (task clock, context switches, faults, migrations), each
+// with kernel time if permitted. MINISHELL_PERF=off turns counting off and
+// MINISHELL_PERF=software skips the hardware events. Runs once, on the first spawn
+void perf_init(void) {
+    if (perf_probed) return;
+    perf_probed = 1;
+
+    const char *env = getenv("MINISHELL_PERF");
+    if (env && strcmp(env, "off") == 0) return;
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    int first = env && strcmp(env, "software") == 0 ? EXECLOG_PERF_SOFTWARE : EXECLOG_PERF_HARDWARE;
+    for (int kind = first; kind <= EXECLOG_PERF_SOFTWARE; kind++) {
+        for (int exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++) {
+            PerfGroup probe;
+            if (perf_group_open(0, kind, exclude_kernel, &probe) == 0) {
+                perf_group_close(&probe);
+                perf_kind = kind;
+                perf_exclude_kernel = exclude_kernel;
+                startup_first_use("perf counters", begin);
+                return;
+            }
+        }
+    }
+    startup_first_use("perf counters (none)", begin);
+}
+
+// Pipe that holds a new child before its exec until its counters are attached;
+// returns -1 (and no pipe) when counting is off
+int perf_sync_open(int sync[2]) {
+    sync[0] = sync[1] = -1;
+    perf_init();
+    if (perf_kind == 0) return -1;
+    if (pipe(sync) != 0) {
+        sync[0] = sync[1] = -1;
+        return -1;
+    }
+    fcntl(sync[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sync[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+// Child side: wait until the parent closes its end of the sync pipe
+void perf_sync_wait(int sync[2]) {
+    if (sync[0] < 0) return;
+
+    char byte;
+    close(sync[1]);
+    while (read(sync[0], &byte, 1) < 0 && errno == EINTR) {}
+    close(sync[0]);
+}
+
+// Parent side: attach a counter group to the child and let it continue. A child
+// that cannot be counted (out of descriptors, say) just runs without counters
+void perf_attach(pid_t pid, int sync[2], PerfGroup *group) {
+    group->kind = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++) group->fds[i] = -1;
+    if (sync[0] < 0) return;
+
+    if (pid > 0) perf_group_open(pid, perf_kind, perf_exclude_kernel, group);
+    close(sync[0]);
+    close(sync[1]);
+    sync[0] = sync[1] = -1;
+}
+
+// Read a reaped child's counters and close the group. Only read and close, so the
+// SIGCHLD handler may call it
+void perf_group_read(PerfGroup *group, PerfCounts *out) {
+    memset(out, 0, sizeof(*out));
+    if (group->kind == 0) return;
+
+    out->kind = group->kind;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        uint64_t value[3];          // Count, time enabled, time running
+        if (read(group->fds[i], value, sizeof(value)) != (ssize_t)sizeof(value)) {
+            out->kind = 0;
+            break;
+        }
+        // Scale up a count that was multiplexed off the PMU part of the time
+        if (value[2] > 0 && value[2] < value[1]) {
+            value[0] = (uint64_t)((double)value[0] * value[1] / value[2]);
+        }
+        out->values[i] = value[0];
+    }
+    perf_group_close(group);
+}
+
+// Close a counter group without reading it
+void perf_group_close(PerfGroup *group) {
+    for (int i = PERF_COUNTERS - 1; i >= 0; i--) {
+        if (group->fds[i] >= 0) close(group->fds[i]);
+        group->fds[i] = -1;
+    }
+    group->kind = 0;
+}
+
+// Sketch bucket of a run time: exact below 2^SKETCH_SUB_BITS us, then
+// 2^SKETCH_SUB_BITS buckets per power of two
+static uint32_t sketch_bucket(uint64_t us) {
+    if (us >= (1ULL << 40)) us = (1ULL << 40) - 1;
+    if (us < (1u << SKETCH_SUB_BITS)) return (uint32_t)us;
+
+    int e = 63 - __builtin_clzll(us);
+    return (uint32_t)((e - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) +
+           (uint32_t)((us >> (e - SKETCH_SUB_BITS)) & ((1u << SKETCH_SUB_BITS) - 1));
+}
+
+// Middle of the run times a sketch bucket holds
+static uint64_t sketch_bucket_value(uint32_t bucket) {
+    if (bucket < (1u << SKETCH_SUB_BITS)) return bucket;
+
+    int e = (int)(bucket >> SKETCH_SUB_BITS) + SKETCH_SUB_BITS - 1;
+    uint64_t low = ((uint64_t)(1u << SKETCH_SUB_BITS) + (bucket & ((1u << SKETCH_SUB_BITS) - 1))) << (e - SKETCH_SUB_BITS);
+    return low + (1ULL << (e - SKETCH_SUB_BITS)) / 2;
+}
+
+// Run time (us) below which a fraction q of the command's runs finished, clamped
+// to the exact minimum and maximum
+uint64_t sketch_quantile(const CommandStats *stats, double q) {
+    if (stats->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(q * stats->count + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < SKETCH_BUCKETS; b++) {
+        seen += stats->sketch[b];
+        if (seen >= rank) {
+            uint64_t value = sketch_bucket_value(b);
+            if (value < stats->min_us) value = stats->min_us;
+            if (value > stats->max_us) value = stats->max_us;
+            return value;
+        }
+    }
+    return stats->max_us;
+}
+
+// Count one finished run of a command, with its performance counters if it had any.
+// Called by main with SIGCHLD blocked and by the SIGCHLD handler, so it neither
+// allocates nor locks
+void command_stats_record(const char *name, int64_t duration_ns, int status, const PerfCounts *perf) {
+    if (name == NULL || name[0] == '\0') return;
+
+    size_t len = strnlen(name, COMMAND_STATS_NAME - 1);
+    uint64_t hash = hash_bytes(name, len);
+    uint32_t slot = (uint32_t)hash & (COMMAND_STATS_SLOTS - 1);
+    CommandStats *stats = NULL;
+
+    while (command_stats[slot].name[0] != '\0') {
+        if (command_stats[slot].hash == hash && strncmp(command_stats[slot].name, name, len) == 0 &&
+            command_stats[slot].name[len] == '\0') {
+            stats = &command_stats[slot];
+            break;
+        }
+        slot = (slot + 1) & (COMMAND_STATS_SLOTS - 1);
+    }
+
+    if (stats == NULL) {
+        // Keep probe chains short: past 3/4 full, new names share one entry
+        if (command_stats_used >= COMMAND_STATS_SLOTS * 3 / 4) {
+            stats = &command_stats_other;
+            if (stats->name[0] == '\0') strcpy(stats->name, "(other)");
+        } else {
+            stats = &command_stats[slot];
+            memcpy(stats->name, name, len);
+            stats->name[len] = '\0';
+            stats->hash = hash;
+            command_stats_used++;
+        }
+    }
+    if (stats->count == 0) stats->min_us = UINT64_MAX;
+
+    uint64_t us = duration_ns > 0 ? (uint64_t)duration_ns / 1000 : 0;
+    stats->count++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) stats->failures++;
+    stats->total_us += us;
+    if (us < stats->min_us) stats->min_us = us;
+    if (us > stats->max_us) stats->max_us = us;
+    stats->sketch[sketch_bucket(us)]++;
+
+    if (perf && perf->kind != 0 && (stats->perf_kind == 0 || stats->perf_kind == perf->kind)) {
+        stats->perf_kind = perf->kind;
+        stats->perf_runs++;
+        for (int i = 0; i < PERF_COUNTERS; i++) stats->perf_totals[i] += perf->values[i];
+    }
+}
+
+// Copy every in-use entry (and "(other)", if used) into a new array; returns how many.
+// Copying holds the SIGCHLD handler off only for the copy
+int command_stats_snapshot(CommandStats **out) {
+    sigset_t chld_set, saved_mask;
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_set, &saved_mask);
+
+    int count = 0;
+    CommandStats *snapshot = safe_malloc((command_stats_used + 1) * sizeof(CommandStats));
+    for (int i = 0; i < COMMAND_STATS_SLOTS; i++) {
+        if (command_stats[i].name[0] != '\0') snapshot[count++] = command_stats[i];
+    }
+    if (command_stats_other.count > 0) snapshot[count++] = command_stats_other;
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+    *out = snapshot;
+    return count;
+}
+
+// Sort order for `stats` (0 total, 1 count, 2 p99), read by compare_command_stats()
+static int command_stats_sort = 0;
+
+// Largest first on the chosen column, then by name
+static int compare_command_stats(const void *a, const void *b) {
+    const CommandStatsRow *x = a, *y = b;
+    uint64_t vx, vy;
+
+    if (command_stats_sort == 1) {
+        vx = x->stats->count;
+        vy = y->stats->count;
+    } else if (command_stats_sort == 2) {
+        vx = x->p99;
+        vy = y->p99;
+    } else {
+        vx = x->stats->total_us;
+        vy = y->stats->total_us;
+    }
+    if (vx != vy) return vx > vy ? -1 : 1;
+    return strcmp(x->stats->name, y->stats->name);
+}
+
+// Print a duration given in microseconds with a unit that keeps it short
+static void print_micros(uint64_t us) {
+    if (us < 1000) printf(" %7lluus", (unsigned long long)us);
+    else if (us < 1000000) printf(" %7.2fms", us / 1e3);
+    else printf(" %8.2fs", us / 1e6);
+}
+
+// stats [--sort=p99|count|total] [--top N]: per-command counts, failures and run times
+int stats_builtin(char **args, int args_len) {
+    int sort = 0;
+    long top = 20;
+
+    for (int i = 1; i < args_len; i++) {
+        if (strncmp(args[i], "--sort=", 7) == 0) {
+            const char *key = args[i] + 7;
+            if (strcmp(key, "total") == 0) sort = 0;
+            else if (strcmp(key, "count") == 0) sort = 1;
+            else if (strcmp(key, "p99") == 0) sort = 2;
+            else sort = -1;
+        } else if (strcmp(args[i], "--top") == 0 && i + 1 < args_len) {
+            char *end = NULL;
+            top = strtol(args[++i], &end, 10);
+            if (*end != '\0' || top <= 0) sort = -1;
+        } else {
+            sort = -1;
+        }
+        if (sort < 0) {
+            fprintf(stderr, "ERR: Usage: stats [--sort=p99|count|total] [--top N]\n");
+            return 1;
+        }
     }
 
-    float total_time = (float)((double)sec_diff + (double)nsec_diff / 1000000000.0);
-    return total_time;
+    CommandStats *snapshot = NULL;
+    int count = command_stats_snapshot(&snapshot);
+
+    CommandStatsRow *rows = safe_malloc((count + 1) * sizeof(CommandStatsRow));
+    for (int i = 0; i < count; i++) {
+        rows[i].stats = &snapshot[i];
+        rows[i].p50 = sketch_quantile(&snapshot[i], 0.50);
+        rows[i].p90 = sketch_quantile(&snapshot[i], 0.90);
+        rows[i].p99 = sketch_quantile(&snapshot[i], 0.99);
+    }
+    command_stats_sort = sort;
+    qsort(rows, count, sizeof(CommandStatsRow), compare_command_stats);
+
+    printf("%-20s %8s %6s %10s %9s %9s %9s %9s %9s %9s",
+           "command", "count", "fail", "total", "avg", "min", "p50", "p90", "p99", "max");
+    // Counter columns: per-run averages over the runs that had counters
+    if (perf_kind == EXECLOG_PERF_HARDWARE) printf(" %6s %10s %10s", "ipc", "cmiss/run", "bmiss/run");
+    else if (perf_kind == EXECLOG_PERF_SOFTWARE) printf(" %9s %8s %8s", "cpu/run", "csw/run", "flt/run");
+    printf("\n");
+    for (int i = 0; i < count && i < top; i++) {
+        const CommandStats *stats = rows[i].stats;
+        printf("%-20.20s %8u %6u", stats->name, stats->count, stats->failures);
+        if (stats->total_us < 10000000) printf(" %8.2fms", stats->total_us / 1e3);
+        else printf(" %9.2fs", stats->total_us / 1e6);
+        print_micros(stats->total_us / stats->count);
+        print_micros(stats->min_us);
+        print_micros(rows[i].p50);
+        print_micros(rows[i].p90);
+        print_micros(rows[i].p99);
+        print_micros(stats->max_us);
+
+        const uint64_t *perf = stats->perf_totals;
+        uint32_t runs = stats->perf_runs;
+        if (perf_kind == EXECLOG_PERF_HARDWARE) {
+            if (runs > 0 && stats->perf_kind == perf_kind) {
+                printf(" %6.2f %10.0f %10.0f", perf[0] ? (double)perf[1] / perf[0] : 0.0,
+                       (double)perf[2] / runs, (double)perf[3] / runs);
+            } else {
+                printf(" %6s %10s %10s", "-", "-", "-");
+            }
+        } else if (perf_kind == EXECLOG_PERF_SOFTWARE) {
+            if (runs > 0 && stats->perf_kind == perf_kind) {
+                print_micros(perf[0] / 1000 / runs);
+                printf(" %8.1f %8.1f", (double)perf[1] / runs, (double)perf[2] / runs);
+            } else {
+                printf(" %9s %8s %8s", "-", "-", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    free(rows);
+    free(snapshot);
+    return 0;
 }
 
-// Append command and execution time to log file
-void append_to_log(const char *filename, char* val1, float val2) {
-    FILE *file = fopen(filename, "a");
-    if (!file) {
-        perror("Error opening log file");
+// Create this shell's counters segment, unless MINISHELL_SHM=off. A segment left
+// behind by an earlier process with the same pid is replaced
+void shm_stats_open(void) {
+    const char *env = getenv("MINISHELL_SHM");
+    if (env && strcmp(env, "off") == 0) return;
+
+    snprintf(shm_stats_name, sizeof(shm_stats_name), "/%s%d", SHMSTATS_PREFIX, (int)getpid());
+    int fd = shm_open(shm_stats_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        shm_unlink(shm_stats_name);
+        fd = shm_open(shm_stats_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        perror("shm_open");
+        return;
+    }
+
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(ShellStatsSegment)) == 0) {
+        map = mmap(NULL, sizeof(ShellStatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping shared counters");
+        shm_unlink(shm_stats_name);
         return;
     }
 
-    fprintf(file, "%s : %.5f sec\n", val1, val2);
-    fclose(file);
+    ShellStatsSegment *seg = map;
+    seg->version = SHMSTATS_VERSION;
+    seg->size = sizeof(ShellStatsSegment);
+    seg->pid = (int32_t)getpid();
+    seg->started_ns = clock_ns(CLOCK_REALTIME);
+    shm_stats = seg;
+    shm_stats_publish();
+
+    // Readers only trust a segment once the magic is there
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(seg->magic, SHMSTATS_MAGIC, sizeof(seg->magic));
+}
+
+// Copy the counters into the segment under its seqlock. Only memory writes (the
+// clock is read through the vDSO). Called by main and by the SIGCHLD handler; the
+// handler never writes over an update main is in the middle of, it leaves it to
+// main to publish again
+void shm_stats_publish(void) {
+    ShellStatsSegment *seg = shm_stats;
+    if (seg == NULL) return;
+
+    if (shm_stats_writing) {
+        shm_stats_dirty = 1;   // Only the handler can get here
+        return;
+    }
+
+    // The handler may have found the segment busy just before it was released
+    do {
+        shm_stats_writing = 1;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        shm_stats_dirty = 0;
+        ShellCounters c;
+        memset(&c, 0, sizeof(c));
+        c.updated_ns = clock_ns(CLOCK_REALTIME);
+        c.total_cmd_count = total_cmd_count;
+        c.dangerous_cmd_blocked_count = dangerous_cmd_blocked_count;
+        c.semi_dangerous_cmd_count = semi_dangerous_cmd_count;
+        c.command_running = command_running;
+        for (int i = 0; i < MAX_BACKGROUND_JOBS; i++) {
+            if (background_jobs[i].pid != 0) c.background_jobs++;
+        }
+        c.last_cmd_time = last_cmd_time;
+        c.average_time = average_time;
+        c.min_time = min_time;
+        c.max_time = max_time;
+        c.total_time = total_time_all;
+        c.matrix_operations = matrix_stats.operation_count;
+        c.matrix_errors = matrix_stats.error_count;
+        c.matrices_processed = matrix_stats.total_matrices_processed;
+        c.max_matrix_size = matrix_stats.max_matrix_size;
+        c.matrix_add_operations = matrix_stats.add_operations;
+        c.matrix_sub_operations = matrix_stats.sub_operations;
+
+        uint64_t seq = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(&seg->counters, &c, sizeof(c));
+        __atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        shm_stats_writing = 0;
+    } while (shm_stats_dirty);
+}
+
+// Remove this shell's counters segment
+void shm_stats_close(void) {
+    if (shm_stats == NULL) return;
+    ShellStatsSegment *seg = shm_stats;
+    shm_stats = NULL;
+    munmap(seg, sizeof(ShellStatsSegment));
+    shm_unlink(shm_stats_name);
+}
+
+// Start of a span: the time, or 0 when not tracing so the span is not recorded
+int64_t trace_now(void) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) return 0;
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+// Add an event to a buffer, growing it unless it is the handler's fixed one
+static void trace_append(TraceBuffer *buffer, const char *category, const char *name, int64_t begin_ns,
+                         int64_t end_ns, int32_t tid, int32_t arg, const char *detail, int can_grow) {
+    if (buffer->count == buffer->capacity) {
+        uint32_t capacity = buffer->capacity * 2;
+        TraceEvent *events = can_grow && capacity <= TRACE_MAX_EVENTS ?
+                             realloc(buffer->events, capacity * sizeof(TraceEvent)) : NULL;
+        if (events == NULL) {
+            __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+
+    TraceEvent *event = &buffer->events[buffer->count++];
+    event->category = category;
+    event->name = name;
+    event->begin_ns = begin_ns;
+    event->end_ns = end_ns;
+    event->tid = tid ? tid : buffer->tid;
+    event->arg = arg;
+    size_t length = detail ? strnlen(detail, sizeof(event->detail) - 1) : 0;
+    if (length) memcpy(event->detail, detail, length);
+    event->detail[length] = '\0';
+}
+
+// Name the calling thread's track (before its first event)
+void trace_thread_name(const char *name) {
+    trace_thread_label = name;
+}
+
+// Record a span of the calling thread that began at begin_ns and ends now. tid 0
+// puts it on the thread's own track. Does nothing if begin_ns is 0 or tracing stopped
+void trace_span(const char *category, const char *name, int64_t begin_ns, int32_t tid, int32_t arg,
+                const char *detail) {
+    if (begin_ns == 0 || !__atomic_load_n(&tracing, __ATOMIC_RELAXED)) return;
+    int64_t end_ns = clock_ns(CLOCK_MONOTONIC);
+
+    TraceBuffer *buffer = trace_thread_buffer;
+    if (buffer == NULL || trace_thread_generation != __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE)) {
+        buffer = malloc(sizeof(TraceBuffer));
+        if (buffer == NULL) return;
+        buffer->tid = (int32_t)syscall(SYS_gettid);
+        buffer->thread_name = trace_thread_label ? trace_thread_label : "thread";
+        buffer->count = 0;
+        buffer->capacity = TRACE_INITIAL_EVENTS;
+        buffer->events = malloc(buffer->capacity * sizeof(TraceEvent));
+        if (buffer->events == NULL) {
+            free(buffer);
+            return;
+        }
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        trace_thread_buffer = buffer;
+        trace_thread_generation = trace_generation;
+    }
+    trace_append(buffer, category, name, begin_ns, end_ns, tid, arg, detail, 1);
+}
+
+// trace_span() for the SIGCHLD handler: no allocation, into the preallocated buffer
+void trace_signal_span(const char *category, const char *name, int64_t begin_ns, int32_t tid,
+                       const char *detail) {
+    if (begin_ns == 0 || !tracing || trace_signal_buffer.events == NULL) return;
+    trace_append(&trace_signal_buffer, category, name, begin_ns, clock_ns(CLOCK_MONOTONIC), tid, 0, detail, 0);
+}
+
+// Start buffering events for <path>
+int trace_start(const char *path) {
+    if (tracing) {
+        fprintf(stderr, "ERR: Already tracing to %s\n", trace_path);
+        return -1;
+    }
+
+    // Fail now rather than after the trace has been collected
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    close(fd);
+
+    snprintf(trace_path, sizeof(trace_path), "%s", path);
+    memset(&trace_signal_buffer, 0, sizeof(trace_signal_buffer));
+    trace_signal_buffer.tid = (int32_t)getpid();
+    trace_signal_buffer.thread_name = "shell";
+    trace_signal_buffer.capacity = TRACE_SIGNAL_EVENTS;
+    trace_signal_buffer.events = safe_malloc(TRACE_SIGNAL_EVENTS * sizeof(TraceEvent));
+    trace_dropped = 0;
+    trace_started_ns = clock_ns(CLOCK_MONOTONIC);
+    trace_thread_name("shell");
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Write a JSON string literal
+static void trace_write_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// Write one buffer's events (and its track name) as trace-event JSON
+static void trace_write_buffer(FILE *out, const TraceBuffer *buffer, int pid, int *first) {
+    if (buffer->count == 0) return;
+
+    fprintf(out, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+            *first ? "" : ",", pid, buffer->tid);
+    trace_write_string(out, buffer->thread_name);
+    fprintf(out, "}}");
+    *first = 0;
+
+    for (uint32_t i = 0; i < buffer->count; i++) {
+        const TraceEvent *e = &buffer->events[i];
+        if (e->tid != buffer->tid && strcmp(e->category, "process") == 0) {
+            // A child's lifetime gets a track of its own, named after the command
+            char name[TRACE_DETAIL_MAX + 32];
+            snprintf(name, sizeof(name), "%s (pid %d)", e->detail, e->tid);
+            fprintf(out, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    pid, e->tid);
+            trace_write_string(out, name);
+            fprintf(out, "}}");
+        }
+        fprintf(out, ",\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":", e->category);
+        trace_write_string(out, e->name);
+        fprintf(out, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", pid, e->tid,
+                (e->begin_ns - trace_started_ns) / 1e3, (e->end_ns - e->begin_ns) / 1e3);
+        if (e->arg || e->detail[0]) {
+            fprintf(out, ",\"args\":{");
+            if (e->arg) fprintf(out, "\"value\":%d%s", e->arg, e->detail[0] ? "," : "");
+            if (e->detail[0]) {
+                fprintf(out, "\"detail\":");
+                trace_write_string(out, e->detail);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "}");
+    }
+}
+
+// Stop tracing and write every buffered event to the trace file as Chrome
+// trace-event JSON (Perfetto and chrome://tracing open it)
+int trace_stop(void) {
+    if (!tracing) {
+        fprintf(stderr, "ERR: Not tracing\n");
+        return -1;
+    }
+
+    // Traced threads other than main (mcalc workers) have been joined by now; the
+    // handler is held off while its buffer is read and freed
+    sigset_t chld_set, saved_mask;
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_set, &saved_mask);
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL) perror(trace_path);
+
+    long events = 0;
+    int pid = (int)getpid();
+    int first = 1;
+    if (out) {
+        fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        fprintf(out, "\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"minishell\"}}", pid);
+        first = 0;
+        trace_write_buffer(out, &trace_signal_buffer, pid, &first);
+    }
+    events += trace_signal_buffer.count;
+
+    TraceBuffer *buffer = __atomic_exchange_n(&trace_buffers, NULL, __ATOMIC_ACQUIRE);
+    while (buffer) {
+        TraceBuffer *next = buffer->next;
+        if (out) trace_write_buffer(out, buffer, pid, &first);
+        events += buffer->count;
+        free(buffer->events);
+        free(buffer);
+        buffer = next;
+    }
+    free(trace_signal_buffer.events);
+    trace_signal_buffer.events = NULL;
+    __atomic_add_fetch(&trace_generation, 1, __ATOMIC_RELEASE);
+    trace_thread_buffer = NULL;
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+    if (out == NULL) return -1;
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0) {
+        perror(trace_path);
+        return -1;
+    }
+    printf("trace: %ld events written to %s", events, trace_path);
+    if (trace_dropped > 0) printf(" (%ld dropped)", trace_dropped);
+    printf("\n");
+    return 0;
+}
+
+// trace on <file> | trace off | trace: record parse, danger check, spawn, process,
+// wait and mcalc spans into a Chrome trace-event file
+int trace_builtin(char **args, int args_len) {
+    if (args_len == 3 && strcmp(args[1], "on") == 0) {
+        return trace_start(args[2]) == 0 ? 0 : 1;
+    }
+    if (args_len == 2 && strcmp(args[1], "off") == 0) {
+        return trace_stop() == 0 ? 0 : 1;
+    }
+    if (args_len == 1) {
+        if (tracing) printf("tracing to %s\n", trace_path);
+        else printf("not tracing\n");
+        return 0;
+    }
+    fprintf(stderr, "ERR: Usage: trace [on <file>|off]\n");
+    return 1;
+}
+
+// Most runs first, for choosing the labelled commands
+static int compare_command_runs(const void *a, const void *b) {
+    const CommandStats *x = a, *y = b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Write a Prometheus label value, escaping \\, " and newlines
+static void metrics_label(FILE *out, const char *value) {
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') fprintf(out, "\\%c", *value);
+        else if (*value == '\n') fputs("\\n", out);
+        else fputc(*value, out);
+    }
+}
+
+// Latency histogram of one command. Bucket counts come from the command's sketch,
+// each sketch bucket counted under the first bound at or above its midpoint
+static void metrics_histogram(FILE *out, const char *name, const CommandStats *stats) {
+    static const double bounds[] = {0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60, 300};
+    uint64_t counts[sizeof(bounds) / sizeof(bounds[0])] = {0};
+    int nbounds = (int)(sizeof(bounds) / sizeof(bounds[0]));
+
+    for (uint32_t b = 0; b < SKETCH_BUCKETS; b++) {
+        if (stats->sketch[b] == 0) continue;
+        double seconds = sketch_bucket_value(b) / 1e6;
+        for (int i = 0; i < nbounds; i++) {
+            if (seconds <= bounds[i]) {
+                counts[i] += stats->sketch[b];
+                break;
+            }
+        }
+    }
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i < nbounds; i++) {
+        cumulative += counts[i];
+        fprintf(out, "minishell_command_duration_seconds_bucket{command=\"");
+        metrics_label(out, name);
+        fprintf(out, "\",le=\"%g\"} %llu\n", bounds[i], (unsigned long long)cumulative);
+    }
+    fprintf(out, "minishell_command_duration_seconds_bucket{command=\"");
+    metrics_label(out, name);
+    fprintf(out, "\",le=\"+Inf\"} %u\n", stats->count);
+    fprintf(out, "minishell_command_duration_seconds_sum{command=\"");
+    metrics_label(out, name);
+    fprintf(out, "\"} %.6f\n", stats->total_us / 1e6);
+    fprintf(out, "minishell_command_duration_seconds_count{command=\"");
+    metrics_label(out, name);
+    fprintf(out, "\"} %u\n", stats->count);
+}
+
+// The Prometheus text exposition of the shell's metrics, in open_memstream's buffer:
+// release it with (free), which memstats does not intercept. Per-command series
+// are limited to the metrics_top_k most run commands, the rest summed as "other"
+char* metrics_render(size_t *length) {
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (out == NULL) return NULL;
+
+    CommandStats *snapshot = NULL;
+    int count = command_stats_snapshot(&snapshot);
+    qsort(snapshot, count, sizeof(CommandStats), compare_command_runs);
+
+    // Everything past the top K (including "(other)" itself) folds into one entry
+    CommandStats rest;
+    memset(&rest, 0, sizeof(rest));
+    rest.min_us = UINT64_MAX;
+    int labelled = count < metrics_top_k ? count : metrics_top_k;
+    for (int i = 0; i < count; i++) {
+        if (i < labelled && strcmp(snapshot[i].name, "(other)") != 0) continue;
+        rest.count += snapshot[i].count;
+        rest.failures += snapshot[i].failures;
+        rest.total_us += snapshot[i].total_us;
+        for (uint32_t b = 0; b < SKETCH_BUCKETS; b++) rest.sketch[b] += snapshot[i].sketch[b];
+    }
+
+    fprintf(out, "# HELP minishell_commands_total Commands that completed successfully.\n");
+    fprintf(out, "# TYPE minishell_commands_total counter\n");
+    fprintf(out, "minishell_commands_total %d\n", total_cmd_count);
+
+    fprintf(out, "# HELP minishell_command_runs_total Runs per command, successful or not.\n");
+    fprintf(out, "# TYPE minishell_command_runs_total counter\n");
+    for (int i = 0; i < labelled; i++) {
+        if (strcmp(snapshot[i].name, "(other)") == 0) continue;
+        fprintf(out, "minishell_command_runs_total{command=\"");
+        metrics_label(out, snapshot[i].name);
+        fprintf(out, "\"} %u\n", snapshot[i].count);
+    }
+    if (rest.count > 0) fprintf(out, "minishell_command_runs_total{command=\"other\"} %u\n", rest.count);
+
+    fprintf(out, "# HELP minishell_command_failures_total Runs that exited nonzero or were killed.\n");
+    fprintf(out, "# TYPE minishell_command_failures_total counter\n");
+    for (int i = 0; i < labelled; i++) {
+        if (strcmp(snapshot[i].name, "(other)") == 0) continue;
+        fprintf(out, "minishell_command_failures_total{command=\"");
+        metrics_label(out, snapshot[i].name);
+        fprintf(out, "\"} %u\n", snapshot[i].failures);
+    }
+    if (rest.count > 0) fprintf(out, "minishell_command_failures_total{command=\"other\"} %u\n", rest.failures);
+
+    fprintf(out, "# HELP minishell_command_duration_seconds Time from reading a command to its exit.\n");
+    fprintf(out, "# TYPE minishell_command_duration_seconds histogram\n");
+    for (int i = 0; i < labelled; i++) {
+        if (strcmp(snapshot[i].name, "(other)") != 0) metrics_histogram(out, snapshot[i].name, &snapshot[i]);
+    }
+    if (rest.count > 0) metrics_histogram(out, "other", &rest);
+    free(snapshot);
+
+    fprintf(out, "# HELP minishell_command_duration_max_seconds Longest successful command.\n");
+    fprintf(out, "# TYPE minishell_command_duration_max_seconds gauge\n");
+    fprintf(out, "minishell_command_duration_max_seconds %.6f\n", max_time);
+
+    fprintf(out, "# HELP minishell_dangerous_commands_blocked_total Commands refused by the blocklist.\n");
+    fprintf(out, "# TYPE minishell_dangerous_commands_blocked_total counter\n");
+    fprintf(out, "minishell_dangerous_commands_blocked_total %d\n", dangerous_cmd_blocked_count);
+    fprintf(out, "# HELP minishell_dangerous_commands_warned_total Commands run with a similarity warning.\n");
+    fprintf(out, "# TYPE minishell_dangerous_commands_warned_total counter\n");
+    fprintf(out, "minishell_dangerous_commands_warned_total %ld\n", danger_warned_total);
+
+    fprintf(out, "# HELP minishell_background_jobs Background commands not yet reaped.\n");
+    fprintf(out, "# TYPE minishell_background_jobs gauge\n");
+    int jobs = 0;
+    for (int i = 0; i < MAX_BACKGROUND_JOBS; i++) {
+        if (background_jobs[i].pid != 0) jobs++;
+    }
+    fprintf(out, "minishell_background_jobs %d\n", jobs);
+
+    fprintf(out, "# HELP minishell_matrix_operations_total mcalc operations by type.\n");
+    fprintf(out, "# TYPE minishell_matrix_operations_total counter\n");
+    fprintf(out, "minishell_matrix_operations_total{op=\"add\"} %d\n", matrix_stats.add_operations);
+    fprintf(out, "minishell_matrix_operations_total{op=\"sub\"} %d\n", matrix_stats.sub_operations);
+    fprintf(out, "# HELP minishell_matrix_errors_total mcalc operations that failed.\n");
+    fprintf(out, "# TYPE minishell_matrix_errors_total counter\n");
+    fprintf(out, "minishell_matrix_errors_total %d\n", matrix_stats.error_count);
+    fprintf(out, "# HELP minishell_matrices_processed_total Matrices given to mcalc.\n");
+    fprintf(out, "# TYPE minishell_matrices_processed_total counter\n");
+    fprintf(out, "minishell_matrices_processed_total %d\n", matrix_stats.total_matrices_processed);
+    fprintf(out, "# HELP minishell_matrix_max_elements Largest matrix seen, in elements.\n");
+    fprintf(out, "# TYPE minishell_matrix_max_elements gauge\n");
+    fprintf(out, "minishell_matrix_max_elements %d\n", matrix_stats.max_matrix_size);
+
+    // Resource peaks of the shell itself and of every child it has reaped
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    fprintf(out, "# HELP minishell_max_rss_bytes Peak resident set size.\n");
+    fprintf(out, "# TYPE minishell_max_rss_bytes gauge\n");
+    fprintf(out, "minishell_max_rss_bytes{process=\"shell\"} %lld\n", (long long)self.ru_maxrss * 1024);
+    fprintf(out, "minishell_max_rss_bytes{process=\"children\"} %lld\n", (long long)children.ru_maxrss * 1024);
+    fprintf(out, "# HELP minishell_cpu_seconds_total CPU time, user plus system.\n");
+    fprintf(out, "# TYPE minishell_cpu_seconds_total counter\n");
+    fprintf(out, "minishell_cpu_seconds_total{process=\"shell\"} %.6f\n",
+            self.ru_utime.tv_sec + self.ru_stime.tv_sec + (self.ru_utime.tv_usec + self.ru_stime.tv_usec) / 1e6);
+    fprintf(out, "minishell_cpu_seconds_total{process=\"children\"} %.6f\n",
+            children.ru_utime.tv_sec + children.ru_stime.tv_sec +
+            (children.ru_utime.tv_usec + children.ru_stime.tv_usec) / 1e6);
+
+    fclose(out);
+    return text;
+}
+
+// Start the endpoints the environment asks for: MINISHELL_METRICS_SOCKET=<path> serves
+// HTTP on a Unix socket, MINISHELL_METRICS_FILE=<file.prom> is rewritten every
+// MINISHELL_METRICS_INTERVAL seconds. MINISHELL_METRICS_TOP_K bounds the command labels
+void metrics_start(void) {
+    const char *env = getenv("MINISHELL_METRICS_TOP_K");
+    if (env && atoi(env) >= 0) metrics_top_k = atoi(env);
+
+    const char *socket_path = getenv("MINISHELL_METRICS_SOCKET");
+    if (socket_path && *socket_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "ERR: metrics socket path too long: %s\n", socket_path);
+        } else {
+            snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            unlink(socket_path);   // A socket file left by an earlier shell
+            if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0 ||
+                event_loop_add(fd, metrics_accept_handler) != 0) {
+                perror("Error starting metrics socket");
+                if (fd >= 0) close(fd);
+            } else {
+                metrics_listen_fd = fd;
+                snprintf(metrics_socket_path, sizeof(metrics_socket_path), "%s", socket_path);
+            }
+        }
+    }
+
+    metrics_file = getenv("MINISHELL_METRICS_FILE");
+    if (metrics_file && *metrics_file) {
+        env = getenv("MINISHELL_METRICS_INTERVAL");
+        int interval = env && atoi(env) > 0 ? atoi(env) : METRICS_INTERVAL;
+        struct itimerspec period = {{interval, 0}, {interval, 0}};
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0 || timerfd_settime(fd, 0, &period, NULL) != 0 ||
+            event_loop_add(fd, metrics_timer_handler) != 0) {
+            perror("Error starting metrics timer");
+            if (fd >= 0) close(fd);
+        } else {
+            metrics_timer_fd = fd;
+        }
+        metrics_write_textfile();
+    } else {
+        metrics_file = NULL;
+    }
+}
+
+// Write all of a buffer to a descriptor, giving up on a peer that stalls
+static int metrics_write_all(int fd, const char *data, size_t length, int timeout_ms) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n > 0) {
+            data += n;
+            length -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && timeout_ms > 0) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, timeout_ms) > 0) continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Answer one scrape: a minimal HTTP/1.0 responder for GET /metrics (or /)
+void metrics_accept_handler(int fd) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) return;
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    fcntl(client, F_SETFL, O_NONBLOCK);
+
+    // Read the request head; scrapers send it in one go
+    char request[METRICS_REQUEST_MAX + 1];
+    size_t used = 0;
+    while (used < METRICS_REQUEST_MAX) {
+        ssize_t n = read(client, request + used, METRICS_REQUEST_MAX - used);
+        if (n > 0) {
+            used += (size_t)n;
+            request[used] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        struct pollfd pfd = {client, POLLIN, 0};
+        if (n < 0 && errno == EAGAIN && poll(&pfd, 1, METRICS_IO_TIMEOUT_MS) > 0) continue;
+        break;
+    }
+    request[used] = '\0';
+
+    char head[256];
+    char *body = NULL;
+    size_t length = 0;
+    int found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+    if (found) body = metrics_render(&length);
+
+    if (body) {
+        snprintf(head, sizeof(head),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+        metrics_scrapes++;
+    } else {
+        const char *status = found ? "500 Internal Server Error" : (used == 0 ? NULL : "404 Not Found");
+        if (status == NULL) {
+            close(client);
+            return;
+        }
+        snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Length: 0\r\n\r\n", status);
+    }
+
+    if (metrics_write_all(client, head, strlen(head), METRICS_IO_TIMEOUT_MS) == 0 && body) {
+        metrics_write_all(client, body, length, METRICS_IO_TIMEOUT_MS);
+    }
+    (free)(body);
+    close(client);
+}
+
+// Timer tick: rewrite the textfile collector file
+void metrics_timer_handler(int fd) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    metrics_write_textfile();
+}
+
+// Replace the .prom file atomically: the collector sees the old file or the new one
+int metrics_write_textfile(void) {
+    if (metrics_file == NULL) return 0;
+
+    size_t length = 0;
+    char *body = metrics_render(&length);
+    if (body == NULL) return -1;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", metrics_file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int result = -1;
+    if (fd >= 0) {
+        result = metrics_write_all(fd, body, length, 0);
+        if (close(fd) != 0) result = -1;
+        if (result == 0 && rename(tmp, metrics_file) != 0) result = -1;
+        if (result != 0) unlink(tmp);
+    }
+    if (result != 0) perror("Error writing metrics file");
+    (free)(body);
+    return result;
+}
+
+// Final textfile write and socket removal at exit
+void metrics_shutdown(void) {
+    if (metrics_timer_fd >= 0) {
+        metrics_write_textfile();
+        close(metrics_timer_fd);
+        metrics_timer_fd = -1;
+    }
+    if (metrics_listen_fd >= 0) {
+        close(metrics_listen_fd);
+        unlink(metrics_socket_path);
+        metrics_listen_fd = -1;
+    }
+}
+
+// metrics: print what a scrape would return, and where the metrics are served
+int metrics_builtin(char **args, int args_len) {
+    (void)args;
+    if (args_len > 1) {
+        fprintf(stderr, "ERR: Usage: metrics\n");
+        return 1;
+    }
+
+    size_t length = 0;
+    char *body = metrics_render(&length);
+    if (body == NULL) {
+        fprintf(stderr, "ERR: Could not render metrics\n");
+        return 1;
+    }
+    fwrite(body, 1, length, stdout);
+    (free)(body);
+
+    if (metrics_listen_fd >= 0) printf("# served on %s (%ld scrapes)\n", metrics_socket_path, metrics_scrapes);
+    if (metrics_file) printf("# written to %s\n", metrics_file);
+    return 0;
+}
+
+// Report the time since the previous traced init step (--startup-trace)
+void startup_step(const char *name) {
+    if (!startup_trace) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "startup: %-20s %9.1f us\n", name, time_diff(startup_mark, now) * 1e6);
+    startup_mark = now;
+}
+
+// Report a subsystem that started after the first prompt, when it was first needed
+// (--startup-trace)
+void startup_first_use(const char *name, struct timespec begin) {
+    if (!startup_trace) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "startup: %s started on first use in %.3f ms\n", name, time_diff(begin, now) * 1000.0);
 }
 
 // Display the shell prompt with current statistics
 void prompt(void) {
-    printf("#cmd:%d|#dangerous_cmd_blocked:%d|last_cmd_time:%.5f|avg_time:%.5f|min_time:%.5f|max_time:%.5f>>",
-           total_cmd_count,
-           dangerous_cmd_blocked_count,
-           last_cmd_time,
-           average_time,
-           min_time,
-           max_time);
+    char prompt_text[256];
+    format_prompt(prompt_text, sizeof(prompt_text));
+    printf("%s", prompt_text);
     fflush(stdout);
 }
 
@@ -1097,9 +7230,35 @@ void update_min_max_time(double current_time, double *min_time, double *max_time
 
 // Main function - Shell implementation
 int main(int argc, char* argv[]) {
+    clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+    startup_mark = startup_begin;
+
+    // Benchmark mode: time blocklist lookups without starting the shell
+    if (argc == 2 && strcmp(argv[1], "--bench-policy") == 0) {
+        return bench_policy();
+    }
+
+    // Benchmark mode: time mapping and indexing the lines of a file
+    if (argc == 3 && strcmp(argv[1], "--bench-lines") == 0) {
+        return bench_lines(argv[2]);
+    }
+
+    // Compiler mode: index a text blocklist into a file the shell can map directly
+    if (argc == 4 && strcmp(argv[1], "--compile-blocklist") == 0) {
+        return compile_blocklist(argv[2], argv[3]);
+    }
+
+    // Report where the time to the first prompt goes
+    if (argc >= 2 && strcmp(argv[1], "--startup-trace") == 0) {
+        startup_trace = 1;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     // Validate command line arguments
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <dangerous_commands_file> <log_file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--startup-trace] <dangerous_commands_file> <log_file>\n", argv[0]);
         exit(1);
     }
     current_command[0] = '\0';
@@ -1111,23 +7270,53 @@ int main(int argc, char* argv[]) {
     char right_cmd[MAX_INPUT_LENGTH];
     pid_t right_pid = 0;
 
-    // Load dangerous commands list
-    Danger_CMD = read_file_lines(input_file, &numLines);
-    if (Danger_CMD == NULL) {
+    startup_step("arguments");
+
+    // The dangerous commands list is indexed by the first command checked against it
+    // (policy_ensure_loaded); only make sure it can be read
+    if (access(input_file, R_OK) != 0) {
+        perror(input_file);
         fprintf(stderr, "Failed to load dangerous commands\n");
         exit(1);
     }
+    startup_step("blocklist check");
 
-    // Clear the log file
-    {
-        FILE *clear = fopen(argv[2], "w");
-        if (clear) fclose(clear);
+    // Re-read the list whenever it changes on disk
+    if (policy_watch_start(input_file) != 0) {
+        snprintf(policy_path, sizeof(policy_path), "%s", input_file);
     }
+    startup_step("blocklist watch");
+
+    // The persistent history is mapped the first time it is used (history_open)
+
+    // Logs are written by a background thread, started once the first record is queued,
+    // which truncates a text command log on its first record and appends to a binary
+    // one (MINISHELL_LOG_FORMAT=binary)
+    log_start(output_file);
+    startup_step("log config");
+
+    // Live counters for shtop and other monitors
+    shm_stats_open();
+    startup_step("shared counters");
+
+    // Counters attached to every child (MINISHELL_PERF=off|software) are probed for
+    // on the first spawn (perf_sync_open)
+
+    // Prometheus socket and textfile, when configured
+    metrics_start();
+    startup_step("metrics");
 
     // Set up signal handlers
     signal(SIGCHLD, sigchld_handler);
     signal(SIGXCPU, sigxcpu_handler);
     signal(SIGXFSZ, sigxfsz_handler);
+    startup_step("signals");
+
+    if (startup_trace) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fprintf(stderr, "startup: %-20s %9.1f us\n", "total to first prompt", time_diff(startup_begin, now) * 1e6);
+    }
 
     // Main command processing loop
     while (1) {
@@ -1135,17 +7324,32 @@ int main(int argc, char* argv[]) {
         l_args = NULL;
         r_args = NULL;
         pip_flag = 0;
-
+        right_pid = 0;
+        history_current = -1;
+        free_redirections(&l_redir);
+        free_redirections(&r_redir);
+
+        command_running = 0;
+        log_writer_ensure();
+        shm_stats_publish();
+        memstats_line_done();
         prompt();
 
         // Get user input
-        get_string(userInput, sizeof(userInput));
+        read_input_line(userInput, sizeof(userInput));
+        policy_sync();
         clock_gettime(CLOCK_MONOTONIC, &start);
+        int64_t parse_begin = trace_now();
 
         // Skip empty input
         if (userInput[0] == '\0') {
             continue;
         }
+
+        // Expand !!, !n and !prefix history events
+        if (expand_history(userInput, sizeof(userInput)) != 0) {
+            continue;
+        }
         strcpy(current_command, userInput);
 
         // Clean up input
@@ -1157,79 +7361,176 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
-        // Split input for pipe
-        pip_flag = pipe_split(userInput, left_cmd, right_cmd);
-        trim_inplace(left_cmd);
-        trim_inplace(right_cmd);
-        //check if the command is mcalc
-        if (strncmp(left_cmd, "mcalc ", 6) == 0){
-            mcalc_handler(left_cmd);
+        history_current = history_append(userInput);
+        PROBE2(command_accepted, userInput, history_current);
+
+        // Reuse the parse and danger verdicts of an identical earlier line
+        ParsedCommand *cached = cmd_cache_lookup(userInput);
+        int l_verdict = DANGER_ALLOW, r_verdict = DANGER_ALLOW;
+        DangerMatch l_match = {NULL, -1, NULL, 0, 0}, r_match = {NULL, -1, NULL, 0, 0};
+
+        if (cached) {
+            pip_flag = cached->pip_flag;
+            l_args = dup_args(cached->l_args);
+            l_args_len = cached->l_args_len;
+            r_args = dup_args(cached->r_args);
+            r_args_len = cached->r_args_len;
+            copy_redirections(&l_redir, &cached->l_redir);
+            copy_redirections(&r_redir, &cached->r_redir);
+            l_verdict = cached->l_verdict;
+            l_match = cached->l_match;
+            r_verdict = cached->r_verdict;
+            r_match = cached->r_match;
+            trace_span("shell", "parse (cached)", parse_begin, 0, 0, current_command);
+        } else {
+            // Split input for pipe
+            pip_flag = pipe_split(userInput, left_cmd, right_cmd);
+            trim_inplace(left_cmd);
+            trim_inplace(right_cmd);
+            //check if the command is mcalc
+            if (strncmp(left_cmd, "mcalc ", 6) == 0){
+                int64_t mcalc_begin = trace_now();
+                memstats_mcalc_begin();
+                mcalc_handler(left_cmd);
+                memstats_mcalc_end();
+                trace_span("mcalc", "mcalc", mcalc_begin, 0, 0, current_command);
 
-            continue;
-        }
-        // Split into arguments
-        l_args = split_to_args(left_cmd, delim, &l_args_len);
-        r_args = split_to_args(right_cmd, delim, &r_args_len);
+                continue;
+            }
+            // Split into arguments
+            l_args = split_to_args(left_cmd, delim, &l_args_len);
+            r_args = split_to_args(right_cmd, delim, &r_args_len);
 
-        // Validate arguments
-        if (l_args == NULL || (r_args == NULL && pip_flag)) {
-            free_args(l_args);
-            free_args(r_args);
-            l_args = NULL;
-            r_args = NULL;
-            continue;
-        }
+            // Validate arguments
+            if (l_args == NULL || (r_args == NULL && pip_flag)) {
+                free_args(l_args);
+                free_args(r_args);
+                l_args = NULL;
+                r_args = NULL;
+                continue;
+            }
 
-        // Handle exit command
-        if (l_args_len > 0 && l_args[0] && strcmp(l_args[0], "done") == 0) {
-            free_args(l_args);
-            free_args(r_args);
-            free_args(Danger_CMD);
-            printf("%d\n", dangerous_cmd_blocked_count + semi_dangerous_cmd_count);
-            return 0;
-        }
+            // Pull <, >, >>, 2>, 2>> and 2>&1 out of the arguments
+            if (parse_redirections(l_args, &l_args_len, &l_redir) != 0 ||
+                parse_redirections(r_args, &r_args_len, &r_redir) != 0 ||
+                l_args_len == 0 || (pip_flag && r_args_len == 0)) {
+                free_args(l_args);
+                free_args(r_args);
+                l_args = NULL;
+                r_args = NULL;
+                continue;
+            }
 
-        // Handle resource limits
-        if (l_args_len > 0 && l_args[0] && strcmp(l_args[0], "rlimit") == 0) {
-            char **new_cmd = check_rsc_lmt(l_args, &l_args_len);
-            if (new_cmd != NULL) {
+            // Handle exit command
+            if (l_args_len > 0 && l_args[0] && strcmp(l_args[0], "done") == 0) {
                 free_args(l_args);
-                l_args = new_cmd;
-            } else {
+                free_args(r_args);
+                policy_shutdown();
+                cmd_cache_flush();
+                verdict_cache_flush();
+                history_close();
+                log_shutdown();
+                shm_stats_close();
+                metrics_shutdown();
+                if (tracing) trace_stop();
+                trie_free(&command_trie);
+                free_redirections(&l_redir);
+                free_redirections(&r_redir);
+                printf("%d\n", dangerous_cmd_blocked_count + semi_dangerous_cmd_count);
+                return 0;
+            }
+
+            // Handle builtin commands
+            const BuiltinCommand *builtin = find_builtin_command(l_args[0]);
+            if (builtin != NULL && !pip_flag) {
+                int saved_fds[3];
+                if (save_and_apply_redirections(&l_redir, saved_fds) == 0) {
+                    int64_t builtin_begin = trace_now();
+                    builtin->handler(l_args, l_args_len);
+                    trace_span("shell", "builtin", builtin_begin, 0, 0, l_args[0]);
+                    restore_redirections(saved_fds);
+                }
                 free_args(l_args);
                 free_args(r_args);
                 l_args = NULL;
                 r_args = NULL;
                 continue;
             }
-        }
 
-        if (pip_flag && r_args_len > 0 && r_args[0] && strcmp(r_args[0], "rlimit") == 0) {
-            char **new_cmd = check_rsc_lmt(r_args, &r_args_len);
-            if (new_cmd != NULL) {
-                free_args(r_args);
-                r_args = new_cmd;
-            } else {
+            // Handle resource limits (setrlimit has side effects, so these lines are never cached)
+            int cacheable = 1;
+            if (l_args_len > 0 && l_args[0] && strcmp(l_args[0], "rlimit") == 0) {
+                cacheable = 0;
+                char **new_cmd = check_rsc_lmt(l_args, &l_args_len);
+                if (new_cmd != NULL) {
+                    free_args(l_args);
+                    l_args = new_cmd;
+                } else {
+                    free_args(l_args);
+                    free_args(r_args);
+                    l_args = NULL;
+                    r_args = NULL;
+                    continue;
+                }
+            }
+
+            if (pip_flag && r_args_len > 0 && r_args[0] && strcmp(r_args[0], "rlimit") == 0) {
+                cacheable = 0;
+                char **new_cmd = check_rsc_lmt(r_args, &r_args_len);
+                if (new_cmd != NULL) {
+                    free_args(r_args);
+                    r_args = new_cmd;
+                } else {
+                    free_args(l_args);
+                    free_args(r_args);
+                    l_args = NULL;
+                    r_args = NULL;
+                    continue;
+                }
+            }
+
+            // Check argument count
+            if (l_args_len > MAX_ARGC || r_args_len > MAX_ARGC) {
+                printf("ERR_ARGS\n");
                 free_args(l_args);
                 free_args(r_args);
                 l_args = NULL;
                 r_args = NULL;
                 continue;
             }
+
+            // Security check
+            trace_span("shell", "parse", parse_begin, 0, 0, current_command);
+            int64_t check_begin = trace_now();
+            l_verdict = classify_dangerous_command(l_args, l_args_len, &l_match);
+            if (l_verdict != DANGER_BLOCK && r_args) {
+                r_verdict = classify_dangerous_command(r_args, r_args_len, &r_match);
+            }
+            trace_span("shell", "danger check", check_begin, 0, 0, NULL);
+
+            if (cacheable) {
+                cmd_cache_store(userInput, pip_flag, l_args, l_args_len, r_args, r_args_len,
+                                &l_redir, &r_redir, l_verdict, &l_match, r_verdict, &r_match);
+            }
         }
 
-        // Check argument count
-        if (l_args_len > MAX_ARGC || r_args_len > MAX_ARGC) {
-            printf("ERR_ARGS\n");
-            free_args(l_args);
-            free_args(r_args);
-            l_args = NULL;
-            r_args = NULL;
-            continue;
+        // Expand *, ?, [...] and ** patterns, then check what they expanded to as well:
+        // the verdicts above (and in the cache) are for the words as typed, while the
+        // expansion depends on the files present now
+        int l_globs = args_have_globs(l_args);
+        int r_globs = args_have_globs(r_args);
+        l_args = expand_globs(l_args, &l_args_len);
+        r_args = expand_globs(r_args, &r_args_len);
+        if (l_globs || r_globs) {
+            int64_t check_begin = trace_now();
+            if (l_globs) classify_expanded_command(l_args, l_args_len, &l_verdict, &l_match);
+            if (r_globs && l_verdict != DANGER_BLOCK) {
+                classify_expanded_command(r_args, r_args_len, &r_verdict, &r_match);
+            }
+            trace_span("shell", "danger check", check_begin, 0, 0, NULL);
         }
 
-        // Security check
-        if (is_dangerous_command(l_args, l_args_len)) {
+        if (report_danger_verdict(l_verdict, &l_match)) {
             free_args(l_args);
             free_args(r_args);
             l_args = NULL;
@@ -1237,7 +7538,7 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
-        if (r_args && is_dangerous_command(r_args, r_args_len)) {
+        if (r_args && report_danger_verdict(r_verdict, &r_match)) {
             free_args(l_args);
             free_args(r_args);
             l_args = NULL;
@@ -1254,6 +7555,12 @@ int main(int argc, char* argv[]) {
             l_args_len--;                  // Decrease arg count
         }
 
+        // Names the runs are counted under by `stats`
+        char left_name[COMMAND_STATS_NAME] = "";
+        char right_name[COMMAND_STATS_NAME] = "";
+        if (l_args && l_args[0]) canonical_command_name(l_args[0], left_name, sizeof(left_name));
+        if (r_args && r_args[0]) canonical_command_name(r_args[0], right_name, sizeof(right_name));
+
         // Create pipe
         if (pipe(pipefd) == -1) {
             perror("pipe creation failed");
@@ -1265,7 +7572,34 @@ int main(int argc, char* argv[]) {
         }
 
         // Execute left command
+        // A background command is registered before its SIGCHLD can be handled
+        sigset_t chld_set, saved_mask;
+        sigemptyset(&chld_set);
+        sigaddset(&chld_set, SIGCHLD);
+        if (background_flag) sigprocmask(SIG_BLOCK, &chld_set, &saved_mask);
+
+        // Each child waits on perf_sync until its counters are attached
+        int perf_sync[2];
+        PerfGroup left_perf, right_perf;
+        right_perf.kind = 0;
+        perf_sync_open(perf_sync);
+
+        int64_t spawn_begin = trace_now();
         left_pid = fork();
+        if (left_pid != 0) perf_attach(left_pid, perf_sync, &left_perf);
+        int64_t left_started = trace_now();
+        int64_t right_started = 0;
+        trace_span("shell", "spawn", spawn_begin, 0, 0, left_name);
+        if (left_pid > 0) PROBE3(spawn, left_pid, left_name, background_flag);
+        if (left_pid > 0 && background_flag) {
+            background_job_add(left_pid, &start, left_name, current_command, &left_perf);
+        }
+        if (background_flag && left_pid != 0) sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        if (left_pid > 0) {
+            command_running = !background_flag;
+            shm_stats_publish();
+        }
+
         if (left_pid < 0) {
             if (errno == EAGAIN) {
                 fprintf(stderr, "Process creation limit exceeded!\n");
@@ -1283,7 +7617,8 @@ int main(int argc, char* argv[]) {
 
         if (left_pid == 0) {
             // Child process for left command
-            check_and_redirect_stderr(l_args);
+            perf_sync_wait(perf_sync);
+            if (background_flag) sigprocmask(SIG_SETMASK, &saved_mask, NULL);
 
             // Set up signal handlers
             signal(SIGXCPU, sigxcpu_handler);
@@ -1298,6 +7633,7 @@ int main(int argc, char* argv[]) {
                 // No pipe, just execute the command
                 close(pipefd[0]);
                 close(pipefd[1]);
+                if (apply_redirections(&l_redir) != 0) exit(1);
                 handle_execvp_errors_in_child(l_args);
             }
 
@@ -1313,6 +7649,7 @@ int main(int argc, char* argv[]) {
 
             close(pipefd[0]);
             close(pipefd[1]);
+            if (apply_redirections(&l_redir) != 0) exit(1);
             handle_execvp_errors_in_child(l_args);
         }
 
@@ -1330,17 +7667,30 @@ int main(int argc, char* argv[]) {
                         printf("ERR: Not enough arguments for %s\n", cmd->name);
                     } else {
                         // Execute the custom command handler
-                        cmd->handler();
+                        int saved_fds[3];
+                        if (save_and_apply_redirections(&r_redir, saved_fds) == 0) {
+                            cmd->handler();
+                            restore_redirections(saved_fds);
+                        }
                     }
                 } else {
                     // Standard pipe to external command
+                    perf_sync_open(perf_sync);
+                    spawn_begin = trace_now();
                     right_pid = fork();
+                    if (right_pid != 0) perf_attach(right_pid, perf_sync, &right_perf);
+                    right_started = trace_now();
+                    if (right_pid > 0) {
+                        trace_span("shell", "spawn", spawn_begin, 0, 0, right_name);
+                        PROBE3(spawn, right_pid, right_name, 0);
+                    }
                     if (right_pid < 0) {
                         if (errno == EAGAIN) {
                             fprintf(stderr, "Process creation limit exceeded!\n");
                         } else {
                             perror("Fork Failed");
                         }
+                        perf_group_close(&left_perf);
                         free_args(l_args);
                         free_args(r_args);
                         l_args = NULL;
@@ -1351,6 +7701,7 @@ int main(int argc, char* argv[]) {
                     }
 
                     if (right_pid == 0) {
+                        perf_sync_wait(perf_sync);
                         signal(SIGCHLD, sigchld_handler);
 
                         char **cmd2 = check_rsc_lmt(r_args, &r_args_len);
@@ -1369,6 +7720,7 @@ int main(int argc, char* argv[]) {
 
                         close(pipefd[1]);
                         close(pipefd[0]);
+                        if (apply_redirections(&r_redir) != 0) exit(1);
                         handle_execvp_errors_in_child(r_args);
                     }
                 }
@@ -1380,17 +7732,91 @@ int main(int argc, char* argv[]) {
         close(pipefd[1]);
 
         // Wait for child processes to complete
+        struct rusage left_usage, right_usage;
+        struct timespec left_done, right_done;
+        memset(&left_usage, 0, sizeof(left_usage));
+        memset(&right_usage, 0, sizeof(right_usage));
+        int64_t wait_begin = trace_now();
         if (pip_flag) {
-            waitpid(left_pid, &left_status, 0);
+            wait4(left_pid, &left_status, 0, &left_usage);
+            clock_gettime(CLOCK_MONOTONIC, &left_done);
+            trace_span("process", "process", left_started, left_pid, 0, left_name);
             if (right_pid > 0) {
-                waitpid(right_pid, &right_status, 0);
+                wait4(right_pid, &right_status, 0, &right_usage);
+                clock_gettime(CLOCK_MONOTONIC, &right_done);
+                trace_span("process", "process", right_started, right_pid, 0, right_name);
             }
         } else {
-            if (!background_flag)
-                waitpid(left_pid, &left_status, 0);
+            if (!background_flag) {
+                wait4(left_pid, &left_status, 0, &left_usage);
+                clock_gettime(CLOCK_MONOTONIC, &left_done);
+                trace_span("process", "process", left_started, left_pid, 0, left_name);
+            }
+        }
+        if (!background_flag) trace_span("shell", "wait", wait_begin, 0, 0, current_command);
+
+        // Counters of the reaped children; a background child's are read by the handler
+        PerfCounts left_counts, right_counts;
+        memset(&left_counts, 0, sizeof(left_counts));
+        memset(&right_counts, 0, sizeof(right_counts));
+        if (!background_flag) perf_group_read(&left_perf, &left_counts);
+        perf_group_read(&right_perf, &right_counts);
+
+        // Per-command statistics: each side of a pipeline counts from the line
+        // being read to its own exit
+        if (!background_flag) {
+            int64_t left_ns = (int64_t)(left_done.tv_sec - start.tv_sec) * 1000000000LL +
+                              (left_done.tv_nsec - start.tv_nsec);
+            PROBE3(reaped, left_pid, left_status, left_ns);
+            sigprocmask(SIG_BLOCK, &chld_set, &saved_mask);
+            command_stats_record(left_name, left_ns, left_status, &left_counts);
+            if (pip_flag && right_pid > 0) {
+                int64_t right_ns = (int64_t)(right_done.tv_sec - start.tv_sec) * 1000000000LL +
+                                   (right_done.tv_nsec - start.tv_nsec);
+                PROBE3(reaped, right_pid, right_status, right_ns);
+                command_stats_record(right_name, right_ns, right_status, &right_counts);
+            }
+            sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        }
+
+        // Structured log: every foreground command, whatever its exit status
+        if (!background_flag && log_format == LOG_FORMAT_BINARY) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t duration = (int64_t)(now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec);
+
+            if (pip_flag && right_pid > 0) {
+                // Both sides ran at once: add up their CPU time and faults, keep the larger RSS
+                timeradd(&left_usage.ru_utime, &right_usage.ru_utime, &left_usage.ru_utime);
+                timeradd(&left_usage.ru_stime, &right_usage.ru_stime, &left_usage.ru_stime);
+                if (right_usage.ru_maxrss > left_usage.ru_maxrss) left_usage.ru_maxrss = right_usage.ru_maxrss;
+                left_usage.ru_minflt += right_usage.ru_minflt;
+                left_usage.ru_majflt += right_usage.ru_majflt;
+                left_usage.ru_nvcsw += right_usage.ru_nvcsw;
+                left_usage.ru_nivcsw += right_usage.ru_nivcsw;
+                if (left_counts.kind == right_counts.kind) {
+                    for (int i = 0; i < PERF_COUNTERS; i++) left_counts.values[i] += right_counts.values[i];
+                } else {
+                    left_counts.kind = 0;
+                }
+                log_command_record(current_command, duration, EXECLOG_F_PIPE, left_pid, left_status,
+                                   right_pid, right_status, &left_usage, &left_counts);
+            } else {
+                log_command_record(current_command, duration, 0, left_pid, left_status, 0, 0, &left_usage,
+                                   &left_counts);
+            }
+        }
 
-            background_flag = 0; // Reset background flag
+        // Record how the command ended in its history entry
+        if (!background_flag && history_current >= 0) {
+            int status = (pip_flag && right_pid > 0) ? right_status : left_status;
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            history_set_result(history_current,
+                               WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status),
+                               time_diff(start, now));
         }
+        background_flag = 0; // Reset background flag
 
         // Clean up argument arrays
         free_args(l_args);
@@ -1798,7 +8224,9 @@ void mcalc_handler(char *input) {
     }
 
     // Use hierarchical calculation with threads
+    PROBE4(mcalc_begin, operation, matrix_count, matrices[0].rows, matrices[0].cols);
     Matrix result = hierarchical_matrix_calculation(matrices, matrix_count, operation);
+    PROBE4(mcalc_end, operation, result.data != NULL, result.rows, result.cols);
 
     // Check if calculation succeeded
     if (!result.data) {
@@ -1835,6 +8263,8 @@ typedef struct {
 // Thread function for matrix operations
 void* matrix_thread_operation(void* arg) {
     ThreadData* data = (ThreadData*)arg;
+    int64_t trace_begin = trace_now();
+    trace_thread_name("mcalc worker");
 
     // Allocate memory for result matrix
     data->result->rows = data->matrix1->rows;
@@ -1862,6 +8292,8 @@ void* matrix_thread_operation(void* arg) {
         }
     }
 
+    trace_span("mcalc", "matrix_thread_operation", trace_begin, 0, data->result->rows * data->result->cols,
+               data->operation);
     pthread_exit(NULL);
 }
 
@@ -1922,8 +8354,10 @@ Matrix hierarchical_matrix_calculation(Matrix* matrices, int matrix_count, char*
 
     // Start hierarchical processing
     int current_count = matrix_count;
+    int level = 0;
 
     while (current_count > 1) {
+        int64_t level_begin = trace_now();
         int pairs = current_count / 2;
         int next_count = pairs + (current_count % 2);
         Matrix* next_level = malloc(sizeof(Matrix) * next_count);
@@ -2008,6 +8442,7 @@ Matrix hierarchical_matrix_calculation(Matrix* matrices, int matrix_count, char*
         // Free thread resources
         free(thread_data);
         free(threads);
+        trace_span("mcalc", "reduction level", level_begin, 0, ++level, operation);
     }
 
     // At this point, working_matrices has only one matrix - the final result
@@ -0,0 +1,51 @@
+// Live counters a running shell publishes in POSIX shared memory, one segment per
+// shell named SHMSTATS_PREFIX<pid> (/dev/shm/minishell.<pid>). Shared by the shell
+// (shitTest.c), which writes it, and shtop.c, which reads every segment on the host.
+//
+// The counters are guarded by a seqlock: the shell makes seq odd, updates the fields and
+// makes it even again, with plain memory writes only. A reader copies the fields between
+// two reads of seq and retries if seq was odd or changed in between.
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+
+#define SHMSTATS_MAGIC "MSHSTAT1"
+#define SHMSTATS_VERSION 1               // Bump on any layout change
+#define SHMSTATS_PREFIX "minishell."     // Segment name after the leading '/'
+
+// Counter snapshot, copied as a whole under the seqlock
+typedef struct {
+    int64_t updated_ns;                  // CLOCK_REALTIME of the last update
+    int32_t total_cmd_count;             // Successful commands
+    int32_t dangerous_cmd_blocked_count;
+    int32_t semi_dangerous_cmd_count;    // Allowed with a warning
+    int32_t command_running;             // 1 while a foreground command runs
+    int32_t background_jobs;             // Background commands not yet reaped
+    int32_t reserved;
+    double last_cmd_time;                // Seconds, as in the prompt
+    double average_time;
+    double min_time;
+    double max_time;
+    double total_time;
+    int32_t matrix_operations;           // MatrixStats
+    int32_t matrix_errors;
+    int32_t matrices_processed;
+    int32_t max_matrix_size;
+    int32_t matrix_add_operations;
+    int32_t matrix_sub_operations;
+} ShellCounters;
+
+// The whole segment
+typedef struct {
+    char magic[8];                       // SHMSTATS_MAGIC
+    uint32_t version;
+    uint32_t size;                       // sizeof(ShellStatsSegment)
+    int32_t pid;
+    int32_t reserved;
+    int64_t started_ns;                  // CLOCK_REALTIME when the shell started
+    uint64_t seq;                        // Odd while the shell is writing counters
+    ShellCounters counters;
+} ShellStatsSegment;
+
+#endif
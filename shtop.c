@@ -0,0 +1,183 @@
+// shtop - live counters of every shell running on this host
+//
+//   gcc -O2 -o shtop shtop.c
+//   shtop [-i seconds] [-c]
+//
+// Reads the shared-memory segments the shells publish (shmstats.h): one line per
+// shell and a total line. With -i the screen is redrawn every interval; -c removes
+// segments left behind by shells that are no longer running.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "shmstats.h"
+
+/**** CONSTANTS ****/
+#define SHM_DIR "/dev/shm"
+#define MAX_SHELLS 1024
+#define SNAPSHOT_RETRIES 1000        // Reads of a segment before giving up on a busy writer
+
+/**** TYPES ****/
+// One shell's snapshot
+typedef struct {
+    int32_t pid;
+    int64_t started_ns;
+    ShellCounters counters;
+} ShellSnapshot;
+
+/**** FUNCTION PROTOTYPES ****/
+int read_segment(const char *name, ShellSnapshot *out, int clean);
+int snapshot_counters(const ShellStatsSegment *seg, ShellCounters *out);
+int collect_shells(ShellSnapshot *shells, int max, int clean, int *stale);
+void print_shells(const ShellSnapshot *shells, int count, int stale);
+
+// Parse options and print once, or every interval until interrupted
+int main(int argc, char *argv[]) {
+    double interval = 0;
+    int clean = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:c")) != -1) {
+        if (opt == 'i') interval = strtod(optarg, NULL);
+        else if (opt == 'c') clean = 1;
+        else {
+            fprintf(stderr, "Usage: %s [-i seconds] [-c]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static ShellSnapshot shells[MAX_SHELLS];
+    for (;;) {
+        int stale = 0;
+        int count = collect_shells(shells, MAX_SHELLS, clean, &stale);
+        if (count < 0) return 1;
+
+        if (interval > 0) printf("\033[H\033[2J");
+        print_shells(shells, count, stale);
+        fflush(stdout);
+        if (interval <= 0) return 0;
+
+        struct timespec wait = {(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+        nanosleep(&wait, NULL);
+    }
+}
+
+// Read every shell's segment; returns how many were read
+int collect_shells(ShellSnapshot *shells, int max, int clean, int *stale) {
+    DIR *dir = opendir(SHM_DIR);
+    if (dir == NULL) {
+        perror(SHM_DIR);
+        return -1;
+    }
+
+    int count = 0;
+    size_t prefix_len = strlen(SHMSTATS_PREFIX);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < max) {
+        if (strncmp(entry->d_name, SHMSTATS_PREFIX, prefix_len) != 0) continue;
+
+        int result = read_segment(entry->d_name, &shells[count], clean);
+        if (result == 0) count++;
+        else if (result == 1) (*stale)++;
+    }
+    closedir(dir);
+    return count;
+}
+
+// Map one segment and take a snapshot. Returns 0 on success, 1 if its shell is gone
+// and -1 if it could not be read
+int read_segment(const char *name, ShellSnapshot *out, int clean) {
+    char path[300];
+    snprintf(path, sizeof(path), "/%s", name);
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ShellStatsSegment)) {
+        close(fd);
+        return -1;
+    }
+    const ShellStatsSegment *seg = mmap(NULL, sizeof(ShellStatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) return -1;
+
+    int result = -1;
+    if (memcmp(seg->magic, SHMSTATS_MAGIC, sizeof(seg->magic)) != 0 || seg->version != SHMSTATS_VERSION) {
+        result = -1;
+    } else if (kill(seg->pid, 0) != 0 && errno == ESRCH) {
+        // The shell died without removing its segment
+        if (clean) shm_unlink(path);
+        result = 1;
+    } else if (snapshot_counters(seg, &out->counters) == 0) {
+        out->pid = seg->pid;
+        out->started_ns = seg->started_ns;
+        result = 0;
+    }
+
+    munmap((void*)seg, sizeof(ShellStatsSegment));
+    return result;
+}
+
+// Copy the counters under the segment's seqlock: retry while the shell is writing
+// (odd sequence) or wrote while we were copying (sequence changed)
+int snapshot_counters(const ShellStatsSegment *seg, ShellCounters *out) {
+    for (int attempt = 0; attempt < SNAPSHOT_RETRIES; attempt++) {
+        uint64_t before = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+
+        memcpy(out, (const void*)&seg->counters, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == before) return 0;
+    }
+    return -1;
+}
+
+// One line per shell, then the totals across all of them
+void print_shells(const ShellSnapshot *shells, int count, int stale) {
+    ShellCounters total;
+    memset(&total, 0, sizeof(total));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    printf("%8s %9s %8s %7s %6s %4s %4s %10s %10s %10s %10s %7s %6s\n", "pid", "uptime", "cmds", "blocked",
+           "warned", "run", "bg", "last", "avg", "min", "max", "matrix", "m.err");
+    for (int i = 0; i < count; i++) {
+        const ShellCounters *c = &shells[i].counters;
+        printf("%8d %8.0fs %8d %7d %6d %4d %4d %10.5f %10.5f %10.5f %10.5f %7d %6d\n", shells[i].pid,
+               (now_ns - shells[i].started_ns) / 1e9, c->total_cmd_count, c->dangerous_cmd_blocked_count,
+               c->semi_dangerous_cmd_count, c->command_running, c->background_jobs, c->last_cmd_time,
+               c->average_time, c->min_time, c->max_time, c->matrix_operations, c->matrix_errors);
+
+        total.total_cmd_count += c->total_cmd_count;
+        total.dangerous_cmd_blocked_count += c->dangerous_cmd_blocked_count;
+        total.semi_dangerous_cmd_count += c->semi_dangerous_cmd_count;
+        total.command_running += c->command_running;
+        total.background_jobs += c->background_jobs;
+        total.total_time += c->total_time;
+        if (c->total_cmd_count > 0 && (total.min_time <= 0 || c->min_time < total.min_time)) {
+            total.min_time = c->min_time;
+        }
+        if (c->max_time > total.max_time) total.max_time = c->max_time;
+        total.matrix_operations += c->matrix_operations;
+        total.matrix_errors += c->matrix_errors;
+    }
+
+    printf("%8s %9s %8d %7d %6d %4d %4d %10s %10.5f %10.5f %10.5f %7d %6d\n", "total", "",
+           total.total_cmd_count, total.dangerous_cmd_blocked_count, total.semi_dangerous_cmd_count,
+           total.command_running, total.background_jobs, "",
+           total.total_cmd_count ? total.total_time / total.total_cmd_count : 0.0,
+           total.min_time, total.max_time, total.matrix_operations, total.matrix_errors);
+    printf("%d shell%s", count, count == 1 ? "" : "s");
+    if (stale > 0) printf(", %d stale segment%s%s", stale, stale == 1 ? "" : "s", " (shtop -c removes them)");
+    printf("\n");
+}